@@ -0,0 +1,508 @@
+// Common harness for the MPI benchmarks: command line options, timing of
+// repeated operations, statistics over ranks and repetitions, and output
+// as a plain table, CSV or JSON.
+
+#ifndef __BENCH_HPP__
+#define __BENCH_HPP__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <mpi.h>
+#ifdef BENCH_TRACE
+#include "trace.h"
+#endif
+
+namespace bench {
+
+// Command line options of the form --key=value or --key value.
+// Every lookup registers the option, so that --help can list them.
+class Args {
+public:
+    Args(int argc, char **argv) : program(argv[0]) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0) {
+                bad.push_back(arg);
+                continue;
+            }
+            arg = arg.substr(2);
+            auto eq = arg.find('=');
+            if (eq != std::string::npos) {
+                values[arg.substr(0, eq)] = arg.substr(eq + 1);
+            } else if (i + 1 < argc && std::string(argv[i + 1]).compare(0, 2, "--") != 0) {
+                values[arg] = argv[++i];
+            } else {
+                values[arg] = "1";
+            }
+        }
+    }
+
+    std::string get(const std::string &key, const std::string &def,
+                    const std::string &help) {
+        known.push_back({key, def, help});
+        auto it = values.find(key);
+        return it == values.end() ? def : it->second;
+    }
+
+    long get_int(const std::string &key, long def, const std::string &help) {
+        return std::atol(get(key, std::to_string(def), help).c_str());
+    }
+
+    double get_double(const std::string &key, double def, const std::string &help) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%g", def);
+        return std::atof(get(key, buf, help).c_str());
+    }
+
+    std::vector<std::string> get_list(const std::string &key, const std::string &def,
+                                      const std::string &help) {
+        std::vector<std::string> items;
+        std::string s = get(key, def, help);
+        size_t start = 0;
+        while (start <= s.size()) {
+            auto end = s.find(',', start);
+            if (end == std::string::npos)
+                end = s.size();
+            if (end > start)
+                items.push_back(s.substr(start, end - start));
+            start = end + 1;
+        }
+        return items;
+    }
+
+    // Call after all options are looked up. Prints usage and returns false
+    // if --help was given or an unknown option was found.
+    bool finish(int rank) {
+        std::vector<std::string> unknown = bad;
+        for (auto &kv : values) {
+            if (kv.first == "help")
+                continue;
+            bool found = false;
+            for (auto &opt : known)
+                found = found || opt.key == kv.first;
+            if (!found)
+                unknown.push_back("--" + kv.first);
+        }
+        if (values.count("help") == 0 && unknown.empty())
+            return true;
+        if (0 == rank) {
+            for (auto &u : unknown)
+                fprintf(stderr, "Unknown option %s\n", u.c_str());
+            fprintf(stderr, "Usage: %s [options]\n", program.c_str());
+            for (auto &opt : known)
+                fprintf(stderr, "  --%-14s %s (default: %s)\n", opt.key.c_str(),
+                        opt.help.c_str(), opt.def.c_str());
+        }
+        return false;
+    }
+
+private:
+    struct Option {
+        std::string key, def, help;
+    };
+    std::string program;
+    std::map<std::string, std::string> values;
+    std::vector<Option> known;
+    std::vector<std::string> bad;
+};
+
+// Counts from min to max (inclusive), doubling each step
+inline std::vector<int> count_range(int min_count, int max_count)
+{
+    std::vector<int> counts;
+    for (long count = std::max(min_count, 1); count <= max_count; count *= 2)
+        counts.push_back(count);
+    return counts;
+}
+
+// Region in the timeline of tools/trace, when built with TRACE=1
+inline void trace_region(const char *name, bool begin)
+{
+#ifdef BENCH_TRACE
+    if (begin)
+        trace_begin(name);
+    else
+        trace_end(name);
+#else
+    (void)name;
+    (void)begin;
+#endif
+}
+
+// Time an operation: run warmup iterations, then time each of repeat
+// iterations separately. Ranks are synchronized before each iteration so
+// that every sample measures the same collective step.
+template <typename Op>
+std::vector<double> measure(MPI_Comm comm, int warmup, int repeat, Op &&op)
+{
+    for (int n = 0; n < warmup; n++) {
+        trace_region("warmup", true);
+        op();
+        trace_region("warmup", false);
+    }
+
+    std::vector<double> samples(repeat);
+    for (int n = 0; n < repeat; n++) {
+        MPI_Barrier(comm);
+        trace_region("sample", true);
+        double t0 = MPI_Wtime();
+        op();
+        samples[n] = MPI_Wtime() - t0;
+        trace_region("sample", false);
+    }
+    return samples;
+}
+
+// A communication operation under test, split into start and wait so
+// that computation can be placed in between. Blocking operations do all
+// their work in start. test polls for progress, free releases resources
+// created for the operation.
+struct Exchange {
+    std::function<void()> start;
+    std::function<void()> wait = [] {};
+    std::function<void()> test = [] {};
+    std::function<void()> free = [] {};
+
+    void run() const {
+        start();
+        wait();
+    }
+};
+
+// Exchange completed by a set of (nonblocking or persistent) requests
+using Requests = std::shared_ptr<std::vector<MPI_Request>>;
+
+inline Exchange with_requests(Requests reqs, std::function<void()> start)
+{
+    Exchange ex;
+    ex.start = start;
+    ex.wait = [reqs] {
+        MPI_Waitall(reqs->size(), reqs->data(), MPI_STATUSES_IGNORE);
+    };
+    ex.test = [reqs] {
+        int flag;
+        MPI_Testall(reqs->size(), reqs->data(), &flag, MPI_STATUSES_IGNORE);
+    };
+    return ex;
+}
+
+// Check of the block of count values received from the neighbour in
+// direction b of a Cartesian grid, directions 2 d and 2 d + 1 being the
+// two neighbours of dimension d. sent(rank, k) is the value that rank
+// sends in direction k, so block b holds sent(nghbrs[b], b ^ 1), or keeps
+// empty without a neighbour. When both neighbours of a dimension are the
+// same rank (periodic dimension of size two) MPI-3 does not define which
+// of the two messages goes to which block of a neighbourhood collective,
+// and libraries differ, so either order is accepted.
+template <typename T, typename Sent>
+bool check_neighbor_block(const T *block, int count, const std::vector<int> &nghbrs, int b,
+                          T empty, Sent sent)
+{
+    int o = b ^ 1;
+    T expected = empty, swapped = empty;
+    if (nghbrs[b] != MPI_PROC_NULL) {
+        expected = swapped = sent(nghbrs[b], o);
+        if (nghbrs[b] == nghbrs[o])
+            swapped = sent(nghbrs[b], b);
+    }
+    for (int i = 0; i < count; i++)
+        if (block[i] != expected && block[i] != swapped)
+            return false;
+    return true;
+}
+
+// Synthetic computation of adjustable length, e.g. for measuring how much
+// of a nonblocking operation is overlapped with computation. The work is
+// a chain of dependent floating point operations, calibrated on each rank
+// to take the requested time. The calibration takes the fastest of several
+// samples of at least a millisecond: the first ones are slowed down by
+// page faults and clock frequency ramp-up, and calibrating from them
+// makes the work shorter than requested.
+class Workload {
+public:
+    explicit Workload(double seconds) {
+        if (seconds <= 0.0)
+            return;
+        long n = 1000;
+        double t;
+        do {
+            n *= 2;
+            t = time(n);
+        } while (t < 1.0e-3);
+        for (int s = 0; s < calibration_samples; s++)
+            t = std::min(t, time(n));
+        iterations = static_cast<long>(n * seconds / t);
+    }
+
+    // Run the work in chunks, calling poll between consecutive chunks
+    template <typename Poll>
+    void run(int chunks, Poll &&poll) {
+        chunks = std::max(chunks, 1);
+        for (int k = 0; k < chunks; k++) {
+            kernel(iterations / chunks);
+            if (k + 1 < chunks)
+                poll();
+        }
+    }
+
+    void run() { run(1, [] {}); }
+
+private:
+    static constexpr int calibration_samples = 5;
+
+    double time(long n) {
+        double t0 = MPI_Wtime();
+        kernel(n);
+        return MPI_Wtime() - t0;
+    }
+
+    void kernel(long n) {
+        double x = sink;
+        for (long i = 0; i < n; i++)
+            x = x * 0.9999999 + 1.0e-7;
+        sink = x;
+    }
+
+    long iterations = 0;
+    volatile double sink = 1.0;
+};
+
+// Order statistics of a set of timings. ci_low / ci_high bound the
+// 95 % confidence interval of the median.
+struct Summary {
+    long n = 0;
+    double min = 0.0, median = 0.0, p90 = 0.0, p99 = 0.0, max = 0.0;
+    double mean = 0.0, ci_low = 0.0, ci_high = 0.0;
+};
+
+inline double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    double pos = p * (sorted.size() - 1);
+    size_t i = static_cast<size_t>(pos);
+    if (i + 1 >= sorted.size())
+        return sorted.back();
+    return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+inline Summary summarize(std::vector<double> samples)
+{
+    Summary s;
+    if (samples.empty())
+        return s;
+    std::sort(samples.begin(), samples.end());
+    long n = samples.size();
+    s.n = n;
+    s.min = samples.front();
+    s.max = samples.back();
+    s.median = percentile(samples, 0.5);
+    s.p90 = percentile(samples, 0.9);
+    s.p99 = percentile(samples, 0.99);
+    for (auto t : samples)
+        s.mean += t;
+    s.mean /= n;
+
+    // Distribution free interval: the ranks of the order statistics
+    // come from the normal approximation of the binomial distribution
+    double half = 1.96 * std::sqrt(static_cast<double>(n)) / 2.0;
+    long lo = static_cast<long>(std::floor(n / 2.0 - half));
+    long hi = static_cast<long>(std::ceil(n / 2.0 + half));
+    s.ci_low = samples[std::max(lo, 0L)];
+    s.ci_high = samples[std::min(hi, n - 1)];
+    return s;
+}
+
+// Collect the samples of all ranks to root and summarize them there.
+// The result is valid only on root.
+inline Summary gather_summary(const std::vector<double> &samples, MPI_Comm comm,
+                              int root = 0)
+{
+    int rank, ntasks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &ntasks);
+
+    int count = samples.size();
+    std::vector<int> counts(ntasks), displs(ntasks);
+    MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, root, comm);
+    std::vector<double> all;
+    if (rank == root) {
+        int total = 0;
+        for (int i = 0; i < ntasks; i++) {
+            displs[i] = total;
+            total += counts[i];
+        }
+        all.resize(total);
+    }
+    MPI_Gatherv(samples.data(), count, MPI_DOUBLE, all.data(), counts.data(),
+                displs.data(), MPI_DOUBLE, root, comm);
+    return summarize(std::move(all));
+}
+
+// One result row: what was measured, its timing summary and any
+// benchmark specific derived values. The MB/s column is moved bytes over
+// the median time, where moved defaults to bytes; set it when the timed
+// operation sends more than one message of that size.
+struct Record {
+    std::string benchmark;
+    std::string method;
+    long bytes;
+    Summary time;
+    std::vector<std::pair<std::string, double>> extra;
+    double moved = 0.0;
+};
+
+// Collects records on rank 0 and writes them at the end as a table,
+// CSV or JSON. Times are reported in microseconds.
+class Reporter {
+public:
+    Reporter(const std::string &format, const std::string &output, MPI_Comm comm)
+        : format(format), output(output) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &ntasks);
+        char version[MPI_MAX_LIBRARY_VERSION_STRING];
+        int len;
+        MPI_Get_library_version(version, &len);
+        library = std::string(version, len);
+        while (!library.empty() && (library.back() == '\n' || library.back() == '\0'))
+            library.pop_back();
+    }
+
+    static bool valid(const std::string &format) {
+        return format == "table" || format == "csv" || format == "json";
+    }
+
+    // Free form line printed above the table, ignored in CSV and JSON
+    void comment(const std::string &line) { comments.push_back(line); }
+
+    void add(const Record &record) {
+        if (0 == rank)
+            records.push_back(record);
+    }
+
+    void write() const {
+        if (0 != rank)
+            return;
+        FILE *fp = output.empty() ? stdout : fopen(output.c_str(), "w");
+        if (fp == nullptr) {
+            fprintf(stderr, "Cannot open %s for writing\n", output.c_str());
+            return;
+        }
+        if (format == "csv")
+            write_csv(fp);
+        else if (format == "json")
+            write_json(fp);
+        else
+            write_table(fp);
+        if (fp != stdout)
+            fclose(fp);
+    }
+
+private:
+    static constexpr double usec = 1.0e6;
+
+    void write_table(FILE *fp) const {
+        fprintf(fp, "# %s\n# %d tasks\n", library.c_str(), ntasks);
+        for (auto &c : comments)
+            fprintf(fp, "# %s\n", c.c_str());
+        fprintf(fp, "# %-14s %-20s %9s %10s %10s %10s %10s %10s %10s %21s",
+                "benchmark", "method", "bytes", "min", "median", "p90", "p99",
+                "max", "MB/s", "median 95% CI");
+        if (!records.empty())
+            for (auto &e : records.front().extra)
+                fprintf(fp, " %12s", e.first.c_str());
+        fprintf(fp, "\n");
+        for (auto &r : records) {
+            auto &t = r.time;
+            fprintf(fp, "  %-14s %-20s %9ld %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f"
+                    "  [%8.2f, %8.2f]", r.benchmark.c_str(), r.method.c_str(),
+                    r.bytes, t.min * usec, t.median * usec, t.p90 * usec,
+                    t.p99 * usec, t.max * usec, bandwidth(r), t.ci_low * usec,
+                    t.ci_high * usec);
+            for (auto &e : r.extra)
+                fprintf(fp, " %12.4g", e.second);
+            fprintf(fp, "\n");
+        }
+    }
+
+    void write_csv(FILE *fp) const {
+        fprintf(fp, "benchmark,method,ntasks,bytes,samples,min_us,median_us,"
+                "median_ci_low_us,median_ci_high_us,p90_us,p99_us,max_us,"
+                "mean_us,bandwidth_MBps");
+        if (!records.empty())
+            for (auto &e : records.front().extra)
+                fprintf(fp, ",%s", e.first.c_str());
+        fprintf(fp, "\n");
+        for (auto &r : records) {
+            auto &t = r.time;
+            fprintf(fp, "%s,%s,%d,%ld,%ld,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f",
+                    r.benchmark.c_str(), r.method.c_str(), ntasks, r.bytes, t.n,
+                    t.min * usec, t.median * usec, t.ci_low * usec,
+                    t.ci_high * usec, t.p90 * usec, t.p99 * usec, t.max * usec,
+                    t.mean * usec, bandwidth(r));
+            for (auto &e : r.extra)
+                fprintf(fp, ",%g", e.second);
+            fprintf(fp, "\n");
+        }
+    }
+
+    void write_json(FILE *fp) const {
+        fprintf(fp, "{\n  \"library\": \"%s\",\n  \"ntasks\": %d,\n  \"results\": [",
+                escape(library).c_str(), ntasks);
+        for (size_t i = 0; i < records.size(); i++) {
+            auto &r = records[i];
+            auto &t = r.time;
+            fprintf(fp, "%s\n    {\"benchmark\": \"%s\", \"method\": \"%s\", "
+                    "\"bytes\": %ld, \"samples\": %ld, \"min_us\": %.4f, "
+                    "\"median_us\": %.4f, \"median_ci_us\": [%.4f, %.4f], "
+                    "\"p90_us\": %.4f, \"p99_us\": %.4f, \"max_us\": %.4f, "
+                    "\"mean_us\": %.4f, \"bandwidth_MBps\": %.4f",
+                    i ? "," : "", escape(r.benchmark).c_str(),
+                    escape(r.method).c_str(), r.bytes, t.n, t.min * usec,
+                    t.median * usec, t.ci_low * usec, t.ci_high * usec,
+                    t.p90 * usec, t.p99 * usec, t.max * usec, t.mean * usec,
+                    bandwidth(r));
+            for (auto &e : r.extra)
+                fprintf(fp, ", \"%s\": %g", escape(e.first).c_str(), e.second);
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "\n  ]\n}\n");
+    }
+
+    static double bandwidth(const Record &r) {
+        double moved = r.moved > 0.0 ? r.moved : r.bytes;
+        return r.time.median > 0.0 ? 1.0e-6 * moved / r.time.median : 0.0;
+    }
+
+    static std::string escape(const std::string &s) {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else if (static_cast<unsigned char>(c) >= 0x20) {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    std::string format, output, library;
+    std::vector<std::string> comments;
+    std::vector<Record> records;
+    int rank, ntasks;
+};
+
+} // namespace bench
+
+#endif  // __BENCH_HPP__
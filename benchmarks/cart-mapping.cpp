@@ -0,0 +1,307 @@
+// Effect of the mapping of ranks to the Cartesian grid on the neighbour
+// exchange.
+//
+// The same grid is created with different placements of the ranks:
+//  - identity: MPI_Cart_create without reordering (ranks in row major order)
+//  - reorder:  MPI_Cart_create with reorder = 1, as everywhere else in this
+//              repository, leaving the mapping to the MPI library
+//  - node:     hand made node aware mapping, every node gets a compact tile
+//              of the grid
+//  - random:   random permutation of the ranks, as a worst case
+// For each mapping the neighbour pairs within a node and between nodes are
+// counted, and the exchange with all neighbours is timed. Run with --help
+// to see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+// Node of every rank of MPI_COMM_WORLD. With ranks_per_node > 0 nodes are
+// emulated by consecutive blocks of ranks, otherwise they are the shared
+// memory domains of MPI_Comm_split_type.
+std::vector<int> node_ids(int ranks_per_node)
+{
+    int world_rank, node;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    if (ranks_per_node > 0) {
+        node = world_rank / ranks_per_node;
+    } else {
+        MPI_Comm shared, leaders;
+        int shared_rank;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                            &shared);
+        MPI_Comm_rank(shared, &shared_rank);
+        MPI_Comm_split(MPI_COMM_WORLD, 0 == shared_rank ? 0 : MPI_UNDEFINED, world_rank,
+                       &leaders);
+        if (0 == shared_rank) {
+            MPI_Comm_rank(leaders, &node);
+            MPI_Comm_free(&leaders);
+        }
+        MPI_Bcast(&node, 1, MPI_INT, 0, shared);
+        MPI_Comm_free(&shared);
+    }
+
+    int ntasks;
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    std::vector<int> nodes(ntasks);
+    MPI_Allgather(&node, 1, MPI_INT, nodes.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    return nodes;
+}
+
+// Grid positions in row major order (the rank in a Cartesian communicator
+// without reordering) visited tile by tile, every tile in row major order
+std::vector<int> tiled_order(const std::vector<int> &dims, const std::vector<int> &tile)
+{
+    int ndims = dims.size();
+    std::vector<int> ntiles(ndims), t(ndims, 0), order;
+    for (int d = 0; d < ndims; d++)
+        ntiles[d] = (dims[d] + tile[d] - 1) / tile[d];
+
+    // Odometer over the tiles and over the positions within each tile
+    auto next = [ndims](std::vector<int> &index, const std::vector<int> &limit) {
+        for (int d = ndims - 1; d >= 0; d--) {
+            if (++index[d] < limit[d])
+                return true;
+            index[d] = 0;
+        }
+        return false;
+    };
+    do {
+        std::vector<int> p(ndims, 0);
+        do {
+            int rank = 0;
+            bool inside = true;
+            for (int d = 0; d < ndims; d++) {
+                int x = t[d] * tile[d] + p[d];
+                inside = inside && x < dims[d];
+                rank = rank * dims[d] + x;
+            }
+            if (inside)
+                order.push_back(rank);
+        } while (next(p, tile));
+    } while (next(t, ntiles));
+    return order;
+}
+
+// Position (row major) of every rank of MPI_COMM_WORLD in the grid
+std::vector<int> node_mapping(const std::vector<int> &dims, const std::vector<int> &nodes)
+{
+    int ntasks = nodes.size();
+    int ppn = 0;
+    for (int n : nodes)
+        ppn = std::max(ppn, static_cast<int>(std::count(nodes.begin(), nodes.end(), n)));
+
+    std::vector<int> tile(dims.size(), 0);
+    MPI_Dims_create(ppn, tile.size(), tile.data());
+    // Largest extents of the tile along the largest extents of the grid
+    std::vector<int> by_size(dims.size());
+    std::iota(by_size.begin(), by_size.end(), 0);
+    std::stable_sort(by_size.begin(), by_size.end(),
+                     [&dims](int a, int b) { return dims[a] > dims[b]; });
+    std::vector<int> shape(dims.size());
+    for (size_t i = 0; i < dims.size(); i++)
+        shape[by_size[i]] = std::min(tile[i], dims[by_size[i]]);
+
+    // Ranks grouped by node get the positions tile by tile
+    std::vector<int> ranks(ntasks);
+    std::iota(ranks.begin(), ranks.end(), 0);
+    std::stable_sort(ranks.begin(), ranks.end(),
+                     [&nodes](int a, int b) { return nodes[a] < nodes[b]; });
+    auto order = tiled_order(dims, shape);
+    std::vector<int> position(ntasks);
+    for (int i = 0; i < ntasks; i++)
+        position[ranks[i]] = order[i];
+    return position;
+}
+
+// Cartesian communicator where world rank r has the row major position
+// position[r]
+MPI_Comm cart_with_positions(const std::vector<int> &dims, const std::vector<int> &periods,
+                             const std::vector<int> &position)
+{
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm permuted, cart;
+    MPI_Comm_split(MPI_COMM_WORLD, 0, position[world_rank], &permuted);
+    MPI_Cart_create(permuted, dims.size(), dims.data(), periods.data(), 0, &cart);
+    MPI_Comm_free(&permuted);
+    return cart;
+}
+
+struct Mapping {
+    std::string name;
+    MPI_Comm comm;
+    std::vector<int> nghbrs;
+    int intra, inter;            // neighbour pairs within and between nodes
+};
+
+void count_pairs(Mapping &m, const std::vector<int> &nodes)
+{
+    // Node of every rank of the new communicator
+    int world_rank, ntasks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(m.comm, &ntasks);
+    std::vector<int> cart_nodes(ntasks);
+    MPI_Allgather(&nodes[world_rank], 1, MPI_INT, cart_nodes.data(), 1, MPI_INT, m.comm);
+
+    int counts[2] = {0, 0}, totals[2];
+    for (int n : m.nghbrs)
+        if (n != MPI_PROC_NULL)
+            counts[cart_nodes[n] == nodes[world_rank] ? 0 : 1]++;
+    MPI_Allreduce(counts, totals, 2, MPI_INT, MPI_SUM, m.comm);
+    // Every pair was counted from both ends
+    m.intra = totals[0] / 2;
+    m.inter = totals[1] / 2;
+}
+
+void fill(std::vector<double> &sendbuf, int count, int rank)
+{
+    for (size_t b = 0; b < sendbuf.size() / count; b++)
+        std::fill(&sendbuf[b * count], &sendbuf[(b + 1) * count], rank * 100.0 + b);
+}
+
+bool check(const std::vector<double> &recvbuf, const Mapping &m, int count)
+{
+    auto sent = [](int rank, int b) { return rank * 100.0 + b; };
+    for (size_t b = 0; b < m.nghbrs.size(); b++)
+        if (!bench::check_neighbor_block(&recvbuf[b * count], count, m.nghbrs, b, -1.0, sent))
+            return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    bench::Args args(argc, argv);
+    auto mappings = args.get_list("mappings", "identity,reorder,node,random",
+                                  "comma separated list of rank mappings");
+    auto exchange = args.get("exchange", "neighbor", "neighbor or isend");
+    int ndims = args.get_int("ndims", 3, "dimensions of the Cartesian grid");
+    int periodic = args.get_int("periodic", 1, "periodic boundaries (0/1)");
+    int ranks_per_node = args.get_int("ranks-per-node", 0,
+                                      "emulate nodes of this many consecutive ranks, "
+                                      "0 uses the real nodes");
+    int seed = args.get_int("seed", 1, "seed of the random permutation");
+    int min_count = args.get_int("min-count", 1, "smallest message in doubles");
+    int max_count = args.get_int("max-count", 128 * 1024, "largest message in doubles");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    const char *known[] = {"identity", "reorder", "node", "random"};
+    bool ok = bench::Reporter::valid(format) &&
+              (exchange == "neighbor" || exchange == "isend");
+    for (auto &name : mappings)
+        if (std::find(std::begin(known), std::end(known), name) == std::end(known)) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown mapping %s\n", name.c_str());
+            ok = false;
+        }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    std::vector<int> dims(ndims, 0), periods(ndims, periodic);
+    MPI_Dims_create(ntasks, ndims, dims.data());
+    auto nodes = node_ids(ranks_per_node);
+    int nnodes = *std::max_element(nodes.begin(), nodes.end()) + 1;
+
+    std::vector<Mapping> maps;
+    for (auto &name : mappings) {
+        Mapping m = {name, MPI_COMM_NULL, {}, 0, 0};
+        if (name == "identity" || name == "reorder") {
+            MPI_Cart_create(MPI_COMM_WORLD, ndims, dims.data(), periods.data(),
+                            name == "reorder", &m.comm);
+        } else if (name == "node") {
+            m.comm = cart_with_positions(dims, periods, node_mapping(dims, nodes));
+        } else {
+            // Same seed and generator everywhere, so all ranks agree
+            std::vector<int> position(ntasks);
+            std::iota(position.begin(), position.end(), 0);
+            std::mt19937 gen(seed);
+            for (int i = ntasks - 1; i > 0; i--)
+                std::swap(position[i], position[gen() % (i + 1)]);
+            m.comm = cart_with_positions(dims, periods, position);
+        }
+        m.nghbrs.resize(2 * ndims);
+        for (int i = 0; i < ndims; i++)
+            MPI_Cart_shift(m.comm, i, 1, &m.nghbrs[2 * i], &m.nghbrs[2 * i + 1]);
+        count_pairs(m, nodes);
+        maps.push_back(m);
+    }
+
+    // Statistics are gathered over MPI_COMM_WORLD, the communicators of
+    // the mappings differ only in the order of the same processes
+    bench::Reporter reporter(format, output, MPI_COMM_WORLD);
+    std::string grid;
+    for (int i = 0; i < ndims; i++)
+        grid += (i ? " x " : "") + std::to_string(dims[i]);
+    reporter.comment(std::to_string(ntasks) + " ntasks on " + std::to_string(nnodes) +
+                     (ranks_per_node > 0 ? " emulated" : "") + " nodes in " + grid +
+                     " grid, " + exchange + " exchange");
+
+    for (int count : bench::count_range(min_count, max_count)) {
+        std::vector<double> sendbuf(count * 2 * ndims), recvbuf(sendbuf.size());
+        for (auto &m : maps) {
+            int rank;
+            MPI_Comm_rank(m.comm, &rank);
+            fill(sendbuf, count, rank);
+            std::fill(recvbuf.begin(), recvbuf.end(), -1.0);
+
+            std::vector<MPI_Request> reqs(4 * ndims);
+            auto samples = bench::measure(m.comm, warmup, repeat, [&] {
+                if (exchange == "neighbor") {
+                    MPI_Neighbor_alltoall(sendbuf.data(), count, MPI_DOUBLE, recvbuf.data(),
+                                          count, MPI_DOUBLE, m.comm);
+                    return;
+                }
+                for (int b = 0; b < 2 * ndims; b++) {
+                    MPI_Irecv(&recvbuf[b * count], count, MPI_DOUBLE, m.nghbrs[b], b ^ 1,
+                              m.comm, &reqs[2 * b]);
+                    MPI_Isend(&sendbuf[b * count], count, MPI_DOUBLE, m.nghbrs[b], b,
+                              m.comm, &reqs[2 * b + 1]);
+                }
+                MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+            });
+
+            int valid = check(recvbuf, m, count), all_valid;
+            MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, MPI_COMM_WORLD);
+
+            auto summary = bench::gather_summary(samples, MPI_COMM_WORLD);
+            double pairs = m.intra + m.inter;
+            reporter.add({exchange, m.name, static_cast<long>(count * sizeof(double)),
+                          summary,
+                          {{"intra_pairs", static_cast<double>(m.intra)},
+                           {"inter_pairs", static_cast<double>(m.inter)},
+                           {"intra_fraction", pairs > 0 ? m.intra / pairs : 0.0}}});
+            if (0 == world_rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s mapping with %d doubles gave "
+                        "wrong data!!!\n", m.name.c_str(), count);
+        }
+    }
+
+    reporter.write();
+
+    for (auto &m : maps)
+        MPI_Comm_free(&m.comm);
+    MPI_Finalize();
+}
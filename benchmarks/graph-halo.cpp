@@ -0,0 +1,220 @@
+// Halo exchange of an irregular 2D domain decomposition with the
+// distributed graph halo exchange of halo-exchange.hpp.
+//
+// The global grid is cut into vertical strips, and every strip is cut
+// into blocks of varying height, as after rebalancing a rectilinear
+// decomposition. A block has an upper and a lower neighbour in its own
+// strip, but a varying number of neighbours in the strips on each side.
+// Run with --help to see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+#include "halo-exchange.hpp"
+
+// Rows [row0, row1) and columns [col0, col1) of the global grid owned by
+// one rank
+struct Block {
+    int row0, row1, col0, col1;
+
+    int height() const { return row1 - row0; }
+    int width() const { return col1 - col0; }
+};
+
+// Blocks of all ranks: rank = strip * nblocks + block. The row cuts of the
+// strips differ, so that the blocks of neighbouring strips are misaligned.
+std::vector<Block> decompose(int nrows, int ncols, int nstrips, int nblocks)
+{
+    std::vector<Block> blocks;
+    for (int s = 0; s < nstrips; s++) {
+        std::vector<double> weight(nblocks);
+        double total = 0.0;
+        for (int b = 0; b < nblocks; b++) {
+            weight[b] = 1.0 + 0.5 * ((b + s) % 3);
+            total += weight[b];
+        }
+        int row = 0;
+        double sum = 0.0;
+        for (int b = 0; b < nblocks; b++) {
+            sum += weight[b];
+            int next = b == nblocks - 1 ? nrows : static_cast<int>(nrows * sum / total);
+            next = std::max(next, row + 1);
+            blocks.push_back({row, next, s * ncols / nstrips, (s + 1) * ncols / nstrips});
+            row = next;
+        }
+    }
+    return blocks;
+}
+
+// Local data is the block with a ghost layer, (height + 2) x (width + 2)
+struct Local {
+    Block b;
+    int index(int row, int col) const {
+        return (row - b.row0 + 1) * (b.width() + 2) + (col - b.col0 + 1);
+    }
+};
+
+// Elements to exchange with every block that shares an edge with our own
+std::vector<halo::Neighbour> neighbours(const std::vector<Block> &blocks, int rank)
+{
+    Local l = {blocks[rank]};
+    const Block &me = l.b;
+    std::vector<halo::Neighbour> nghbrs;
+    for (int r = 0; r < static_cast<int>(blocks.size()); r++) {
+        const Block &o = blocks[r];
+        halo::Neighbour n = {r, {}, {}};
+        if (o.col0 == me.col0 && (o.row1 == me.row0 || o.row0 == me.row1)) {
+            // Upper or lower neighbour in the same strip
+            bool upper = o.row1 == me.row0;
+            int send = upper ? me.row0 : me.row1 - 1;
+            int recv = upper ? me.row0 - 1 : me.row1;
+            for (int c = me.col0; c < me.col1; c++) {
+                n.send.push_back(l.index(send, c));
+                n.recv.push_back(l.index(recv, c));
+            }
+        } else if (o.col1 == me.col0 || o.col0 == me.col1) {
+            // Strip on the left or right, shares the overlapping rows
+            bool left = o.col1 == me.col0;
+            int send = left ? me.col0 : me.col1 - 1;
+            int recv = left ? me.col0 - 1 : me.col1;
+            for (int row = std::max(me.row0, o.row0); row < std::min(me.row1, o.row1); row++) {
+                n.send.push_back(l.index(row, send));
+                n.recv.push_back(l.index(row, recv));
+            }
+        }
+        if (!n.send.empty())
+            nghbrs.push_back(n);
+    }
+    return nghbrs;
+}
+
+double value(int row, int col, int ncols)
+{
+    return static_cast<double>(row) * ncols + col;
+}
+
+void fill(std::vector<double> &data, const Local &l, int ncols)
+{
+    std::fill(data.begin(), data.end(), -1.0);
+    for (int row = l.b.row0; row < l.b.row1; row++)
+        for (int col = l.b.col0; col < l.b.col1; col++)
+            data[l.index(row, col)] = value(row, col, ncols);
+}
+
+// Ghost points inside the domain must hold the value of the neighbour,
+// corners are not exchanged
+bool check(const std::vector<double> &data, const Local &l, int nrows, int ncols)
+{
+    for (int row = l.b.row0 - 1; row <= l.b.row1; row++)
+        for (int col = l.b.col0 - 1; col <= l.b.col1; col++) {
+            bool inside = row >= l.b.row0 && row < l.b.row1;
+            bool edge = inside != (col >= l.b.col0 && col < l.b.col1);
+            bool domain = row >= 0 && row < nrows && col >= 0 && col < ncols;
+            double expected = domain && (inside || edge) ? value(row, col, ncols) : -1.0;
+            if (data[l.index(row, col)] != expected)
+                return false;
+        }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "isend,neighbor,persistent",
+                                 "comma separated list of halo exchange backends");
+    int reorder = args.get_int("reorder", 1, "allow reordering of ranks (0/1)");
+    int min_size = args.get_int("min-size", 16, "smallest average edge of a block");
+    int max_size = args.get_int("max-size", 2048, "largest average edge of a block");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    const halo::Backend all_backends[] = {halo::Backend::isend, halo::Backend::neighbor,
+                                          halo::Backend::persistent};
+    bool ok = bench::Reporter::valid(format);
+    std::vector<halo::Backend> selected;
+    for (auto &name : methods) {
+        auto it = std::find_if(std::begin(all_backends), std::end(all_backends),
+                               [&name](halo::Backend b) {
+                                   return name == halo::backend_name(b);
+                               });
+        if (it == std::end(all_backends)) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else {
+            selected.push_back(*it);
+        }
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    int dims[2] = {0, 0};
+    MPI_Dims_create(ntasks, 2, dims);
+    int nstrips = dims[0], nblocks = dims[1];
+
+    bench::Reporter reporter(format, output, MPI_COMM_WORLD);
+    reporter.comment(std::to_string(ntasks) + " ntasks in " + std::to_string(nstrips) +
+                     " strips of " + std::to_string(nblocks) + " blocks, bytes is the "
+                     "average halo volume per rank");
+
+    for (int size : bench::count_range(min_size, max_size)) {
+        int nrows = size * nblocks, ncols = size * nstrips;
+        auto blocks = decompose(nrows, ncols, nstrips, nblocks);
+        Local l = {blocks[world_rank]};
+        auto nghbrs = neighbours(blocks, world_rank);
+
+        // The graph communicator may renumber the ranks, but every
+        // process still owns the block it described
+        halo::Exchange ex(MPI_COMM_WORLD, nghbrs, MPI_DOUBLE, reorder);
+
+        long bytes = 0, total_bytes;
+        for (auto &n : nghbrs)
+            bytes += n.recv.size() * sizeof(double);
+        MPI_Allreduce(&bytes, &total_bytes, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+        std::vector<double> data((l.b.height() + 2) * (l.b.width() + 2));
+        for (auto backend : selected) {
+            fill(data, l, ncols);
+            auto samples = bench::measure(ex.comm(), warmup, repeat, [&] {
+                ex.exchange(data.data(), backend);
+            });
+
+            int valid = check(data, l, nrows, ncols), all_valid;
+            MPI_Allreduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+
+            auto summary = bench::gather_summary(samples, MPI_COMM_WORLD);
+            int degree = ex.outdegree(), max_degree;
+            MPI_Reduce(&degree, &max_degree, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+            reporter.add({std::to_string(nrows) + "x" + std::to_string(ncols),
+                          halo::backend_name(backend), total_bytes / ntasks, summary,
+                          {{"max_neighbours", static_cast<double>(max_degree)}}});
+            if (0 == world_rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s with %d x %d grid gave "
+                        "wrong data!!!\n", halo::backend_name(backend), nrows, ncols);
+        }
+    }
+
+    reporter.write();
+
+    MPI_Finalize();
+}
@@ -0,0 +1,194 @@
+// Halo exchange for irregular neighbourhoods.
+//
+// Every rank describes its own neighbours: which elements of its local
+// data it sends to each of them and where the elements received from them
+// are stored. From this a distributed graph topology is built with
+// MPI_Dist_graph_create_adjacent, weighting every edge with the number of
+// bytes sent along it so that the MPI library can use the weights when it
+// reorders the ranks. The exchange itself can use point-to-point messages,
+// a neighbourhood collective or persistent requests, behind one interface.
+
+#ifndef __HALO_EXCHANGE_HPP__
+#define __HALO_EXCHANGE_HPP__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+namespace halo {
+
+// Elements exchanged with one neighbour, as indices to the local data.
+// Each neighbour should appear only once in the list of a rank.
+struct Neighbour {
+    int rank;                  // in the communicator given to Exchange
+    std::vector<int> send;     // elements sent to the neighbour
+    std::vector<int> recv;     // where the elements from the neighbour go
+};
+
+enum class Backend { isend, neighbor, persistent };
+
+inline const char *backend_name(Backend b)
+{
+    switch (b) {
+    case Backend::isend:
+        return "isend";
+    case Backend::neighbor:
+        return "neighbor";
+    default:
+        return "persistent";
+    }
+}
+
+class Exchange {
+public:
+    // Collective over comm. With reorder the ranks of the new communicator
+    // (see comm()) may differ from the ones in comm.
+    Exchange(MPI_Comm comm, const std::vector<Neighbour> &nghbrs,
+             MPI_Datatype element, bool reorder = true) {
+        int size;
+        MPI_Type_size(element, &size);
+
+        std::vector<int> sources, destinations, sweights, dweights;
+        for (auto &n : nghbrs) {
+            if (!n.recv.empty()) {
+                sources.push_back(n.rank);
+                sweights.push_back(n.recv.size() * size);
+                recvtypes.push_back(indexed_type(n.recv, element));
+            }
+            if (!n.send.empty()) {
+                destinations.push_back(n.rank);
+                dweights.push_back(n.send.size() * size);
+                sendtypes.push_back(indexed_type(n.send, element));
+            }
+        }
+
+        // Keep the weight arrays valid pointers also without neighbours
+        sweights.push_back(0);
+        dweights.push_back(0);
+        MPI_Dist_graph_create_adjacent(comm, sources.size(), sources.data(),
+                                       sweights.data(), destinations.size(),
+                                       destinations.data(), dweights.data(),
+                                       MPI_INFO_NULL, reorder, &graph);
+
+        // Neighbours keep their order, but with reordering their ranks change
+        sources.resize(recvtypes.size());
+        destinations.resize(sendtypes.size());
+        MPI_Dist_graph_neighbors(graph, sources.size(), sources.data(),
+                                 sweights.data(), destinations.size(),
+                                 destinations.data(), dweights.data());
+        source_ranks = sources;
+        destination_ranks = destinations;
+
+        recvcounts.assign(recvtypes.size(), 1);
+        sendcounts.assign(sendtypes.size(), 1);
+        recvdispls.assign(recvtypes.size(), 0);
+        senddispls.assign(sendtypes.size(), 0);
+    }
+
+    Exchange(const Exchange &) = delete;
+    Exchange &operator=(const Exchange &) = delete;
+
+    ~Exchange() {
+        for (auto &p : persistent)
+            for (auto &r : p.second)
+                MPI_Request_free(&r);
+        for (auto &t : sendtypes)
+            MPI_Type_free(&t);
+        for (auto &t : recvtypes)
+            MPI_Type_free(&t);
+        MPI_Comm_free(&graph);
+    }
+
+    // Communicator with the graph topology
+    MPI_Comm comm() const { return graph; }
+
+    int indegree() const { return source_ranks.size(); }
+    int outdegree() const { return destination_ranks.size(); }
+
+    // Start the exchange of the halo of data. The data must not be
+    // modified (halo) or read (sent elements) before wait().
+    void start(void *data, Backend backend) {
+        active = backend;
+        switch (backend) {
+        case Backend::isend:
+            requests.resize(source_ranks.size() + destination_ranks.size());
+            for (size_t i = 0; i < source_ranks.size(); i++)
+                MPI_Irecv(data, 1, recvtypes[i], source_ranks[i], tag, graph,
+                          &requests[i]);
+            for (size_t i = 0; i < destination_ranks.size(); i++)
+                MPI_Isend(data, 1, sendtypes[i], destination_ranks[i], tag, graph,
+                          &requests[source_ranks.size() + i]);
+            break;
+        case Backend::neighbor:
+            requests.resize(1);
+            MPI_Ineighbor_alltoallw(data, sendcounts.data(), senddispls.data(),
+                                    sendtypes.data(), data, recvcounts.data(),
+                                    recvdispls.data(), recvtypes.data(), graph,
+                                    &requests[0]);
+            break;
+        case Backend::persistent: {
+            auto &reqs = persistent_requests(data);
+            if (!reqs.empty())
+                MPI_Startall(reqs.size(), reqs.data());
+            break;
+        }
+        }
+        started = data;
+    }
+
+    void wait() {
+        if (active == Backend::persistent) {
+            auto &reqs = persistent[started];
+            MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+        } else {
+            MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+        }
+    }
+
+    void exchange(void *data, Backend backend) {
+        start(data, backend);
+        wait();
+    }
+
+private:
+    static constexpr int tag = 42;
+
+    static MPI_Datatype indexed_type(const std::vector<int> &indices,
+                                     MPI_Datatype element) {
+        MPI_Datatype type;
+        MPI_Type_create_indexed_block(indices.size(), 1, indices.data(), element, &type);
+        MPI_Type_commit(&type);
+        return type;
+    }
+
+    // Persistent requests are bound to a buffer, so they are created on
+    // first use for each buffer (typically the two fields of a solver)
+    std::vector<MPI_Request> &persistent_requests(void *data) {
+        auto it = persistent.find(data);
+        if (it != persistent.end())
+            return it->second;
+        auto &reqs = persistent[data];
+        reqs.resize(source_ranks.size() + destination_ranks.size());
+        for (size_t i = 0; i < source_ranks.size(); i++)
+            MPI_Recv_init(data, 1, recvtypes[i], source_ranks[i], tag, graph, &reqs[i]);
+        for (size_t i = 0; i < destination_ranks.size(); i++)
+            MPI_Send_init(data, 1, sendtypes[i], destination_ranks[i], tag, graph,
+                          &reqs[source_ranks.size() + i]);
+        return reqs;
+    }
+
+    MPI_Comm graph;
+    std::vector<int> source_ranks, destination_ranks;
+    std::vector<MPI_Datatype> sendtypes, recvtypes;
+    std::vector<int> sendcounts, recvcounts;
+    std::vector<MPI_Aint> senddispls, recvdispls;
+    std::vector<MPI_Request> requests;
+    std::map<void *, std::vector<MPI_Request>> persistent;
+    Backend active = Backend::isend;
+    void *started = nullptr;
+};
+
+} // namespace halo
+
+#endif  // __HALO_EXCHANGE_HPP__
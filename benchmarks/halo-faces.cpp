@@ -0,0 +1,371 @@
+// Halo exchange of the faces of a 3D block in a Cartesian process topology.
+//
+// The faces are strided in memory (the last one with a stride of a full
+// row for each element), and with a non-cubic block they have different
+// sizes. Compares derived datatypes in MPI_Neighbor_alltoallw and
+// point-to-point with explicit packing to contiguous buffers followed by
+// MPI_Neighbor_alltoallv or MPI_Neighbor_alltoall.
+// Run with --help to see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+using bench::Exchange;
+
+// Local block of nx x ny x nz points with a ghost layer of width one,
+// stored in C order. Faces are numbered in the neighbourhood collective
+// order: for each dimension first the lower, then the upper neighbour.
+struct Block {
+    MPI_Comm comm;
+    int n[3];                     // interior points
+    int nghbrs[6];
+    std::vector<double> data;
+
+    int extent(int d) const { return n[d] + 2; }
+    long index(int i, int j, int k) const {
+        return (static_cast<long>(i) * extent(1) + j) * extent(2) + k;
+    }
+
+    // Region of face f: the boundary layer to send or the ghost layer
+    // to receive, without the edges and corners
+    void face(int f, bool ghost, int start[3], int size[3]) const {
+        int d = f / 2;
+        for (int e = 0; e < 3; e++) {
+            start[e] = 1;
+            size[e] = n[e];
+        }
+        size[d] = 1;
+        if (f % 2 == 0)
+            start[d] = ghost ? 0 : 1;
+        else
+            start[d] = ghost ? n[d] + 1 : n[d];
+    }
+
+    int face_count(int f) const {
+        int d = f / 2;
+        return n[(d + 1) % 3] * n[(d + 2) % 3];
+    }
+};
+
+using Method = std::function<Exchange(Block &)>;
+
+// Subarray datatype of a face, relative to the start of the block
+MPI_Datatype subarray_type(const Block &b, int f, bool ghost)
+{
+    int sizes[3] = {b.extent(0), b.extent(1), b.extent(2)};
+    int start[3], size[3];
+    b.face(f, ghost, start, size);
+    MPI_Datatype type;
+    MPI_Type_create_subarray(3, sizes, size, start, MPI_ORDER_C, MPI_DOUBLE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+// Vector datatype of a face, relative to its first element
+MPI_Datatype vector_type(const Block &b, int f)
+{
+    MPI_Datatype type, row;
+    long plane = static_cast<long>(b.extent(1)) * b.extent(2);
+    switch (f / 2) {
+    case 0:
+        MPI_Type_vector(b.n[1], b.n[2], b.extent(2), MPI_DOUBLE, &type);
+        break;
+    case 1:
+        MPI_Type_vector(b.n[0], b.n[2], plane, MPI_DOUBLE, &type);
+        break;
+    default:
+        MPI_Type_vector(b.n[1], 1, b.extent(2), MPI_DOUBLE, &row);
+        MPI_Type_create_hvector(b.n[0], 1, plane * sizeof(double), row, &type);
+        MPI_Type_free(&row);
+        break;
+    }
+    MPI_Type_commit(&type);
+    return type;
+}
+
+MPI_Aint face_offset(const Block &b, int f, bool ghost)
+{
+    int start[3], size[3];
+    b.face(f, ghost, start, size);
+    return b.index(start[0], start[1], start[2]) * sizeof(double);
+}
+
+Exchange alltoallw(Block &b, bool subarray)
+{
+    struct Types {
+        int counts[6];
+        MPI_Aint sdispls[6], rdispls[6];
+        MPI_Datatype stypes[6], rtypes[6];
+    };
+    auto t = std::make_shared<Types>();
+    for (int f = 0; f < 6; f++) {
+        t->counts[f] = 1;
+        if (subarray) {
+            t->stypes[f] = subarray_type(b, f, false);
+            t->rtypes[f] = subarray_type(b, f, true);
+            t->sdispls[f] = t->rdispls[f] = 0;
+        } else {
+            t->stypes[f] = vector_type(b, f);
+            MPI_Type_dup(t->stypes[f], &t->rtypes[f]);
+            t->sdispls[f] = face_offset(b, f, false);
+            t->rdispls[f] = face_offset(b, f, true);
+        }
+    }
+    Exchange ex;
+    ex.start = [&b, t] {
+        MPI_Neighbor_alltoallw(b.data.data(), t->counts, t->sdispls, t->stypes,
+                               b.data.data(), t->counts, t->rdispls, t->rtypes,
+                               b.comm);
+    };
+    ex.free = [t] {
+        for (int f = 0; f < 6; f++) {
+            MPI_Type_free(&t->stypes[f]);
+            MPI_Type_free(&t->rtypes[f]);
+        }
+    };
+    return ex;
+}
+
+Exchange isend_subarray(Block &b)
+{
+    auto types = std::make_shared<std::vector<MPI_Datatype>>(12);
+    for (int f = 0; f < 6; f++) {
+        (*types)[2 * f] = subarray_type(b, f, false);
+        (*types)[2 * f + 1] = subarray_type(b, f, true);
+    }
+    auto reqs = std::make_shared<std::vector<MPI_Request>>(12);
+    Exchange ex = bench::with_requests(reqs, [&b, types, reqs] {
+        for (int f = 0; f < 6; f++) {
+            MPI_Irecv(b.data.data(), 1, (*types)[2 * f + 1], b.nghbrs[f], f ^ 1,
+                      b.comm, &(*reqs)[2 * f]);
+            MPI_Isend(b.data.data(), 1, (*types)[2 * f], b.nghbrs[f], f,
+                      b.comm, &(*reqs)[2 * f + 1]);
+        }
+    });
+    ex.free = [types] {
+        for (auto &t : *types)
+            MPI_Type_free(&t);
+    };
+    return ex;
+}
+
+// Explicit packing of a face to / from a contiguous buffer. The innermost
+// loop runs over the contiguous dimension whenever the face has one.
+void pack(const Block &b, int f, double *buf)
+{
+    int start[3], size[3];
+    b.face(f, false, start, size);
+    for (int i = start[0]; i < start[0] + size[0]; i++)
+        for (int j = start[1]; j < start[1] + size[1]; j++) {
+            const double *src = &b.data[b.index(i, j, start[2])];
+            for (int k = 0; k < size[2]; k++)
+                *buf++ = src[k];
+        }
+}
+
+void unpack(Block &b, int f, const double *buf)
+{
+    int start[3], size[3];
+    b.face(f, true, start, size);
+    for (int i = start[0]; i < start[0] + size[0]; i++)
+        for (int j = start[1]; j < start[1] + size[1]; j++) {
+            double *dst = &b.data[b.index(i, j, start[2])];
+            for (int k = 0; k < size[2]; k++)
+                dst[k] = *buf++;
+        }
+}
+
+// Packed faces exchanged either with exact sizes (alltoallv) or padded to
+// the largest face (alltoall)
+Exchange pack_exchange(Block &b, bool padded)
+{
+    struct Buffers {
+        int counts[6], displs[6], block;
+        std::vector<double> send, recv;
+    };
+    auto p = std::make_shared<Buffers>();
+    int total = 0;
+    p->block = 0;
+    for (int f = 0; f < 6; f++)
+        p->block = std::max(p->block, b.face_count(f));
+    for (int f = 0; f < 6; f++) {
+        p->counts[f] = b.face_count(f);
+        p->displs[f] = padded ? f * p->block : total;
+        total += p->counts[f];
+    }
+    p->send.resize(padded ? 6 * p->block : total);
+    p->recv.resize(p->send.size());
+
+    Exchange ex;
+    ex.start = [&b, p, padded] {
+        for (int f = 0; f < 6; f++)
+            pack(b, f, p->send.data() + p->displs[f]);
+        if (padded)
+            MPI_Neighbor_alltoall(p->send.data(), p->block, MPI_DOUBLE,
+                                  p->recv.data(), p->block, MPI_DOUBLE, b.comm);
+        else
+            MPI_Neighbor_alltoallv(p->send.data(), p->counts, p->displs, MPI_DOUBLE,
+                                   p->recv.data(), p->counts, p->displs, MPI_DOUBLE,
+                                   b.comm);
+        for (int f = 0; f < 6; f++)
+            if (b.nghbrs[f] != MPI_PROC_NULL)
+                unpack(b, f, p->recv.data() + p->displs[f]);
+    };
+    return ex;
+}
+
+// Every interior point holds a value computed from its global position,
+// ghosts are -1 until received
+double value(const int g[3], const int global[3], const int periods[3])
+{
+    int w[3];
+    for (int d = 0; d < 3; d++)
+        w[d] = periods[d] ? (g[d] + global[d]) % global[d] : g[d];
+    return (static_cast<double>(w[0]) * global[1] + w[1]) * global[2] + w[2];
+}
+
+void fill(Block &b, const int coords[3], const int global[3], const int periods[3])
+{
+    std::fill(b.data.begin(), b.data.end(), -1.0);
+    for (int i = 1; i <= b.n[0]; i++)
+        for (int j = 1; j <= b.n[1]; j++)
+            for (int k = 1; k <= b.n[2]; k++) {
+                int g[3] = {coords[0] * b.n[0] + i - 1, coords[1] * b.n[1] + j - 1,
+                            coords[2] * b.n[2] + k - 1};
+                b.data[b.index(i, j, k)] = value(g, global, periods);
+            }
+}
+
+bool check(const Block &b, const int coords[3], const int global[3],
+           const int periods[3])
+{
+    for (int f = 0; f < 6; f++) {
+        int start[3], size[3];
+        b.face(f, true, start, size);
+        for (int i = start[0]; i < start[0] + size[0]; i++)
+            for (int j = start[1]; j < start[1] + size[1]; j++)
+                for (int k = start[2]; k < start[2] + size[2]; k++) {
+                    int g[3] = {coords[0] * b.n[0] + i - 1, coords[1] * b.n[1] + j - 1,
+                                coords[2] * b.n[2] + k - 1};
+                    double expected = b.nghbrs[f] == MPI_PROC_NULL ? -1.0
+                                      : value(g, global, periods);
+                    if (b.data[b.index(i, j, k)] != expected)
+                        return false;
+                }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    const std::vector<std::pair<std::string, Method>> all_methods = {
+        {"alltoallw-subarray", [](Block &b) { return alltoallw(b, true); }},
+        {"alltoallw-vector", [](Block &b) { return alltoallw(b, false); }},
+        {"isend-subarray", isend_subarray},
+        {"pack-alltoallv", [](Block &b) { return pack_exchange(b, false); }},
+        {"pack-alltoall", [](Block &b) { return pack_exchange(b, true); }},
+    };
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "alltoallw-subarray,alltoallw-vector,"
+                                 "isend-subarray,pack-alltoallv,pack-alltoall",
+                                 "comma separated list of exchange methods");
+    auto shape = args.get_list("shape", "1,1,2",
+                               "aspect ratio of the local block, nx,ny,nz = size * shape");
+    int periodic = args.get_int("periodic", 0, "periodic boundaries (0/1)");
+    int min_size = args.get_int("min-size", 4, "smallest edge of the local block");
+    int max_size = args.get_int("max-size", 128, "largest edge of the local block");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format) && shape.size() == 3;
+    std::vector<std::pair<std::string, const Method *>> selected;
+    for (auto &name : methods) {
+        const Method *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        }
+        selected.push_back({name, m});
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    int dims[3] = {0, 0, 0}, periods[3] = {periodic, periodic, periodic};
+    MPI_Dims_create(ntasks, 3, dims);
+
+    Block b;
+    MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 1, &b.comm);
+    MPI_Comm_rank(b.comm, &rank);
+    int coords[3];
+    MPI_Cart_coords(b.comm, rank, 3, coords);
+    for (int d = 0; d < 3; d++)
+        MPI_Cart_shift(b.comm, d, 1, &b.nghbrs[2 * d], &b.nghbrs[2 * d + 1]);
+
+    bench::Reporter reporter(format, output, b.comm);
+    reporter.comment(std::to_string(ntasks) + " ntasks in " + std::to_string(dims[0]) +
+                     " x " + std::to_string(dims[1]) + " x " + std::to_string(dims[2]) +
+                     " grid, bytes is the halo volume per rank");
+
+    for (int size : bench::count_range(min_size, max_size)) {
+        int global[3];
+        long halo = 0;
+        for (int d = 0; d < 3; d++) {
+            b.n[d] = size * std::atoi(shape[d].c_str());
+            global[d] = b.n[d] * dims[d];
+        }
+        for (int f = 0; f < 6; f++)
+            halo += b.face_count(f) * sizeof(double);
+        b.data.assign(static_cast<long>(b.extent(0)) * b.extent(1) * b.extent(2), -1.0);
+
+        for (auto &method : selected) {
+            fill(b, coords, global, periods);
+            Exchange ex = (*method.second)(b);
+            auto samples = bench::measure(b.comm, warmup, repeat, [&ex] { ex.run(); });
+
+            int valid = check(b, coords, global, periods), all_valid;
+            MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, b.comm);
+            ex.free();
+
+            auto summary = bench::gather_summary(samples, b.comm);
+            reporter.add({std::to_string(b.n[0]) + "x" + std::to_string(b.n[1]) + "x" +
+                          std::to_string(b.n[2]), method.first, halo, summary, {}});
+            if (0 == rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s with block %d x %d x %d "
+                        "gave wrong data!!!\n", method.first.c_str(), b.n[0],
+                        b.n[1], b.n[2]);
+        }
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&b.comm);
+    MPI_Finalize();
+}
@@ -0,0 +1,98 @@
+// Check of migration.hpp with exchanges back to back: no barrier or other
+// collective between the steps, as in a particle code whose ranks compute
+// for different times between the migrations. The ranks create different
+// numbers of particles for every step, each for a random rank, and every
+// particle has to arrive in the exchange of its own step. The totals are
+// compared only after the last step. Run on any number of ranks.
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "migration.hpp"
+
+struct Particle {
+    long id;
+    int step;
+    int destination;
+};
+MPI_STRUCT_TYPE(Particle, id, step, destination)
+
+// Per step: particles created, their ids, particles received, their ids
+// and particles of the wrong step or rank
+enum { CREATED, CREATED_IDS, RECEIVED, RECEIVED_IDS, WRONG, NSUMS };
+
+bool run(MPI_Comm cart, migrate::Backend backend, int steps)
+{
+    int rank, ntasks;
+    MPI_Comm_rank(cart, &rank);
+    MPI_Comm_size(cart, &ntasks);
+
+    migrate::Migrator<Particle> migrator(cart, backend);
+    auto owner = [](const Particle &p) { return p.destination; };
+    std::mt19937 gen(4321 + rank);
+    std::uniform_int_distribution<int> destination(0, ntasks - 1);
+    std::vector<long> sums(steps * NSUMS, 0);
+    std::vector<Particle> particles;
+
+    for (int s = 0; s < steps; s++) {
+        long *sum = &sums[s * NSUMS];
+        int count = 1000 * (1 + (rank + s) % ntasks);
+        particles.resize(count);
+        for (int i = 0; i < count; i++) {
+            long id = (static_cast<long>(s) * ntasks + rank) * 1000 * ntasks + i;
+            particles[i] = {id, s, destination(gen)};
+            sum[CREATED]++;
+            sum[CREATED_IDS] += id;
+        }
+        migrator.exchange(particles, owner);
+        for (auto &p : particles) {
+            sum[RECEIVED]++;
+            sum[RECEIVED_IDS] += p.id;
+            sum[WRONG] += p.step != s || p.destination != rank;
+        }
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, sums.data(), sums.size(), MPI_LONG, MPI_SUM, cart);
+    bool ok = true;
+    for (int s = 0; s < steps; s++) {
+        long *sum = &sums[s * NSUMS];
+        if (sum[RECEIVED] != sum[CREATED] || sum[RECEIVED_IDS] != sum[CREATED_IDS] ||
+            sum[WRONG] != 0) {
+            if (0 == rank)
+                fprintf(stderr, "Something is wrong: %s step %d received %ld of %ld "
+                        "particles, %ld in the wrong step or rank!!!\n",
+                        migrate::backend_name(backend), s, sum[RECEIVED], sum[CREATED],
+                        sum[WRONG]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int ntasks, rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    // Particles go to any rank, which the neighbor migration does not allow
+    int dims[2] = {0, 0}, periods[2] = {1, 1};
+    MPI_Dims_create(ntasks, 2, dims);
+    MPI_Comm cart;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &cart);
+
+    bool ok = true;
+    for (auto backend : {migrate::Backend::alltoall, migrate::Backend::nbx})
+        ok = run(cart, backend, 50) && ok;
+    if (0 == rank && ok)
+        printf("migration.hpp: all checks passed\n");
+
+    MPI_Comm_free(&cart);
+    MPI_Finalize();
+    return ok ? 0 : 1;
+}
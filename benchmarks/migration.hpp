@@ -0,0 +1,303 @@
+// Migration of particles to the ranks that own them.
+//
+// After every step of a particle code some particles have left the domain
+// of their rank. They are bucketed by their new owner (counting sort into
+// one send buffer), removed from the local array, and sent with the
+// datatype of the particle from struct-type.hpp. The receivers learn how
+// many particles arrive in one of three ways:
+//  - alltoall: MPI_Alltoall of the counts and MPI_Alltoallv, dense over
+//              all ranks
+//  - neighbor: MPI_Neighbor_alltoall of the counts and
+//              MPI_Neighbor_alltoallv over a graph of the 3^ndims - 1
+//              surrounding domains, so particles may move at most one
+//              domain per step
+//  - nbx:      the sparse "nonblocking consensus": MPI_Issend to each
+//              destination, MPI_Iprobe for incoming particles, and an
+//              MPI_Ibarrier started after the own sends have completed,
+//              which completes once all particles have been received
+// All buffers are kept between the steps, so that after the first steps
+// the migration does no allocation.
+
+#ifndef __MIGRATION_HPP__
+#define __MIGRATION_HPP__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <mpi.h>
+
+#include "struct-type.hpp"
+
+namespace migrate {
+
+enum class Backend { alltoall, neighbor, nbx };
+
+inline const char *backend_name(Backend b)
+{
+    switch (b) {
+    case Backend::alltoall:
+        return "alltoall";
+    case Backend::neighbor:
+        return "neighbor";
+    default:
+        return "nbx";
+    }
+}
+
+// Box [0, length) decomposed over a Cartesian communicator, periodic in
+// the periodic dimensions of the communicator
+class CartDomain {
+public:
+    CartDomain(MPI_Comm cart, const std::vector<double> &length) : length(length) {
+        int ndims;
+        MPI_Cartdim_get(cart, &ndims);
+        dims.resize(ndims);
+        periods.resize(ndims);
+        coords.resize(ndims);
+        MPI_Cart_get(cart, ndims, dims.data(), periods.data(), coords.data());
+    }
+
+    int ndims() const { return dims.size(); }
+
+    // Part of the box owned by this rank in dimension d
+    double lower(int d) const { return length[d] * coords[d] / dims[d]; }
+    double upper(int d) const { return length[d] * (coords[d] + 1) / dims[d]; }
+
+    // Rank owning position x (ndims coordinates). Positions outside the
+    // box wrap around in periodic dimensions and belong to the boundary
+    // domains in the others.
+    int owner(const double *x) const {
+        int rank = 0;
+        for (int d = 0; d < ndims(); d++) {
+            int c = static_cast<int>(std::floor(x[d] / length[d] * dims[d]));
+            if (periods[d])
+                c = ((c % dims[d]) + dims[d]) % dims[d];
+            else
+                c = std::min(std::max(c, 0), dims[d] - 1);
+            rank = rank * dims[d] + c;    // row major as MPI_Cart_rank
+        }
+        return rank;
+    }
+
+private:
+    std::vector<double> length;
+    std::vector<int> dims, periods, coords;
+};
+
+template <typename T>
+class Migrator {
+public:
+    // Collective over cart, which must be a Cartesian communicator
+    Migrator(MPI_Comm cart, Backend backend) : backend(backend) {
+        MPI_Comm_dup(cart, &comm);
+        MPI_Comm_size(comm, &ntasks);
+        MPI_Comm_rank(comm, &rank);
+        counts.resize(ntasks);
+        displs.resize(ntasks);
+        if (backend == Backend::alltoall) {
+            recvcounts.resize(ntasks);
+            recvdispls.resize(ntasks);
+        } else if (backend == Backend::neighbor) {
+            create_graph(cart);
+        }
+    }
+
+    Migrator(const Migrator &) = delete;
+    Migrator &operator=(const Migrator &) = delete;
+
+    ~Migrator() {
+        if (graph != MPI_COMM_NULL)
+            MPI_Comm_free(&graph);
+        MPI_Comm_free(&comm);
+    }
+
+    // Collective. Sends every particle p to rank owner(p) and appends the
+    // particles received to particles, the order of the particles that
+    // stay is kept. Returns the number of particles sent away.
+    template <typename Owner>
+    long exchange(std::vector<T> &particles, Owner &&owner) {
+        long sent = bucket(particles, owner);
+        switch (backend) {
+        case Backend::alltoall:
+            exchange_alltoall(particles);
+            break;
+        case Backend::neighbor:
+            exchange_neighbor(particles);
+            break;
+        case Backend::nbx:
+            exchange_nbx(particles);
+            break;
+        }
+        return sent;
+    }
+
+private:
+    // The nbx exchanges alternate between two tags. A rank that has left
+    // the barrier of an exchange can send the particles of the next one
+    // while its neighbours still probe for those of this one, but it
+    // cannot get further ahead.
+    static constexpr int tag = 43;
+
+    // Neighbours are the distinct ranks of the surrounding domains, in
+    // increasing order, the same for sending and receiving
+    void create_graph(MPI_Comm cart) {
+        int ndims;
+        MPI_Cartdim_get(cart, &ndims);
+        std::vector<int> dims(ndims), periods(ndims), coords(ndims), shifted(ndims);
+        MPI_Cart_get(cart, ndims, dims.data(), periods.data(), coords.data());
+
+        int nshifts = 1;
+        for (int d = 0; d < ndims; d++)
+            nshifts *= 3;
+        for (int s = 0; s < nshifts; s++) {
+            bool inside = true;
+            for (int d = 0, k = s; d < ndims; d++, k /= 3) {
+                shifted[d] = coords[d] + k % 3 - 1;
+                if (!periods[d] && (shifted[d] < 0 || shifted[d] >= dims[d]))
+                    inside = false;
+            }
+            int r;
+            if (inside) {
+                MPI_Cart_rank(cart, shifted.data(), &r);
+                if (r != rank)
+                    nghbrs.push_back(r);
+            }
+        }
+        std::sort(nghbrs.begin(), nghbrs.end());
+        nghbrs.erase(std::unique(nghbrs.begin(), nghbrs.end()), nghbrs.end());
+
+        MPI_Dist_graph_create_adjacent(comm, nghbrs.size(), nghbrs.data(), MPI_UNWEIGHTED,
+                                       nghbrs.size(), nghbrs.data(), MPI_UNWEIGHTED,
+                                       MPI_INFO_NULL, 0, &graph);
+        nsendcounts.resize(nghbrs.size());
+        nsenddispls.resize(nghbrs.size());
+        recvcounts.resize(nghbrs.size());
+        recvdispls.resize(nghbrs.size());
+    }
+
+    // Leaving particles to sendbuf, grouped by destination rank
+    template <typename Owner>
+    long bucket(std::vector<T> &particles, Owner &owner) {
+        std::fill(counts.begin(), counts.end(), 0);
+        destinations.resize(particles.size());
+        for (size_t i = 0; i < particles.size(); i++) {
+            destinations[i] = owner(particles[i]);
+            if (destinations[i] != rank)
+                counts[destinations[i]]++;
+        }
+        int total = 0;
+        for (int r = 0; r < ntasks; r++) {
+            displs[r] = total;
+            total += counts[r];
+        }
+
+        sendbuf.resize(total);
+        next = displs;
+        size_t kept = 0;
+        for (size_t i = 0; i < particles.size(); i++) {
+            if (destinations[i] == rank)
+                particles[kept++] = particles[i];
+            else
+                sendbuf[next[destinations[i]]++] = particles[i];
+        }
+        particles.resize(kept);
+        return total;
+    }
+
+    void exchange_alltoall(std::vector<T> &particles) {
+        MPI_Alltoall(counts.data(), 1, MPI_INT, recvcounts.data(), 1, MPI_INT, comm);
+        size_t kept = receive_space(particles);
+        MPI_Alltoallv(sendbuf.data(), counts.data(), displs.data(), dtype::get<T>(),
+                      particles.data() + kept, recvcounts.data(), recvdispls.data(),
+                      dtype::get<T>(), comm);
+    }
+
+    // The neighbours are in increasing order of rank like the buckets
+    void exchange_neighbor(std::vector<T> &particles) {
+        int moved = 0;
+        for (size_t i = 0; i < nghbrs.size(); i++) {
+            nsendcounts[i] = counts[nghbrs[i]];
+            nsenddispls[i] = displs[nghbrs[i]];
+            moved += nsendcounts[i];
+        }
+        if (moved != static_cast<int>(sendbuf.size())) {
+            fprintf(stderr, "Rank %d: particles moved beyond the surrounding domains, "
+                    "use the nbx or alltoall migration\n", rank);
+            MPI_Abort(comm, 1);
+        }
+        MPI_Neighbor_alltoall(nsendcounts.data(), 1, MPI_INT, recvcounts.data(), 1, MPI_INT,
+                              graph);
+        size_t kept = receive_space(particles);
+        MPI_Neighbor_alltoallv(sendbuf.data(), nsendcounts.data(), nsenddispls.data(),
+                               dtype::get<T>(), particles.data() + kept, recvcounts.data(),
+                               recvdispls.data(), dtype::get<T>(), graph);
+    }
+
+    void exchange_nbx(std::vector<T> &particles) {
+        int round_tag = tag + (rounds++ & 1);
+        requests.clear();
+        for (int r = 0; r < ntasks; r++)
+            if (counts[r] > 0) {
+                requests.emplace_back();
+                MPI_Issend(sendbuf.data() + displs[r], counts[r], dtype::get<T>(), r,
+                           round_tag, comm, &requests.back());
+            }
+
+        MPI_Request barrier = MPI_REQUEST_NULL;
+        bool sent = false, done = false;
+        while (!done) {
+            int arrived;
+            MPI_Status status;
+            MPI_Iprobe(MPI_ANY_SOURCE, round_tag, comm, &arrived, &status);
+            if (arrived) {
+                int n;
+                MPI_Get_count(&status, dtype::get<T>(), &n);
+                size_t kept = particles.size();
+                particles.resize(kept + n);
+                MPI_Recv(particles.data() + kept, n, dtype::get<T>(), status.MPI_SOURCE,
+                         round_tag, comm, MPI_STATUS_IGNORE);
+            }
+            int flag;
+            if (!sent) {
+                // Synchronous sends complete when they have been received
+                MPI_Testall(requests.size(), requests.data(), &flag, MPI_STATUSES_IGNORE);
+                if (flag) {
+                    MPI_Ibarrier(comm, &barrier);
+                    sent = true;
+                }
+            } else {
+                MPI_Test(&barrier, &flag, MPI_STATUS_IGNORE);
+                done = flag;
+            }
+        }
+    }
+
+    // Room after the kept particles for recvcounts, returns where it starts
+    size_t receive_space(std::vector<T> &particles) {
+        int total = 0;
+        for (size_t i = 0; i < recvcounts.size(); i++) {
+            recvdispls[i] = total;
+            total += recvcounts[i];
+        }
+        size_t kept = particles.size();
+        particles.resize(kept + total);
+        return kept;
+    }
+
+    MPI_Comm comm, graph = MPI_COMM_NULL;
+    Backend backend;
+    int rank, ntasks;
+    std::vector<int> counts, displs, next;        // per rank
+    std::vector<int> nghbrs;                      // neighbor
+    std::vector<int> nsendcounts, nsenddispls;    // neighbor, per neighbour
+    std::vector<int> recvcounts, recvdispls;      // per rank or neighbour
+    std::vector<int> destinations;                // of the local particles
+    std::vector<T> sendbuf;
+    std::vector<MPI_Request> requests;
+    unsigned rounds = 0;                          // nbx exchanges
+};
+
+} // namespace migrate
+
+#endif  // __MIGRATION_HPP__
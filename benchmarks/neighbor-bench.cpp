@@ -0,0 +1,325 @@
+// Neighbourhood communication benchmark in a Cartesian process topology.
+//
+// Compares neighbourhood collectives (MPI_Neighbor_allgather and
+// MPI_Neighbor_alltoall) with the equivalent point-to-point exchanges.
+// Run with --help to see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+// Buffers and neighbours of one message size. The blocks of the buffers
+// follow the neighbourhood collective ordering: for each dimension first
+// the source and then the destination of MPI_Cart_shift.
+struct Context {
+    MPI_Comm comm;
+    bool alltoall;               // false: allgather
+    int count;                   // doubles per neighbour
+    std::vector<int> nghbrs;     // 2 * ndims neighbours
+    std::vector<double> sendbuf;
+    std::vector<double> recvbuf;
+
+    int nblocks() const { return nghbrs.size(); }
+    double *send_block(int b) { return sendbuf.data() + (alltoall ? b * count : 0); }
+    double *recv_block(int b) { return recvbuf.data() + b * count; }
+    // Tag of a message is the block index it is sent from, so that the
+    // receiver can tell apart both directions also when the two
+    // neighbours are the same rank (periodic dimension of size two)
+    static int opposite(int b) { return b ^ 1; }
+};
+
+using bench::Exchange;
+using bench::with_requests;
+
+using Method = std::function<Exchange(Context &)>;
+
+// Shift along each direction: send to one neighbour and receive from the
+// one on the opposite side, so that every step pairs up along the grid
+Exchange sendrecv(Context &c)
+{
+    return {[&c] {
+        for (int b = 0; b < c.nblocks(); b++) {
+            int o = Context::opposite(b);
+            MPI_Sendrecv(c.send_block(b), c.count, MPI_DOUBLE, c.nghbrs[b], b,
+                         c.recv_block(o), c.count, MPI_DOUBLE, c.nghbrs[o], b,
+                         c.comm, MPI_STATUS_IGNORE);
+        }
+    }};
+}
+
+Exchange isend(Context &c)
+{
+    auto reqs = std::make_shared<std::vector<MPI_Request>>(2 * c.nblocks());
+    return with_requests(reqs, [&c, reqs] {
+        for (int b = 0; b < c.nblocks(); b++) {
+            MPI_Irecv(c.recv_block(b), c.count, MPI_DOUBLE, c.nghbrs[b],
+                      Context::opposite(b), c.comm, &(*reqs)[2 * b]);
+            MPI_Isend(c.send_block(b), c.count, MPI_DOUBLE, c.nghbrs[b], b,
+                      c.comm, &(*reqs)[2 * b + 1]);
+        }
+    });
+}
+
+Exchange neighbor(Context &c)
+{
+    return {[&c] {
+        if (c.alltoall)
+            MPI_Neighbor_alltoall(c.sendbuf.data(), c.count, MPI_DOUBLE,
+                                  c.recvbuf.data(), c.count, MPI_DOUBLE, c.comm);
+        else
+            MPI_Neighbor_allgather(c.sendbuf.data(), c.count, MPI_DOUBLE,
+                                   c.recvbuf.data(), c.count, MPI_DOUBLE, c.comm);
+    }};
+}
+
+Exchange ineighbor(Context &c)
+{
+    auto reqs = std::make_shared<std::vector<MPI_Request>>(1);
+    return with_requests(reqs, [&c, reqs] {
+        if (c.alltoall)
+            MPI_Ineighbor_alltoall(c.sendbuf.data(), c.count, MPI_DOUBLE,
+                                   c.recvbuf.data(), c.count, MPI_DOUBLE, c.comm,
+                                   reqs->data());
+        else
+            MPI_Ineighbor_allgather(c.sendbuf.data(), c.count, MPI_DOUBLE,
+                                    c.recvbuf.data(), c.count, MPI_DOUBLE, c.comm,
+                                    reqs->data());
+    });
+}
+
+// Persistent point-to-point: the requests are created once and only
+// started and completed in the timed loop
+Exchange persistent(Context &c)
+{
+    auto reqs = std::make_shared<std::vector<MPI_Request>>(2 * c.nblocks());
+    for (int b = 0; b < c.nblocks(); b++) {
+        MPI_Recv_init(c.recv_block(b), c.count, MPI_DOUBLE, c.nghbrs[b],
+                      Context::opposite(b), c.comm, &(*reqs)[2 * b]);
+        MPI_Send_init(c.send_block(b), c.count, MPI_DOUBLE, c.nghbrs[b], b,
+                      c.comm, &(*reqs)[2 * b + 1]);
+    }
+    Exchange ex = with_requests(reqs, [reqs] {
+        MPI_Startall(reqs->size(), reqs->data());
+    });
+    ex.free = [reqs] {
+        for (auto &r : *reqs)
+            MPI_Request_free(&r);
+    };
+    return ex;
+}
+
+// Persistent neighbourhood collectives are new in MPI-4, so they need
+// both the headers at compile time and a library that reports version 4
+bool have_persistent_collectives()
+{
+#if MPI_VERSION >= 4
+    int version, subversion;
+    MPI_Get_version(&version, &subversion);
+    return version >= 4;
+#else
+    return false;
+#endif
+}
+
+Exchange neighbor_init(Context &c)
+{
+    auto reqs = std::make_shared<std::vector<MPI_Request>>(1, MPI_REQUEST_NULL);
+#if MPI_VERSION >= 4
+    if (c.alltoall)
+        MPI_Neighbor_alltoall_init(c.sendbuf.data(), c.count, MPI_DOUBLE,
+                                   c.recvbuf.data(), c.count, MPI_DOUBLE, c.comm,
+                                   MPI_INFO_NULL, reqs->data());
+    else
+        MPI_Neighbor_allgather_init(c.sendbuf.data(), c.count, MPI_DOUBLE,
+                                    c.recvbuf.data(), c.count, MPI_DOUBLE, c.comm,
+                                    MPI_INFO_NULL, reqs->data());
+#else
+    (void)c;
+#endif
+    Exchange ex = with_requests(reqs, [reqs] { MPI_Start(reqs->data()); });
+    ex.free = [reqs] { MPI_Request_free(reqs->data()); };
+    return ex;
+}
+
+// Fill the send buffer so that every block identifies its sender and
+// position, and check that each received block came from the right place
+void fill(Context &c, int rank)
+{
+    int nsend = c.alltoall ? c.nblocks() : 1;
+    for (int b = 0; b < nsend; b++)
+        std::fill(c.send_block(b), c.send_block(b) + c.count,
+                  rank * 100.0 + (c.alltoall ? b : 0));
+    std::fill(c.recvbuf.begin(), c.recvbuf.end(), -1.0);
+}
+
+bool check(Context &c)
+{
+    auto sent = [&c](int rank, int b) { return rank * 100.0 + (c.alltoall ? b : 0); };
+    for (int b = 0; b < c.nblocks(); b++)
+        if (!bench::check_neighbor_block(c.recv_block(b), c.count, c.nghbrs, b, -1.0, sent))
+            return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    const std::vector<std::pair<std::string, Method>> all_methods = {
+        {"sendrecv", sendrecv},
+        {"isend", isend},
+        {"persistent", persistent},
+        {"neighbor", neighbor},
+        {"ineighbor", ineighbor},
+        {"neighbor-init", neighbor_init},
+    };
+
+    bench::Args args(argc, argv);
+    auto pattern = args.get("pattern", "alltoall", "alltoall or allgather");
+    auto methods = args.get_list("methods", "sendrecv,isend,persistent,neighbor,ineighbor,neighbor-init",
+                                 "comma separated list of exchange methods");
+    int ndims = args.get_int("ndims", 3, "dimensions of the Cartesian grid");
+    int periodic = args.get_int("periodic", 0, "periodic boundaries (0/1)");
+    int min_count = args.get_int("min-count", 128, "smallest message in doubles");
+    int max_count = args.get_int("max-count", 512 * 1024, "largest message in doubles");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    double compute_us = args.get_double("compute-us", 0.0,
+                                        "computation between start and wait, "
+                                        "0 disables the overlap measurement");
+    int polls = args.get_int("test-polls", 0, "MPI_Test calls during the computation");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format) &&
+              (pattern == "alltoall" || pattern == "allgather");
+    std::vector<std::pair<std::string, const Method *>> selected;
+    for (auto &name : methods) {
+        const Method *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else if (name == "neighbor-init" && !have_persistent_collectives()) {
+            if (0 == world_rank)
+                fprintf(stderr, "Skipping %s: MPI library does not support "
+                        "MPI-4 persistent collectives\n", name.c_str());
+        } else {
+            selected.push_back({name, m});
+        }
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    std::vector<int> dims(ndims, 0), periods(ndims, periodic);
+    MPI_Dims_create(ntasks, ndims, dims.data());
+
+    Context c;
+    c.alltoall = pattern == "alltoall";
+    MPI_Cart_create(MPI_COMM_WORLD, ndims, dims.data(), periods.data(), 1, &c.comm);
+    MPI_Comm_rank(c.comm, &rank);
+
+    // Results are collected to rank 0 of the Cartesian communicator
+    bench::Reporter reporter(format, output, c.comm);
+    std::string grid;
+    for (int i = 0; i < ndims; i++)
+        grid += (i ? " x " : "") + std::to_string(dims[i]);
+    reporter.comment(std::to_string(ntasks) + " ntasks in " + grid + " grid, bytes per "
+                     "neighbour, MB/s sent per rank to all neighbours");
+
+    // Determine neighbors
+    c.nghbrs.resize(2 * ndims);
+    for (int i = 0; i < ndims; i++)
+        MPI_Cart_shift(c.comm, i, 1, &c.nghbrs[2 * i], &c.nghbrs[2 * i + 1]);
+
+    // Messages sent per exchange, averaged over the ranks, for the MB/s
+    int sends = 0, total_sends;
+    for (int n : c.nghbrs)
+        sends += n != MPI_PROC_NULL;
+    MPI_Allreduce(&sends, &total_sends, 1, MPI_INT, MPI_SUM, c.comm);
+    double messages = static_cast<double>(total_sends) / ntasks;
+
+    // Time of the computation alone, reference for the overlap
+    bench::Workload work(compute_us * 1.0e-6);
+    bench::Summary compute;
+    if (compute_us > 0.0)
+        compute = bench::gather_summary(
+            bench::measure(c.comm, warmup, repeat, [&work] { work.run(); }), c.comm);
+
+    for (int count : bench::count_range(min_count, max_count)) {
+        c.count = count;
+        c.sendbuf.assign(c.alltoall ? count * c.nblocks() : count, 0.0);
+        c.recvbuf.assign(count * c.nblocks(), 0.0);
+
+        for (auto &method : selected) {
+            fill(c, rank);
+
+            // Setup time matters for persistent methods, which pay off
+            // only when it is amortized over enough iterations
+            MPI_Barrier(c.comm);
+            double t0 = MPI_Wtime();
+            Exchange ex = (*method.second)(c);
+            double setup = MPI_Wtime() - t0, max_setup;
+            MPI_Reduce(&setup, &max_setup, 1, MPI_DOUBLE, MPI_MAX, 0, c.comm);
+
+            auto samples = bench::measure(c.comm, warmup, repeat, [&ex] { ex.run(); });
+            auto summary = bench::gather_summary(samples, c.comm);
+            std::vector<std::pair<std::string, double>> extra = {
+                {"setup_us", max_setup * 1.0e6}};
+
+            // Computation between start and wait. With full overlap the
+            // total time is the longer of the two parts, without overlap
+            // it is their sum. Blocking methods compute after the exchange.
+            if (compute_us > 0.0) {
+                auto overlapped = bench::gather_summary(
+                    bench::measure(c.comm, warmup, repeat, [&ex, &work, polls] {
+                        ex.start();
+                        work.run(polls + 1, ex.test);
+                        ex.wait();
+                    }), c.comm);
+                double hidden = summary.median + compute.median - overlapped.median;
+                double shorter = std::min(summary.median, compute.median);
+                double overlap = shorter > 0.0 ? hidden / shorter : 0.0;
+                extra.push_back({"compute_us", compute.median * 1.0e6});
+                extra.push_back({"overlapped_us", overlapped.median * 1.0e6});
+                extra.push_back({"overlap", std::max(0.0, std::min(1.0, overlap))});
+            }
+
+            int valid = check(c), all_valid;
+            MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, c.comm);
+            ex.free();
+
+            long bytes = count * sizeof(double);
+            reporter.add({pattern, method.first, bytes, summary, extra, messages * bytes});
+            if (0 == rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s with %d doubles gave "
+                        "wrong data!!!\n", method.first.c_str(), count);
+        }
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&c.comm);
+    MPI_Finalize();
+}
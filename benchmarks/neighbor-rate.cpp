@@ -0,0 +1,232 @@
+// Latency and message rate of small neighbour messages in a Cartesian
+// process topology.
+//
+// The halos of strong scaled runs are small, so that the time goes to
+// latency and per message overheads instead of bandwidth. Every timed
+// operation is a window of exchanges with all neighbours: with the
+// nonblocking methods all messages of the window are in flight at the same
+// time, the blocking ones repeat the exchange. Run with --help to see the
+// options.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+// Buffers of one message size. The blocks follow the neighbourhood
+// collective ordering, and every exchange of the window receives to its
+// own slot of blocks.
+struct Context {
+    MPI_Comm comm;
+    int bytes;                   // per message
+    int window;                  // exchanges per timed operation
+    std::vector<int> nghbrs;     // 2 * ndims neighbours
+    std::vector<unsigned char> sendbuf;
+    std::vector<unsigned char> recvbuf;
+
+    int nblocks() const { return nghbrs.size(); }
+    unsigned char *send_block(int b) { return sendbuf.data() + b * bytes; }
+    unsigned char *recv_slot(int w) { return recvbuf.data() + w * nblocks() * bytes; }
+    unsigned char *recv_block(int w, int b) { return recv_slot(w) + b * bytes; }
+    static int opposite(int b) { return b ^ 1; }
+};
+
+using Method = std::function<void(Context &)>;
+
+// Shift along each direction as in neighbor-bench, one exchange after
+// another
+void sendrecv(Context &c)
+{
+    for (int w = 0; w < c.window; w++)
+        for (int b = 0; b < c.nblocks(); b++) {
+            int o = Context::opposite(b);
+            MPI_Sendrecv(c.send_block(b), c.bytes, MPI_BYTE, c.nghbrs[b], b,
+                         c.recv_block(w, o), c.bytes, MPI_BYTE, c.nghbrs[o], b,
+                         c.comm, MPI_STATUS_IGNORE);
+        }
+}
+
+// All receives of the window are posted before the sends, messages with
+// the same tag match in order
+void isend(Context &c)
+{
+    int nb = c.nblocks();
+    std::vector<MPI_Request> reqs(2 * c.window * nb);
+    for (int w = 0; w < c.window; w++)
+        for (int b = 0; b < nb; b++)
+            MPI_Irecv(c.recv_block(w, b), c.bytes, MPI_BYTE, c.nghbrs[b],
+                      Context::opposite(b), c.comm, &reqs[w * nb + b]);
+    for (int w = 0; w < c.window; w++)
+        for (int b = 0; b < nb; b++)
+            MPI_Isend(c.send_block(b), c.bytes, MPI_BYTE, c.nghbrs[b], b, c.comm,
+                      &reqs[(c.window + w) * nb + b]);
+    MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+}
+
+void neighbor(Context &c)
+{
+    for (int w = 0; w < c.window; w++)
+        MPI_Neighbor_alltoall(c.sendbuf.data(), c.bytes, MPI_BYTE, c.recv_slot(w),
+                              c.bytes, MPI_BYTE, c.comm);
+}
+
+void ineighbor(Context &c)
+{
+    std::vector<MPI_Request> reqs(c.window);
+    for (int w = 0; w < c.window; w++)
+        MPI_Ineighbor_alltoall(c.sendbuf.data(), c.bytes, MPI_BYTE, c.recv_slot(w),
+                               c.bytes, MPI_BYTE, c.comm, &reqs[w]);
+    MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+}
+
+unsigned char value(int rank, int b)
+{
+    return 1 + (rank * 8 + b) % 251;
+}
+
+void fill(Context &c, int rank)
+{
+    for (int b = 0; b < c.nblocks(); b++)
+        std::fill(c.send_block(b), c.send_block(b) + c.bytes, value(rank, b));
+    std::fill(c.recvbuf.begin(), c.recvbuf.end(), 0);
+}
+
+// Block b of every slot comes from neighbour b, which sends the block of
+// the opposite direction
+bool check(Context &c)
+{
+    for (int w = 0; w < c.window; w++)
+        for (int b = 0; b < c.nblocks(); b++)
+            if (!bench::check_neighbor_block(c.recv_block(w, b), c.bytes, c.nghbrs, b,
+                                             static_cast<unsigned char>(0), value))
+                return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    const std::vector<std::pair<std::string, Method>> all_methods = {
+        {"sendrecv", sendrecv},
+        {"isend", isend},
+        {"neighbor", neighbor},
+        {"ineighbor", ineighbor},
+    };
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "sendrecv,isend,neighbor,ineighbor",
+                                 "comma separated list of exchange methods");
+    auto windows = args.get_list("window", "1,16,64",
+                                 "comma separated exchanges per timed operation");
+    int ndims = args.get_int("ndims", 3, "dimensions of the Cartesian grid");
+    int periodic = args.get_int("periodic", 1, "periodic boundaries (0/1)");
+    int min_bytes = args.get_int("min-bytes", 8, "smallest message in bytes");
+    int max_bytes = args.get_int("max-bytes", 1024, "largest message in bytes");
+    int warmup = args.get_int("warmup", 10, "untimed operations per size");
+    int repeat = args.get_int("repeat", 200, "timed operations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format);
+    std::vector<std::pair<std::string, const Method *>> selected;
+    for (auto &name : methods) {
+        const Method *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else {
+            selected.push_back({name, m});
+        }
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    std::vector<int> dims(ndims, 0), periods(ndims, periodic);
+    MPI_Dims_create(ntasks, ndims, dims.data());
+
+    Context c;
+    MPI_Cart_create(MPI_COMM_WORLD, ndims, dims.data(), periods.data(), 1, &c.comm);
+    MPI_Comm_rank(c.comm, &rank);
+    c.nghbrs.resize(2 * ndims);
+    for (int i = 0; i < ndims; i++)
+        MPI_Cart_shift(c.comm, i, 1, &c.nghbrs[2 * i], &c.nghbrs[2 * i + 1]);
+
+    // Messages sent per exchange, summed over all ranks, and the number of
+    // nodes for the rates per node
+    MPI_Comm node;
+    int node_rank, leader, nnodes, sends = 0, total_sends;
+    MPI_Comm_split_type(c.comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    leader = 0 == node_rank;
+    MPI_Allreduce(&leader, &nnodes, 1, MPI_INT, MPI_SUM, c.comm);
+    MPI_Comm_free(&node);
+    for (int n : c.nghbrs)
+        sends += n != MPI_PROC_NULL;
+    MPI_Allreduce(&sends, &total_sends, 1, MPI_INT, MPI_SUM, c.comm);
+
+    bench::Reporter reporter(format, output, c.comm);
+    std::string grid;
+    for (int i = 0; i < ndims; i++)
+        grid += (i ? " x " : "") + std::to_string(dims[i]);
+    reporter.comment(std::to_string(ntasks) + " ntasks on " + std::to_string(nnodes) +
+                     " nodes in " + grid + " grid, times are per window, us_per_op "
+                     "per exchange with all neighbours, MB/s sent per rank");
+
+    for (auto &win : windows) {
+        c.window = std::max(1, std::atoi(win.c_str()));
+        for (int bytes : bench::count_range(min_bytes, max_bytes)) {
+            c.bytes = bytes;
+            c.sendbuf.assign(bytes * c.nblocks(), 0);
+            c.recvbuf.assign(bytes * c.nblocks() * c.window, 0);
+
+            for (auto &method : selected) {
+                fill(c, rank);
+                auto samples = bench::measure(c.comm, warmup, repeat,
+                                              [&c, &method] { (*method.second)(c); });
+                int valid = check(c), all_valid;
+                MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, c.comm);
+
+                auto summary = bench::gather_summary(samples, c.comm);
+                double t = summary.median > 0.0 ? summary.median : 1.0;
+                double messages = static_cast<double>(total_sends) * c.window;
+                reporter.add({"window=" + std::to_string(c.window), method.first, bytes,
+                              summary,
+                              {{"us_per_op", summary.median / c.window * 1.0e6},
+                               {"pair_msgs_per_s", c.window / t},
+                               {"rank_msgs_per_s", messages / ntasks / t},
+                               {"node_msgs_per_s", messages / nnodes / t}},
+                              messages / ntasks * bytes});
+                if (0 == rank && !all_valid)
+                    fprintf(stderr, "Something is wrong: %s with %d bytes gave "
+                            "wrong data!!!\n", method.first.c_str(), bytes);
+            }
+        }
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&c.comm);
+    MPI_Finalize();
+}
@@ -0,0 +1,257 @@
+// Calibration of a node for the stencil of the heat equation solver: the
+// memory bandwidth ceiling and how close the five-point stencil gets to it
+// for local blocks of different sizes.
+//
+//  - stream:  the STREAM copy (a = b) and triad (a = b + s c) kernels on
+//             1, 2, 4, ... ranks of every node at the same time, the other
+//             ranks idle. The arrays of a node hold --stream-mb MB each
+//             in total, by default four times the last level cache, so
+//             that they come from memory for every number of ranks.
+//  - stencil: the five-point stencil of evolve() in the heat solver on all
+//             ranks at the same time, each on its own square tile sized to
+//             fit in L1, L2 or the share of L3 of the rank, or to come from
+//             memory (or the edge lengths given with --tiles).
+// The stencil does 12 flop and moves 16 bytes per point (read of the old
+// and write of the new value, without write-allocate as in STREAM), an
+// arithmetic intensity of 0.75 flop/byte. Its roofline bound is the
+// intensity times the best triad bandwidth of a node, which is the ceiling
+// column, and fraction is the bandwidth achieved over that of the best
+// triad. Tiles resident in the caches can exceed the ceiling. All
+// bandwidths and flop rates are per node. Run with --help to see the
+// options.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+// Floating point operations and bytes of one point of the stencil
+constexpr double stencil_flops = 12.0;
+constexpr double stencil_bytes = 16.0;
+
+// Cache size in bytes from sysconf, or fallback if it is not known
+long cache_size(int name, long fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+// Arrays of a STREAM kernel on one rank
+struct Stream {
+    explicit Stream(size_t n) : a(n, 0.0), b(n, 1.0), c(n, 2.0) {}
+
+    void copy() {
+        size_t n = a.size();
+        double *__restrict__ pa = a.data();
+        const double *__restrict__ pb = b.data();
+        for (size_t i = 0; i < n; i++)
+            pa[i] = pb[i];
+    }
+
+    void triad() {
+        size_t n = a.size();
+        double *__restrict__ pa = a.data();
+        const double *__restrict__ pb = b.data();
+        const double *__restrict__ pc = c.data();
+        for (size_t i = 0; i < n; i++)
+            pa[i] = pb[i] + 3.0 * pc[i];
+    }
+
+    std::vector<double> a, b, c;
+};
+
+// Two fields of n x n inner points with ghost layers, updated as in
+// evolve() of the heat equation solver
+class Tile {
+public:
+    explicit Tile(int n) : n(n), curr((n + 2) * (n + 2), 0.0), prev(curr) {
+        for (int i = 0; i < n + 2; i++)
+            prev[i] = curr[i] = 100.0;    // hot boundary like the solver
+    }
+
+    void sweep() {
+        const double a = 0.5, dx2 = 1.0e-4, dy2 = 1.0e-4;
+        const double dt = dx2 * dy2 / (2.0 * a * (dx2 + dy2));
+        const int w = n + 2;
+        double *__restrict__ c = curr.data();
+        const double *__restrict__ p = prev.data();
+        for (int i = 1; i < n + 1; i++)
+            for (int j = 1; j < n + 1; j++) {
+                int k = i * w + j;
+                c[k] = p[k] + a * dt *
+                       ((p[k + w] - 2.0 * p[k] + p[k - w]) / dx2 +
+                        (p[k + 1] - 2.0 * p[k] + p[k - 1]) / dy2);
+            }
+        std::swap(curr, prev);
+    }
+
+    double value() const { return prev[(n + 2) + 1]; }
+
+private:
+    int n;
+    std::vector<double> curr, prev;
+};
+
+int main(int argc, char **argv)
+{
+    int rank, ntasks, node_rank, node_size;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    MPI_Comm node;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_size(node, &node_size);
+    int nodes = node_rank == 0;
+    MPI_Allreduce(MPI_IN_PLACE, &nodes, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    long l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32L << 10);
+    long l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 1L << 20);
+    long l3 = cache_size(_SC_LEVEL3_CACHE_SIZE, 32L << 20);
+    long default_mb = std::min(std::max(4 * l3 >> 20, 64L), 512L);
+
+    bench::Args args(argc, argv);
+    int stream_mb = args.get_int("stream-mb", default_mb,
+                                 "MB of each STREAM array per node (default 4 x L3, "
+                                 "64 - 512)");
+    auto tiles = args.get_list("tiles", "", "comma separated tile edge lengths (default "
+                               "from the cache sizes)");
+    int warmup = args.get_int("warmup", 2, "untimed iterations");
+    int repeat = args.get_int("repeat", 10, "timed iterations");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+    if (!bench::Reporter::valid(format) || stream_mb < 1) {
+        if (0 == rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    bench::Reporter reporter(format, output, MPI_COMM_WORLD);
+    reporter.comment(std::to_string(nodes) + " nodes, " + std::to_string(node_size) +
+                     " ranks on the node of rank 0, caches L1 " + std::to_string(l1 >> 10) +
+                     " KiB, L2 " + std::to_string(l2 >> 10) + " KiB, L3 " +
+                     std::to_string(l3 >> 10) + " KiB");
+    reporter.comment("GB_s and GFLOP_s per node, ceiling = intensity x best triad "
+                     "bandwidth, fraction = GB_s / best triad bandwidth");
+
+    // Rows: benchmark, method, bytes per rank and iteration, samples and
+    // the number of active ranks per node
+    struct Row {
+        std::string benchmark, method;
+        double bytes, flops;
+        bench::Summary time;
+        int active;
+    };
+    std::vector<Row> rows;
+
+    // STREAM with 1, 2, 4, ... ranks per node
+    std::vector<int> actives;
+    for (int k = 1; k < node_size; k *= 2)
+        actives.push_back(k);
+    actives.push_back(node_size);
+    double ceiling = 0.0;
+    for (int active : actives) {
+        size_t n = static_cast<size_t>(stream_mb) * (1 << 20) / sizeof(double) / active;
+        bool on = node_rank < active;
+        Stream stream(on ? n : 0);
+        for (int kernel = 0; kernel < 2; kernel++) {
+            auto samples = bench::measure(MPI_COMM_WORLD, warmup, repeat, [&] {
+                if (!on)
+                    return;
+                if (kernel == 0)
+                    stream.copy();
+                else
+                    stream.triad();
+            });
+            if (!on)
+                samples.clear();
+            auto time = bench::gather_summary(samples, MPI_COMM_WORLD);
+            double bytes = (kernel == 0 ? 2.0 : 3.0) * sizeof(double) * n;
+            rows.push_back({"stream", kernel == 0 ? "copy" : "triad", bytes,
+                            kernel == 0 ? 0.0 : 2.0 * n, time, active});
+            if (kernel == 1 && 0 == rank && time.median > 0.0)
+                ceiling = std::max(ceiling, active * bytes / time.median);
+        }
+        int valid = !on || (stream.a[n / 2] == 7.0);
+        MPI_Reduce(0 == rank ? MPI_IN_PLACE : &valid, &valid, 1, MPI_INT, MPI_LAND, 0,
+                   MPI_COMM_WORLD);
+        if (0 == rank && !valid) {
+            fprintf(stderr, "Something is wrong: triad with %d ranks per node gave wrong "
+                    "data!!!\n", active);
+        }
+    }
+
+    // Stencil on all ranks, tiles for each level of the memory hierarchy.
+    // A tile of edge n has 2 (n + 2)^2 doubles, filled to half of L1 and
+    // L2, half of the share of L3 of the rank, and four times that share.
+    std::vector<std::pair<std::string, int>> sizes;
+    auto edge = [](double bytes) {
+        return std::max(8, static_cast<int>(std::sqrt(bytes / 16.0)) - 2);
+    };
+    if (tiles.empty()) {
+        double l3_share = static_cast<double>(l3) / node_size;
+        sizes = {{"L1", edge(0.5 * l1)}, {"L2", edge(0.5 * l2)},
+                 {"L3", edge(0.5 * l3_share)}, {"DRAM", edge(4.0 * l3_share)}};
+        if (sizes[3].second < edge(4.0 * l2))
+            sizes[3].second = edge(4.0 * l2);
+    } else {
+        for (auto &t : tiles)
+            sizes.push_back({"tile", std::max(1, std::atoi(t.c_str()))});
+    }
+    for (auto &size : sizes) {
+        int n = size.second;
+        double points = static_cast<double>(n) * n;
+        // Enough sweeps for a sample of about 2^24 points
+        int sweeps = std::max(1, static_cast<int>((1 << 24) / points));
+        Tile tile(n);
+        auto samples = bench::measure(MPI_COMM_WORLD, warmup, repeat, [&] {
+            for (int s = 0; s < sweeps; s++)
+                tile.sweep();
+        });
+        auto time = bench::gather_summary(samples, MPI_COMM_WORLD);
+        std::string method = size.first + " " + std::to_string(n) + "x" + std::to_string(n);
+        rows.push_back({"stencil", method, stencil_bytes * points * sweeps,
+                        stencil_flops * points * sweeps, time, node_size});
+
+        // Heat flows in from the hot boundary but stays below it
+        double v = tile.value();
+        int valid = v > 0.0 && v <= 100.0;
+        MPI_Reduce(0 == rank ? MPI_IN_PLACE : &valid, &valid, 1, MPI_INT, MPI_LAND, 0,
+                   MPI_COMM_WORLD);
+        if (0 == rank && !valid) {
+            fprintf(stderr, "Something is wrong: stencil on %dx%d tile gave wrong "
+                    "data!!!\n", n, n);
+        }
+    }
+
+    for (auto &r : rows) {
+        double median = r.time.median > 0.0 ? r.time.median : 1.0;
+        double gbs = r.active * r.bytes / median * 1.0e-9;
+        double gflops = r.active * r.flops / median * 1.0e-9;
+        double intensity = r.flops / r.bytes;
+        reporter.add({r.benchmark, r.method, static_cast<long>(r.bytes), r.time,
+                      {{"active", static_cast<double>(r.active)},
+                       {"GB_s", gbs},
+                       {"GFLOP_s", gflops},
+                       {"intensity", intensity},
+                       {"ceiling", intensity * ceiling * 1.0e-9},
+                       {"fraction", ceiling > 0.0 ? gbs * 1.0e9 / ceiling : 0.0}}});
+    }
+    reporter.write();
+
+    MPI_Comm_free(&node);
+    MPI_Finalize();
+}
@@ -0,0 +1,328 @@
+// Exchange of particles stored as an array of structs (AoS) or as a
+// structure of arrays (SoA).
+//
+// The particle of the struct datatype exercise is sent
+//  - struct: as AoS with the struct datatype of struct-type.hpp
+//  - bytes:  as AoS with MPI_BYTE, including the padding of the struct
+//  - pack:   as AoS packed with MPI_Pack and unpacked with MPI_Unpack
+//  - soa:    as SoA with a datatype of one block in every array, see
+//            particles.hpp
+// in two patterns: sendrecv swaps all particles between pairs of ranks,
+// alltoallv redistributes them evenly over all ranks with MPI_Alltoallv
+// (MPI_Alltoallw for soa, which needs a datatype per peer). The SoA
+// datatypes are created in every operation, as the particle counts of a
+// real code change from step to step. Run with --help to see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+#include "particles.hpp"
+
+using particles::Particle;
+
+struct Context {
+    MPI_Comm comm;
+    int rank, ntasks;
+    int partner;                      // sendrecv, MPI_PROC_NULL if none
+    int count;                        // particles per rank
+    std::vector<int> counts, displs;  // particles from every rank to each rank
+    std::vector<Particle> aos_send, aos_recv;
+    particles::Arrays soa_send, soa_recv;
+    std::vector<char> packed_send, packed_recv;
+
+    // Received particles: count with sendrecv, counts[rank] from each rank
+    // with alltoallv
+    int received(bool alltoallv) const { return alltoallv ? counts[rank] * ntasks : count; }
+};
+
+using Method = std::function<void(Context &)>;
+
+struct Layout {
+    Method sendrecv, alltoallv;
+};
+
+void struct_sendrecv(Context &c)
+{
+    MPI_Datatype type = dtype::get<Particle>();
+    MPI_Sendrecv(c.aos_send.data(), c.count, type, c.partner, 0, c.aos_recv.data(), c.count,
+                 type, c.partner, 0, c.comm, MPI_STATUS_IGNORE);
+}
+
+void struct_alltoallv(Context &c)
+{
+    std::vector<int> rcounts(c.ntasks, c.counts[c.rank]), rdispls(c.ntasks);
+    for (int r = 0; r < c.ntasks; r++)
+        rdispls[r] = r * c.counts[c.rank];
+    MPI_Datatype type = dtype::get<Particle>();
+    MPI_Alltoallv(c.aos_send.data(), c.counts.data(), c.displs.data(), type,
+                  c.aos_recv.data(), rcounts.data(), rdispls.data(), type, c.comm);
+}
+
+void bytes_sendrecv(Context &c)
+{
+    int bytes = c.count * sizeof(Particle);
+    MPI_Sendrecv(c.aos_send.data(), bytes, MPI_BYTE, c.partner, 0, c.aos_recv.data(), bytes,
+                 MPI_BYTE, c.partner, 0, c.comm, MPI_STATUS_IGNORE);
+}
+
+void bytes_alltoallv(Context &c)
+{
+    int size = sizeof(Particle);
+    std::vector<int> scounts(c.ntasks), sdispls(c.ntasks), rcounts(c.ntasks), rdispls(c.ntasks);
+    for (int r = 0; r < c.ntasks; r++) {
+        scounts[r] = c.counts[r] * size;
+        sdispls[r] = c.displs[r] * size;
+        rcounts[r] = c.counts[c.rank] * size;
+        rdispls[r] = r * rcounts[r];
+    }
+    MPI_Alltoallv(c.aos_send.data(), scounts.data(), sdispls.data(), MPI_BYTE,
+                  c.aos_recv.data(), rcounts.data(), rdispls.data(), MPI_BYTE, c.comm);
+}
+
+void pack_sendrecv(Context &c)
+{
+    MPI_Datatype type = dtype::get<Particle>();
+    int size, position = 0;
+    MPI_Pack_size(c.count, type, c.comm, &size);
+    MPI_Pack(c.aos_send.data(), c.count, type, c.packed_send.data(), size, &position, c.comm);
+    MPI_Sendrecv(c.packed_send.data(), position, MPI_PACKED, c.partner, 0,
+                 c.packed_recv.data(), size, MPI_PACKED, c.partner, 0, c.comm,
+                 MPI_STATUS_IGNORE);
+    if (c.partner != MPI_PROC_NULL) {
+        position = 0;
+        MPI_Unpack(c.packed_recv.data(), size, &position, c.aos_recv.data(), c.count, type,
+                   c.comm);
+    }
+}
+
+// Every block is packed to a slot of MPI_Pack_size bytes, which is the
+// same on the sending and the receiving rank
+void pack_alltoallv(Context &c)
+{
+    MPI_Datatype type = dtype::get<Particle>();
+    std::vector<int> scounts(c.ntasks), sdispls(c.ntasks), rcounts(c.ntasks), rdispls(c.ntasks);
+    int rsize, offset = 0;
+    MPI_Pack_size(c.counts[c.rank], type, c.comm, &rsize);
+    for (int r = 0; r < c.ntasks; r++) {
+        MPI_Pack_size(c.counts[r], type, c.comm, &scounts[r]);
+        sdispls[r] = offset;
+        offset += scounts[r];
+        int position = sdispls[r];
+        MPI_Pack(c.aos_send.data() + c.displs[r], c.counts[r], type, c.packed_send.data(),
+                 offset, &position, c.comm);
+        rcounts[r] = rsize;
+        rdispls[r] = r * rsize;
+    }
+    MPI_Alltoallv(c.packed_send.data(), scounts.data(), sdispls.data(), MPI_PACKED,
+                  c.packed_recv.data(), rcounts.data(), rdispls.data(), MPI_PACKED, c.comm);
+    for (int r = 0; r < c.ntasks; r++) {
+        int position = rdispls[r];
+        MPI_Unpack(c.packed_recv.data(), rdispls[r] + rsize, &position,
+                   c.aos_recv.data() + r * c.counts[c.rank], c.counts[c.rank], type, c.comm);
+    }
+}
+
+void soa_sendrecv(Context &c)
+{
+    MPI_Datatype stype = c.soa_send.range_type(0, c.count);
+    MPI_Datatype rtype = c.soa_recv.range_type(0, c.count);
+    MPI_Sendrecv(MPI_BOTTOM, 1, stype, c.partner, 0, MPI_BOTTOM, 1, rtype, c.partner, 0,
+                 c.comm, MPI_STATUS_IGNORE);
+    MPI_Type_free(&stype);
+    MPI_Type_free(&rtype);
+}
+
+void soa_alltoallv(Context &c)
+{
+    std::vector<int> ones(c.ntasks, 1), zeros(c.ntasks, 0);
+    std::vector<MPI_Datatype> stypes(c.ntasks), rtypes(c.ntasks);
+    for (int r = 0; r < c.ntasks; r++) {
+        stypes[r] = c.soa_send.range_type(c.displs[r], c.counts[r]);
+        rtypes[r] = c.soa_recv.range_type(r * c.counts[c.rank], c.counts[c.rank]);
+    }
+    MPI_Alltoallw(MPI_BOTTOM, ones.data(), zeros.data(), stypes.data(), MPI_BOTTOM,
+                  ones.data(), zeros.data(), rtypes.data(), c.comm);
+    for (int r = 0; r < c.ntasks; r++) {
+        MPI_Type_free(&stypes[r]);
+        MPI_Type_free(&rtypes[r]);
+    }
+}
+
+Particle value(int rank, int i)
+{
+    return {{static_cast<float>(i % 1000000), static_cast<float>(rank), 0.5f * (i % 100)},
+            rank * 7 + i % 13,
+            {static_cast<char>('A' + rank % 26), static_cast<char>('a' + i % 26)}};
+}
+
+bool equal(const Particle &a, const Particle &b)
+{
+    return a.coords[0] == b.coords[0] && a.coords[1] == b.coords[1] &&
+           a.coords[2] == b.coords[2] && a.charge == b.charge &&
+           a.label[0] == b.label[0] && a.label[1] == b.label[1];
+}
+
+void fill(Context &c, bool soa)
+{
+    Particle empty = {{0.0f, 0.0f, 0.0f}, 0, {0, 0}};
+    for (int i = 0; i < c.count; i++) {
+        if (soa)
+            c.soa_send.set(i, value(c.rank, i));
+        else
+            c.aos_send[i] = value(c.rank, i);
+    }
+    for (size_t i = 0; i < c.aos_recv.size(); i++) {
+        if (soa)
+            c.soa_recv.set(i, empty);
+        else
+            c.aos_recv[i] = empty;
+    }
+}
+
+// Particle j from rank s is received to s * counts[rank] + j with
+// alltoallv, and it is particle displs[rank] + j of rank s
+bool check(Context &c, bool soa, bool alltoallv)
+{
+    for (int i = 0; i < c.received(alltoallv); i++) {
+        Particle p = soa ? c.soa_recv.get(i) : c.aos_recv[i];
+        Particle expected;
+        if (alltoallv)
+            expected = value(i / c.counts[c.rank], c.displs[c.rank] + i % c.counts[c.rank]);
+        else if (c.partner != MPI_PROC_NULL)
+            expected = value(c.partner, i);
+        else
+            return true;
+        if (!equal(p, expected))
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int ntasks, rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    const std::vector<std::pair<std::string, Layout>> all_methods = {
+        {"struct", {struct_sendrecv, struct_alltoallv}},
+        {"bytes", {bytes_sendrecv, bytes_alltoallv}},
+        {"pack", {pack_sendrecv, pack_alltoallv}},
+        {"soa", {soa_sendrecv, soa_alltoallv}},
+    };
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "struct,bytes,pack,soa",
+                                 "comma separated list of layouts");
+    auto patterns = args.get_list("patterns", "sendrecv,alltoallv",
+                                  "comma separated list of sendrecv and alltoallv");
+    int min_count = args.get_int("min-count", 16, "fewest particles per rank");
+    int max_count = args.get_int("max-count", 1048576, "most particles per rank");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format);
+    std::vector<std::pair<std::string, const Layout *>> selected;
+    for (auto &name : methods) {
+        const Layout *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else {
+            selected.push_back({name, m});
+        }
+    }
+    for (auto &pattern : patterns)
+        if (pattern != "sendrecv" && pattern != "alltoallv") {
+            if (0 == rank)
+                fprintf(stderr, "Unknown pattern %s\n", pattern.c_str());
+            ok = false;
+        }
+    if (!ok) {
+        if (0 == rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    Context c;
+    c.comm = MPI_COMM_WORLD;
+    c.rank = rank;
+    c.ntasks = ntasks;
+    c.partner = (rank ^ 1) < ntasks ? rank ^ 1 : MPI_PROC_NULL;
+
+    int data_size;
+    MPI_Type_size(dtype::get<Particle>(), &data_size);
+
+    bench::Reporter reporter(format, output, c.comm);
+    reporter.comment(std::to_string(ntasks) + " ntasks, particles of " +
+                     std::to_string(sizeof(Particle)) + " bytes (" +
+                     std::to_string(data_size) + " bytes of data), bytes are the data sent "
+                     "by each rank");
+
+    for (int count : bench::count_range(min_count, max_count)) {
+        c.count = count;
+        c.counts.assign(ntasks, 0);
+        c.displs.assign(ntasks, 0);
+        for (int r = 0; r < ntasks; r++) {
+            c.counts[r] = count / ntasks + (r < count % ntasks);
+            c.displs[r] = r > 0 ? c.displs[r - 1] + c.counts[r - 1] : 0;
+        }
+        // Room for count particles and for all blocks of alltoallv
+        int room = std::max(count, c.counts[0] * ntasks);
+        c.aos_send.resize(count);
+        c.aos_recv.resize(room);
+        c.soa_send.resize(count);
+        c.soa_recv.resize(room);
+        int whole, block, send_room = 0;
+        MPI_Pack_size(count, dtype::get<Particle>(), c.comm, &whole);
+        for (int r = 0; r < ntasks; r++) {
+            MPI_Pack_size(c.counts[r], dtype::get<Particle>(), c.comm, &block);
+            send_room += block;
+        }
+        MPI_Pack_size(c.counts[rank], dtype::get<Particle>(), c.comm, &block);
+        c.packed_send.resize(std::max(whole, send_room));
+        c.packed_recv.resize(std::max(whole, block * ntasks));
+
+        for (auto &pattern : patterns) {
+            bool alltoallv = pattern == "alltoallv";
+            for (auto &method : selected) {
+                bool soa = method.first == "soa";
+                const Method &op = alltoallv ? method.second->alltoallv
+                                             : method.second->sendrecv;
+                fill(c, soa);
+                auto samples = bench::measure(c.comm, warmup, repeat, [&c, &op] { op(c); });
+                int valid = check(c, soa, alltoallv), all_valid;
+                MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, c.comm);
+
+                reporter.add({pattern, method.first, static_cast<long>(count) * data_size,
+                              bench::gather_summary(samples, c.comm),
+                              {{"particles", static_cast<double>(count)}}});
+                if (0 == rank && !all_valid)
+                    fprintf(stderr, "Something is wrong: %s %s with %d particles gave "
+                            "wrong data!!!\n", pattern.c_str(), method.first.c_str(), count);
+            }
+        }
+    }
+
+    reporter.write();
+
+    MPI_Finalize();
+}
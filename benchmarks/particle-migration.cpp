@@ -0,0 +1,200 @@
+// Migration of particles between the domains of a Cartesian decomposition,
+// see migration.hpp.
+//
+// Every rank starts with particles spread uniformly over its domain, each
+// with a constant random velocity of up to --speed domain widths per step
+// in every direction, in a periodic box. After every step the particles
+// that left the domain are sent to their new owner, and the time of this
+// migration is measured:
+//  - alltoall: counts with MPI_Alltoall, particles with MPI_Alltoallv
+//  - neighbor: counts with MPI_Neighbor_alltoall, particles with
+//              MPI_Neighbor_alltoallv to the surrounding domains
+//  - nbx:      MPI_Issend of the particles, MPI_Iprobe and MPI_Ibarrier
+// The particle is a struct with padding, sent with the datatype of
+// struct-type.hpp. Run with --help to see the options.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+#include "migration.hpp"
+
+struct Particle {
+    double x[3];
+    double v[3];
+    long id;
+    int species;
+};
+MPI_STRUCT_TYPE(Particle, x, v, id, species)
+
+// Uniform in the domain of this rank, with ids unique over all ranks
+std::vector<Particle> create(const migrate::CartDomain &domain, int count, double speed,
+                             int rank)
+{
+    std::mt19937 gen(1234 + rank);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<Particle> particles(count);
+    for (int i = 0; i < count; i++) {
+        auto &p = particles[i];
+        for (int d = 0; d < 3; d++) {
+            p.x[d] = 0.0;
+            p.v[d] = 0.0;
+        }
+        for (int d = 0; d < domain.ndims(); d++) {
+            p.x[d] = domain.lower(d) + unit(gen) * (domain.upper(d) - domain.lower(d));
+            p.v[d] = speed * (2.0 * unit(gen) - 1.0);
+        }
+        p.id = static_cast<long>(rank) * count + i;
+        p.species = i % 3;
+    }
+    return particles;
+}
+
+// The box is [0, dims[d]), every domain has unit width
+void move(std::vector<Particle> &particles, const std::vector<int> &dims)
+{
+    for (auto &p : particles)
+        for (size_t d = 0; d < dims.size(); d++) {
+            p.x[d] += p.v[d];
+            p.x[d] -= dims[d] * std::floor(p.x[d] / dims[d]);
+        }
+}
+
+// All particles are on their owner, none lost or duplicated
+bool check(const std::vector<Particle> &particles, const migrate::CartDomain &domain,
+           long total, int rank, MPI_Comm comm)
+{
+    bool owned = true;
+    long sums[2] = {static_cast<long>(particles.size()), 0};
+    for (auto &p : particles) {
+        owned = owned && domain.owner(p.x) == rank;
+        sums[1] += p.id;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, sums, 2, MPI_LONG, MPI_SUM, comm);
+    return owned && sums[0] == total && sums[1] == total * (total - 1) / 2;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    const std::vector<std::pair<std::string, migrate::Backend>> all_methods = {
+        {"alltoall", migrate::Backend::alltoall},
+        {"neighbor", migrate::Backend::neighbor},
+        {"nbx", migrate::Backend::nbx},
+    };
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "alltoall,neighbor,nbx",
+                                 "comma separated list of migration methods");
+    auto counts = args.get_list("particles", "1000,100000",
+                                "comma separated particles per rank");
+    auto speeds = args.get_list("speed", "0.01,0.1",
+                                "comma separated largest velocities in domain widths per "
+                                "step, at most 1");
+    int ndims = args.get_int("ndims", 3, "dimensions of the domain (1-3)");
+    int warmup = args.get_int("warmup", 3, "untimed steps");
+    int repeat = args.get_int("repeat", 20, "timed steps");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format) && ndims >= 1 && ndims <= 3;
+    std::vector<std::pair<std::string, migrate::Backend>> selected;
+    for (auto &name : methods) {
+        const migrate::Backend *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else {
+            selected.push_back({name, *m});
+        }
+    }
+    for (auto &s : speeds)
+        if (std::atof(s.c_str()) > 1.0)
+            ok = false;
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    std::vector<int> dims(ndims, 0), periods(ndims, 1);
+    MPI_Dims_create(ntasks, ndims, dims.data());
+    MPI_Comm cart;
+    MPI_Cart_create(MPI_COMM_WORLD, ndims, dims.data(), periods.data(), 1, &cart);
+    MPI_Comm_rank(cart, &rank);
+    migrate::CartDomain domain(cart, std::vector<double>(dims.begin(), dims.end()));
+    auto owner = [&domain](const Particle &p) { return domain.owner(p.x); };
+
+    int data_size;
+    MPI_Type_size(dtype::get<Particle>(), &data_size);
+
+    bench::Reporter reporter(format, output, cart);
+    std::string grid;
+    for (int i = 0; i < ndims; i++)
+        grid += (i ? " x " : "") + std::to_string(dims[i]);
+    reporter.comment(std::to_string(ntasks) + " ntasks in periodic " + grid + " grid, times "
+                     "are per migration, bytes the mean data sent per rank");
+
+    for (auto &c : counts) {
+        int count = std::max(1, std::atoi(c.c_str()));
+        long total = static_cast<long>(count) * ntasks;
+        for (auto &s : speeds) {
+            double speed = std::atof(s.c_str());
+            for (auto &method : selected) {
+                migrate::Migrator<Particle> migrator(cart, method.second);
+                auto particles = create(domain, count, speed, rank);
+
+                std::vector<double> samples;
+                long sent = 0;
+                for (int step = 0; step < warmup + repeat; step++) {
+                    move(particles, dims);
+                    MPI_Barrier(cart);
+                    double t0 = MPI_Wtime();
+                    long n = migrator.exchange(particles, owner);
+                    double t = MPI_Wtime() - t0;
+                    if (step >= warmup) {
+                        samples.push_back(t);
+                        sent += n;
+                    }
+                }
+                int valid = check(particles, domain, total, rank, cart);
+                MPI_Allreduce(MPI_IN_PLACE, &sent, 1, MPI_LONG, MPI_SUM, cart);
+                double moved = static_cast<double>(sent) / ntasks / repeat;
+
+                reporter.add({"speed=" + s, method.first,
+                              static_cast<long>(moved * data_size),
+                              bench::gather_summary(samples, cart),
+                              {{"particles", static_cast<double>(count)},
+                               {"moved_per_rank", moved}}});
+                if (0 == rank && !valid)
+                    fprintf(stderr, "Something is wrong: %s with %d particles gave wrong "
+                            "data!!!\n", method.first.c_str(), count);
+            }
+        }
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&cart);
+    MPI_Finalize();
+}
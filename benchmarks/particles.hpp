@@ -0,0 +1,86 @@
+// Particles of the struct datatype exercise as an array of structs and as
+// a structure of arrays.
+//
+// The struct (float coords[3]; int charge; char label[2]) has two bytes of
+// padding, so that an array of them needs a struct datatype, MPI_BYTE
+// including the padding or packing. In the structure of arrays every
+// member is a contiguous array of its own, and a range of particles is a
+// datatype of one contiguous block in each array: an hindexed struct with
+// the absolute addresses of the blocks, used with MPI_BOTTOM as the
+// buffer.
+
+#ifndef __PARTICLES_HPP__
+#define __PARTICLES_HPP__
+
+#include <cstddef>
+#include <vector>
+#include <mpi.h>
+
+#include "struct-type.hpp"
+
+namespace particles {
+
+struct Particle {
+    float coords[3];
+    int charge;
+    char label[2];
+};
+
+// Structure of arrays, particle i is coords[0..2][i], charge[i] and
+// label[2 * i], label[2 * i + 1]
+class Arrays {
+public:
+    explicit Arrays(size_t n = 0) { resize(n); }
+
+    size_t size() const { return charge.size(); }
+
+    void resize(size_t n) {
+        for (auto &c : coords)
+            c.resize(n);
+        charge.resize(n);
+        label.resize(2 * n);
+    }
+
+    Particle get(size_t i) const {
+        return {{coords[0][i], coords[1][i], coords[2][i]}, charge[i],
+                {label[2 * i], label[2 * i + 1]}};
+    }
+
+    void set(size_t i, const Particle &p) {
+        for (int d = 0; d < 3; d++)
+            coords[d][i] = p.coords[d];
+        charge[i] = p.charge;
+        label[2 * i] = p.label[0];
+        label[2 * i + 1] = p.label[1];
+    }
+
+    // Committed datatype of particles [first, first + count), to be used
+    // with MPI_BOTTOM. It is valid until the arrays are resized, free it
+    // with MPI_Type_free.
+    MPI_Datatype range_type(size_t first, size_t count) const {
+        int blocklens[5] = {static_cast<int>(count), static_cast<int>(count),
+                            static_cast<int>(count), static_cast<int>(count),
+                            static_cast<int>(2 * count)};
+        MPI_Datatype types[5] = {MPI_FLOAT, MPI_FLOAT, MPI_FLOAT, MPI_INT, MPI_CHAR};
+        MPI_Aint displs[5];
+        for (int d = 0; d < 3; d++)
+            MPI_Get_address(coords[d].data() + first, &displs[d]);
+        MPI_Get_address(charge.data() + first, &displs[3]);
+        MPI_Get_address(label.data() + 2 * first, &displs[4]);
+
+        MPI_Datatype type;
+        MPI_Type_create_struct(5, blocklens, displs, types, &type);
+        MPI_Type_commit(&type);
+        return type;
+    }
+
+    std::vector<float> coords[3];
+    std::vector<int> charge;
+    std::vector<char> label;
+};
+
+} // namespace particles
+
+MPI_STRUCT_TYPE(particles::Particle, coords, charge, label)
+
+#endif  // __PARTICLES_HPP__
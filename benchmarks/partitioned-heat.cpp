@@ -0,0 +1,385 @@
+// Halo exchange of an OpenMP threaded 2D heat equation solver, with the
+// boundary sent as soon as each thread has computed its part of it.
+//
+// The rows of the local domain are divided between the threads. The thread
+// owning the first (last) row computes it first and marks the upper (lower)
+// face ready, and every thread marks its part of the left and right faces
+// ready when its rows are done. With MPI-4 partitioned communication
+// (MPI_Psend_init / MPI_Precv_init and MPI_Pready) every thread owns a
+// partition of the left and right faces. The same early sends are done also
+// with one MPI_Isend per thread and partition, and both are compared with a
+// bulk send by the master thread after a thread barrier. Run with --help to
+// see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <mpi.h>
+#include <omp.h>
+
+#include "bench.hpp"
+
+// Local field of nx x ny points with one layer of ghost points
+struct Field {
+    int nx, ny;
+    std::vector<double> data;
+
+    double &operator()(int i, int j) { return data[i * (ny + 2) + j]; }
+    double operator()(int i, int j) const { return data[i * (ny + 2) + j]; }
+};
+
+enum class Method { bulk, thread_isend, partitioned };
+
+const std::vector<std::pair<std::string, Method>> all_methods = {
+    {"bulk", Method::bulk},
+    {"thread-isend", Method::thread_isend},
+    {"partitioned", Method::partitioned},
+};
+
+// Faces in the order up, down, left, right. The upper and lower faces are
+// one partition, the left and right faces one partition of plen rows per
+// thread (the last partitions are padded if nx is not divisible).
+struct Context {
+    MPI_Comm cart;
+    int nghbrs[4];
+    int nthreads, nx, ny;
+    double cx, cy;                     // a * dt / dx^2 and a * dt / dy^2
+    std::vector<double> sendbuf[4], recvbuf[4];
+    std::vector<MPI_Request> recvs;
+    std::vector<MPI_Request> psend, precv;   // partitioned, one per face
+
+    static int opposite(int f) { return f ^ 1; }
+    int plen() const { return (nx + nthreads - 1) / nthreads; }
+    int partitions(int f) const { return f < 2 ? 1 : nthreads; }
+    int partition_size(int f) const { return f < 2 ? ny : plen(); }
+    int tag(int f, int p) const { return f * nthreads + p; }
+};
+
+// Partitioned communication is new in MPI-4, so it needs both the headers
+// at compile time and a library that reports version 4
+bool have_partitioned()
+{
+#if MPI_VERSION >= 4
+    int version, subversion;
+    MPI_Get_version(&version, &subversion);
+    return version >= 4;
+#else
+    return false;
+#endif
+}
+
+void setup(Context &c)
+{
+    for (int f = 0; f < 4; f++) {
+        c.sendbuf[f].assign(c.partitions(f) * c.partition_size(f), 0.0);
+        c.recvbuf[f].assign(c.sendbuf[f].size(), 0.0);
+    }
+    c.psend.assign(4, MPI_REQUEST_NULL);
+    c.precv.assign(4, MPI_REQUEST_NULL);
+#if MPI_VERSION >= 4
+    if (!have_partitioned())
+        return;
+    for (int f = 0; f < 4; f++) {
+        if (c.nghbrs[f] == MPI_PROC_NULL)
+            continue;
+        MPI_Psend_init(c.sendbuf[f].data(), c.partitions(f), c.partition_size(f),
+                       MPI_DOUBLE, c.nghbrs[f], c.tag(f, 0), c.cart, MPI_INFO_NULL,
+                       &c.psend[f]);
+        MPI_Precv_init(c.recvbuf[f].data(), c.partitions(f), c.partition_size(f),
+                       MPI_DOUBLE, c.nghbrs[f], c.tag(Context::opposite(f), 0), c.cart,
+                       MPI_INFO_NULL, &c.precv[f]);
+    }
+#endif
+}
+
+void release(Context &c)
+{
+    for (auto &r : c.psend)
+        if (r != MPI_REQUEST_NULL)
+            MPI_Request_free(&r);
+    for (auto &r : c.precv)
+        if (r != MPI_REQUEST_NULL)
+            MPI_Request_free(&r);
+}
+
+void update_row(const Field &prev, Field &curr, int i, double cx, double cy)
+{
+    for (int j = 1; j <= curr.ny; j++)
+        curr(i, j) = prev(i, j) +
+                     cx * (prev(i + 1, j) - 2.0 * prev(i, j) + prev(i - 1, j)) +
+                     cy * (prev(i, j + 1) - 2.0 * prev(i, j) + prev(i, j - 1));
+}
+
+// Partition p of face f is complete in sendbuf, send it
+void ready(Context &c, Method method, int f, int p, std::vector<MPI_Request> &sends)
+{
+    switch (method) {
+    case Method::bulk:
+        break;
+    case Method::thread_isend:
+        sends.emplace_back();
+        MPI_Isend(&c.sendbuf[f][p * c.partition_size(f)], c.partition_size(f), MPI_DOUBLE,
+                  c.nghbrs[f], c.tag(f, p), c.cart, &sends.back());
+        break;
+    case Method::partitioned:
+#if MPI_VERSION >= 4
+        if (c.psend[f] != MPI_REQUEST_NULL)
+            MPI_Pready(p, c.psend[f]);
+#endif
+        break;
+    }
+}
+
+void post_receives(Context &c, Method method)
+{
+    c.recvs.clear();
+    if (method == Method::partitioned) {
+        for (int f = 0; f < 4; f++)
+            if (c.precv[f] != MPI_REQUEST_NULL) {
+                c.recvs.push_back(c.precv[f]);
+                c.recvs.push_back(c.psend[f]);
+            }
+        if (!c.recvs.empty())
+            MPI_Startall(c.recvs.size(), c.recvs.data());
+        return;
+    }
+    for (int f = 0; f < 4; f++) {
+        int o = Context::opposite(f);
+        int n = method == Method::bulk ? 1 : c.partitions(f);
+        int len = c.recvbuf[f].size() / n;
+        for (int p = 0; p < n; p++) {
+            c.recvs.emplace_back();
+            MPI_Irecv(&c.recvbuf[f][p * len], len, MPI_DOUBLE, c.nghbrs[f], c.tag(o, p),
+                      c.cart, &c.recvs.back());
+        }
+    }
+}
+
+// One time step from prev to curr, including the exchange of the new
+// boundary into the ghost layer of curr. Without communication
+// (communicate = false) only the computation and packing are done.
+void step(Context &c, const Field &prev, Field &curr, Method method, bool communicate)
+{
+    if (communicate)
+        post_receives(c, method);
+
+#pragma omp parallel num_threads(c.nthreads)
+    {
+        int t = omp_get_thread_num();
+        int plen = c.plen();
+        int first = 1 + t * plen, last = std::min(first + plen, c.nx + 1);
+        std::vector<MPI_Request> sends;
+        bool send = communicate && method != Method::bulk;
+
+        if (first == 1) {
+            update_row(prev, curr, 1, c.cx, c.cy);
+            std::copy(&curr(1, 1), &curr(1, 1) + c.ny, c.sendbuf[0].begin());
+            if (send)
+                ready(c, method, 0, 0, sends);
+        }
+        if (first <= c.nx && c.nx < last) {
+            if (c.nx != 1)
+                update_row(prev, curr, c.nx, c.cx, c.cy);
+            std::copy(&curr(c.nx, 1), &curr(c.nx, 1) + c.ny, c.sendbuf[1].begin());
+            if (send)
+                ready(c, method, 1, 0, sends);
+        }
+        for (int i = std::max(first, 2); i < std::min(last, c.nx); i++)
+            update_row(prev, curr, i, c.cx, c.cy);
+        for (int i = first; i < last; i++) {
+            c.sendbuf[2][i - 1] = curr(i, 1);
+            c.sendbuf[3][i - 1] = curr(i, c.ny);
+        }
+        if (send) {
+            ready(c, method, 2, t, sends);
+            ready(c, method, 3, t, sends);
+            if (!sends.empty())
+                MPI_Waitall(sends.size(), sends.data(), MPI_STATUSES_IGNORE);
+        }
+
+        if (communicate && method == Method::bulk) {
+#pragma omp barrier
+#pragma omp master
+            {
+                MPI_Request reqs[4];
+                for (int f = 0; f < 4; f++)
+                    MPI_Isend(c.sendbuf[f].data(), c.sendbuf[f].size(), MPI_DOUBLE,
+                              c.nghbrs[f], c.tag(f, 0), c.cart, &reqs[f]);
+                MPI_Waitall(4, reqs, MPI_STATUSES_IGNORE);
+            }
+        }
+    }
+
+    if (!communicate)
+        return;
+    if (!c.recvs.empty())
+        MPI_Waitall(c.recvs.size(), c.recvs.data(), MPI_STATUSES_IGNORE);
+
+    // Ghost points of the physical boundary keep their fixed values
+    if (c.nghbrs[0] != MPI_PROC_NULL)
+        std::copy(c.recvbuf[0].begin(), c.recvbuf[0].end(), &curr(0, 1));
+    if (c.nghbrs[1] != MPI_PROC_NULL)
+        std::copy(c.recvbuf[1].begin(), c.recvbuf[1].end(), &curr(c.nx + 1, 1));
+    for (int i = 1; i <= c.nx; i++) {
+        if (c.nghbrs[2] != MPI_PROC_NULL)
+            curr(i, 0) = c.recvbuf[2][i - 1];
+        if (c.nghbrs[3] != MPI_PROC_NULL)
+            curr(i, c.ny + 1) = c.recvbuf[3][i - 1];
+    }
+}
+
+// A linear field is a stationary solution, so after one step every
+// interior and exchanged ghost point of curr must hold this again
+double value(int gi, int gj, int ncols)
+{
+    return static_cast<double>(gi) * ncols + gj;
+}
+
+bool verify(Context &c, Method method, const int *coords, int ncols)
+{
+    Field prev = {c.nx, c.ny, {}}, curr = {c.nx, c.ny, {}};
+    prev.data.resize((c.nx + 2) * (c.ny + 2));
+    curr.data.resize(prev.data.size());
+    int gi0 = coords[0] * c.nx, gj0 = coords[1] * c.ny;
+    for (int i = 0; i < c.nx + 2; i++)
+        for (int j = 0; j < c.ny + 2; j++) {
+            prev(i, j) = value(gi0 + i, gj0 + j, ncols);
+            bool ghost = i == 0 || i == c.nx + 1 || j == 0 || j == c.ny + 1;
+            bool fixed = (i == 0 && c.nghbrs[0] == MPI_PROC_NULL) ||
+                         (i == c.nx + 1 && c.nghbrs[1] == MPI_PROC_NULL) ||
+                         (j == 0 && c.nghbrs[2] == MPI_PROC_NULL) ||
+                         (j == c.ny + 1 && c.nghbrs[3] == MPI_PROC_NULL);
+            curr(i, j) = ghost && fixed ? prev(i, j) : -1.0;
+        }
+
+    step(c, prev, curr, method, true);
+
+    for (int i = 0; i < c.nx + 2; i++)
+        for (int j = 0; j < c.ny + 2; j++) {
+            bool corner = (i == 0 || i == c.nx + 1) && (j == 0 || j == c.ny + 1);
+            if (!corner && curr(i, j) != prev(i, j))
+                return false;
+        }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks, provided;
+
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "bulk,thread-isend,partitioned",
+                                 "comma separated list of methods");
+    auto threads = args.get_list("threads", "1,2,4", "comma separated thread counts");
+    int min_size = args.get_int("min-size", 64, "smallest local grid edge");
+    int max_size = args.get_int("max-size", 2048, "largest local grid edge");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format);
+    std::vector<std::pair<std::string, Method>> selected;
+    for (auto &name : methods) {
+        auto it = std::find_if(all_methods.begin(), all_methods.end(),
+                               [&name](const std::pair<std::string, Method> &m) {
+                                   return m.first == name;
+                               });
+        if (it == all_methods.end()) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else if (it->second == Method::partitioned && !have_partitioned()) {
+            if (0 == world_rank)
+                fprintf(stderr, "Skipping partitioned: MPI library does not "
+                        "support MPI-4 partitioned communication\n");
+        } else if (it->second != Method::bulk && provided < MPI_THREAD_MULTIPLE) {
+            if (0 == world_rank)
+                fprintf(stderr, "Skipping %s: MPI library does not provide "
+                        "MPI_THREAD_MULTIPLE\n", name.c_str());
+        } else {
+            selected.push_back(*it);
+        }
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    int dims[2] = {0, 0}, periods[2] = {0, 0}, coords[2];
+    MPI_Dims_create(ntasks, 2, dims);
+
+    Context c;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &c.cart);
+    MPI_Comm_rank(c.cart, &rank);
+    MPI_Cart_coords(c.cart, rank, 2, coords);
+    MPI_Cart_shift(c.cart, 0, 1, &c.nghbrs[0], &c.nghbrs[1]);
+    MPI_Cart_shift(c.cart, 1, 1, &c.nghbrs[2], &c.nghbrs[3]);
+
+    // Stable time step of the heat solver with a = 0.5 and dx = dy
+    c.cx = c.cy = 0.125;
+
+    bench::Reporter reporter(format, output, c.cart);
+    reporter.comment(std::to_string(ntasks) + " ntasks in " + std::to_string(dims[0]) +
+                     " x " + std::to_string(dims[1]) + " grid, times are per time step, "
+                     "exposed is the time on top of the computation alone");
+
+    for (auto &nt : threads) {
+        c.nthreads = std::max(1, std::atoi(nt.c_str()));
+        for (int size : bench::count_range(min_size, max_size)) {
+            c.nx = c.ny = size;
+            setup(c);
+
+            Field a = {c.nx, c.ny, std::vector<double>((c.nx + 2) * (c.ny + 2))};
+            Field b = a;
+            for (int i = 0; i < c.nx + 2; i++)
+                for (int j = 0; j < c.ny + 2; j++)
+                    a(i, j) = b(i, j) = value(coords[0] * c.nx + i, coords[1] * c.ny + j,
+                                              dims[1] * c.ny + 2);
+            auto run = [&](Method method, bool communicate) {
+                step(c, a, b, method, communicate);
+                std::swap(a.data, b.data);
+            };
+
+            auto compute = bench::gather_summary(
+                bench::measure(c.cart, warmup, repeat,
+                               [&] { run(Method::bulk, false); }), c.cart);
+
+            for (auto &m : selected) {
+                auto samples = bench::measure(c.cart, warmup, repeat,
+                                              [&] { run(m.second, true); });
+                int valid = verify(c, m.second, coords, dims[1] * c.ny + 2), all_valid;
+                MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, c.cart);
+
+                auto summary = bench::gather_summary(samples, c.cart);
+                reporter.add({"T=" + nt + " " + std::to_string(size) + "^2", m.first,
+                              static_cast<long>(2 * (c.nx + c.ny) * sizeof(double)),
+                              summary,
+                              {{"compute_us", compute.median * 1e6},
+                               {"exposed_us", (summary.median - compute.median) * 1e6}}});
+                if (0 == rank && !all_valid)
+                    fprintf(stderr, "Something is wrong: %s with %d threads and %d x %d "
+                            "grid gave wrong data!!!\n", m.first.c_str(), c.nthreads,
+                            size, size);
+            }
+            release(c);
+        }
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&c.cart);
+    MPI_Finalize();
+}
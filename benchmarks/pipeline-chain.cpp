@@ -0,0 +1,265 @@
+// Broadcast of a large message along a chain of ranks, with and without
+// pipelining.
+//
+// Rank 0 has the message and every rank forwards it to the next one. With
+// store and forward every hop waits for the whole message, so that the
+// time grows with the number of ranks times the message size. Pipelined,
+// the message is split into chunks and a rank forwards chunk k while the
+// later chunks are still arriving:
+//  - sendrecv: store and forward with MPI_Recv and MPI_Send
+//  - isend:    all chunks received with MPI_Irecv, every chunk forwarded
+//              with MPI_Isend as soon as it has arrived
+//  - rma:      MPI_Put of every chunk into the window of the next rank,
+//              MPI_Win_flush and an MPI_Accumulate to the chunk counter of
+//              the next rank
+//  - bcast:    MPI_Bcast for reference
+// The chunk size is tuned separately for each message size and method
+// unless given with --chunk. Run with --help to see the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+struct Chain {
+    int rank, prev, next;        // MPI_PROC_NULL at the ends
+    int count;                   // message in ints
+    int chunk;                   // chunk in ints
+    std::vector<int> buffer;     // isend, sendrecv and bcast
+    int *window;                 // rma, count ints
+    long *counter;               // rma, chunks received by this rank
+    MPI_Win win, counterwin;
+    long received = 0;           // chunks received in the earlier rounds
+
+    int nchunks() const { return (count + chunk - 1) / chunk; }
+    int offset(int k) const { return k * chunk; }
+    int length(int k) const { return std::min(chunk, count - k * chunk); }
+};
+
+using Method = std::function<void(Chain &)>;
+
+void sendrecv(Chain &c)
+{
+    if (c.prev != MPI_PROC_NULL)
+        MPI_Recv(c.buffer.data(), c.count, MPI_INT, c.prev, 0, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+    if (c.next != MPI_PROC_NULL)
+        MPI_Send(c.buffer.data(), c.count, MPI_INT, c.next, 0, MPI_COMM_WORLD);
+}
+
+// One tag for all chunks: messages between two ranks do not overtake each
+// other, and the receives and sends are posted in chunk order
+void isend(Chain &c)
+{
+    int n = c.nchunks();
+    std::vector<MPI_Request> recvs(n, MPI_REQUEST_NULL), sends(n, MPI_REQUEST_NULL);
+    if (c.prev != MPI_PROC_NULL)
+        for (int k = 0; k < n; k++)
+            MPI_Irecv(&c.buffer[c.offset(k)], c.length(k), MPI_INT, c.prev, 0,
+                      MPI_COMM_WORLD, &recvs[k]);
+    for (int k = 0; k < n; k++) {
+        MPI_Wait(&recvs[k], MPI_STATUS_IGNORE);
+        if (c.next != MPI_PROC_NULL)
+            MPI_Isend(&c.buffer[c.offset(k)], c.length(k), MPI_INT, c.next, 0,
+                      MPI_COMM_WORLD, &sends[k]);
+    }
+    MPI_Waitall(n, sends.data(), MPI_STATUSES_IGNORE);
+}
+
+// Inside a lock_all epoch of both windows. The counter is never reset,
+// chunk k of this round has arrived when it reaches received + k + 1.
+void rma(Chain &c)
+{
+    int n = c.nchunks();
+    long one = 1, value = 0;
+    for (int k = 0; k < n; k++) {
+        if (c.prev != MPI_PROC_NULL) {
+            while (value < c.received + k + 1) {
+                MPI_Fetch_and_op(nullptr, &value, MPI_LONG, c.rank, 0, MPI_NO_OP,
+                                 c.counterwin);
+                MPI_Win_flush(c.rank, c.counterwin);
+            }
+            MPI_Win_sync(c.win);
+        }
+        if (c.next != MPI_PROC_NULL) {
+            MPI_Put(c.window + c.offset(k), c.length(k), MPI_INT, c.next, c.offset(k),
+                    c.length(k), MPI_INT, c.win);
+            MPI_Win_flush(c.next, c.win);
+            MPI_Accumulate(&one, 1, MPI_LONG, c.next, 0, 1, MPI_LONG, MPI_SUM,
+                           c.counterwin);
+            MPI_Win_flush(c.next, c.counterwin);
+        }
+    }
+    c.received += n;
+}
+
+void bcast(Chain &c)
+{
+    MPI_Bcast(c.buffer.data(), c.count, MPI_INT, 0, MPI_COMM_WORLD);
+}
+
+int *data(Chain &c, const std::string &method)
+{
+    return method == "rma" ? c.window : c.buffer.data();
+}
+
+// Time of the whole chain in every repetition: ranks start together after
+// a barrier, and the last one to finish ends the broadcast. Also the
+// warmup rounds are separated by barriers, so that a round never
+// overwrites data that is still forwarded in the previous one.
+std::vector<double> chain_times(Chain &c, const Method &method, int warmup, int repeat)
+{
+    for (int n = 0; n < warmup; n++) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        method(c);
+    }
+    auto samples = bench::measure(MPI_COMM_WORLD, 0, repeat, [&] { method(c); });
+    MPI_Allreduce(MPI_IN_PLACE, samples.data(), samples.size(), MPI_DOUBLE, MPI_MAX,
+                  MPI_COMM_WORLD);
+    return samples;
+}
+
+// Chunk size with the shortest median chain time, the same on all ranks
+int tune(Chain &c, const Method &method, int min_chunk, int repeat)
+{
+    int best = c.count;
+    double best_time = 0.0;
+    for (int chunk : bench::count_range(min_chunk, c.count)) {
+        c.chunk = chunk;
+        double t = bench::summarize(chain_times(c, method, 1, repeat)).median;
+        if (best_time == 0.0 || t < best_time) {
+            best = chunk;
+            best_time = t;
+        }
+    }
+    return best;
+}
+
+bool verify(Chain &c, const Method &method, const std::string &name)
+{
+    int *buf = data(c, name);
+    for (int i = 0; i < c.count; i++)
+        buf[i] = 0 == c.rank ? i % 1000 : -1;
+    if (name == "rma")
+        MPI_Win_sync(c.win);
+    MPI_Barrier(MPI_COMM_WORLD);
+    method(c);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (name == "rma")
+        MPI_Win_sync(c.win);
+    for (int i = 0; i < c.count; i++)
+        if (buf[i] != i % 1000)
+            return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int ntasks, rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    const std::vector<std::pair<std::string, Method>> all_methods = {
+        {"sendrecv", sendrecv},
+        {"isend", isend},
+        {"rma", rma},
+        {"bcast", bcast},
+    };
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "sendrecv,isend,rma,bcast",
+                                 "comma separated list of methods");
+    int min_count = args.get_int("min-count", 1024, "smallest message in ints");
+    int max_count = args.get_int("max-count", 10000000, "largest message in ints");
+    int chunk = args.get_int("chunk", 0, "chunk in ints, 0 tunes it for every size");
+    int min_chunk = args.get_int("min-chunk", 1024, "smallest chunk tried by the tuner");
+    int tune_repeat = args.get_int("tune-repeat", 5, "timed iterations per tried chunk");
+    int warmup = args.get_int("warmup", 3, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 20, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format);
+    std::vector<std::pair<std::string, const Method *>> selected;
+    for (auto &name : methods) {
+        const Method *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else {
+            selected.push_back({name, m});
+        }
+    }
+    if (!ok) {
+        if (0 == rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    Chain c;
+    c.rank = rank;
+    c.prev = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    c.next = rank < ntasks - 1 ? rank + 1 : MPI_PROC_NULL;
+
+    bench::Reporter reporter(format, output, MPI_COMM_WORLD);
+    reporter.comment(std::to_string(ntasks) + " ntasks in a chain, times are until the "
+                     "last rank has the message");
+
+    for (int count : bench::count_range(min_count, max_count)) {
+        c.count = count;
+        c.buffer.assign(count, 0);
+        MPI_Win_allocate(count * sizeof(int), sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD,
+                         &c.window, &c.win);
+        MPI_Win_allocate(sizeof(long), sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD,
+                         &c.counter, &c.counterwin);
+        *c.counter = 0;
+        c.received = 0;
+        MPI_Barrier(MPI_COMM_WORLD);
+        MPI_Win_lock_all(0, c.win);
+        MPI_Win_lock_all(0, c.counterwin);
+
+        for (auto &method : selected) {
+            bool chunked = method.first == "isend" || method.first == "rma";
+            c.chunk = count;
+            if (chunked)
+                c.chunk = chunk > 0 ? std::min(chunk, count)
+                                    : tune(c, *method.second, min_chunk, tune_repeat);
+
+            auto samples = chain_times(c, *method.second, warmup, repeat);
+            int valid = verify(c, *method.second, method.first), all_valid;
+            MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, MPI_COMM_WORLD);
+
+            reporter.add({"chain", method.first, static_cast<long>(count * sizeof(int)),
+                          bench::summarize(samples),
+                          {{"chunk_bytes", static_cast<double>(c.chunk * sizeof(int))},
+                           {"chunks", static_cast<double>(c.nchunks())}}});
+            if (0 == rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s with %d ints gave wrong "
+                        "data!!!\n", method.first.c_str(), count);
+        }
+
+        MPI_Win_unlock_all(c.counterwin);
+        MPI_Win_unlock_all(c.win);
+        MPI_Win_free(&c.counterwin);
+        MPI_Win_free(&c.win);
+    }
+
+    reporter.write();
+
+    MPI_Finalize();
+}
@@ -0,0 +1,351 @@
+// One-sided communication in a message chain, as in the exercise
+// mpi/message-chain-one-sided, for all synchronization modes and kinds of
+// windows.
+//
+// Every rank except the last one transfers a message to the next rank,
+// either with MPI_Put by the sender or with MPI_Get by the receiver. The
+// transfers are timed with
+//  - fence:    MPI_Win_fence before and after (collective)
+//  - pscw:     MPI_Win_post / start / complete / wait with the one neighbour
+//  - lock:     MPI_Win_lock / unlock of the target for every transfer
+//  - lock-all: MPI_Win_lock_all once, MPI_Win_flush after every transfer
+// in windows from MPI_Win_allocate, MPI_Win_create and
+// MPI_Win_create_dynamic, and compared with MPI_Send / MPI_Recv. With lock
+// and lock-all the data is complete at the target when the origin is
+// done, but the target is not notified.
+//
+// In the accumulate chain a counter is passed along the ranks: every rank
+// waits until its own counter is incremented and then increments the one
+// of the next rank, with MPI_Accumulate or MPI_Fetch_and_op. This gives
+// the latency of one atomic notification per hop. Run with --help to see
+// the options.
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+// Window of count ints and the local buffer of the same size. For puts the
+// window receives and the local buffer is sent, for gets the other way.
+struct Window {
+    std::string kind;
+    MPI_Win win;
+    int *base;                   // window memory
+    std::vector<int> local;
+    std::vector<MPI_Aint> disp;  // of every rank's window memory
+    int count;
+
+    Window(const std::string &kind, int count) : kind(kind), count(count) {
+        MPI_Aint bytes = static_cast<MPI_Aint>(count) * sizeof(int);
+        if (kind == "allocate") {
+            MPI_Win_allocate(bytes, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &base, &win);
+        } else if (kind == "create") {
+            MPI_Alloc_mem(bytes, MPI_INFO_NULL, &base);
+            MPI_Win_create(base, bytes, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &win);
+        } else {
+            // Dynamic windows address the target memory with its absolute
+            // address, which has to be communicated
+            MPI_Alloc_mem(bytes, MPI_INFO_NULL, &base);
+            MPI_Win_create_dynamic(MPI_INFO_NULL, MPI_COMM_WORLD, &win);
+            MPI_Win_attach(win, base, bytes);
+        }
+        int ntasks;
+        MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+        MPI_Aint address = 0;
+        if (kind == "dynamic")
+            MPI_Get_address(base, &address);
+        disp.resize(ntasks);
+        MPI_Allgather(&address, 1, MPI_AINT, disp.data(), 1, MPI_AINT, MPI_COMM_WORLD);
+        local.resize(count);
+    }
+
+    Window(const Window &) = delete;
+    Window &operator=(const Window &) = delete;
+
+    ~Window() {
+        if (kind == "dynamic")
+            MPI_Win_detach(win, base);
+        MPI_Win_free(&win);
+        if (kind != "allocate")
+            MPI_Free_mem(base);
+    }
+};
+
+struct Chain {
+    int rank, ntasks;
+    int prev, next;              // MPI_PROC_NULL at the ends
+    bool put;
+    MPI_Group from, to;          // groups of prev and next
+
+    // Put: send to next, get: fetch from prev
+    int target() const { return put ? next : prev; }
+};
+
+void transfer(Window &w, const Chain &c)
+{
+    int t = c.target();
+    if (t == MPI_PROC_NULL)
+        return;
+    if (c.put)
+        MPI_Put(w.local.data(), w.count, MPI_INT, t, w.disp[t], w.count, MPI_INT, w.win);
+    else
+        MPI_Get(w.local.data(), w.count, MPI_INT, t, w.disp[t], w.count, MPI_INT, w.win);
+}
+
+void fence(Window &w, const Chain &c)
+{
+    MPI_Win_fence(MPI_MODE_NOPRECEDE, w.win);
+    transfer(w, c);
+    MPI_Win_fence(MPI_MODE_NOSUCCEED, w.win);
+}
+
+// A rank is accessed by the one neighbour and accesses the other one
+void pscw(Window &w, const Chain &c)
+{
+    MPI_Group exposed = c.put ? c.from : c.to, accessed = c.put ? c.to : c.from;
+    MPI_Win_post(exposed, 0, w.win);
+    MPI_Win_start(accessed, 0, w.win);
+    transfer(w, c);
+    MPI_Win_complete(w.win);
+    MPI_Win_wait(w.win);
+}
+
+void lock(Window &w, const Chain &c)
+{
+    int t = c.target();
+    if (t == MPI_PROC_NULL)
+        return;
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, t, 0, w.win);
+    transfer(w, c);
+    MPI_Win_unlock(t, w.win);
+}
+
+// Inside an MPI_Win_lock_all epoch that is opened outside the timing
+void flush(Window &w, const Chain &c)
+{
+    int t = c.target();
+    if (t == MPI_PROC_NULL)
+        return;
+    transfer(w, c);
+    MPI_Win_flush(t, w.win);
+}
+
+void two_sided(Window &w, const Chain &c)
+{
+    if (c.put) {
+        if (c.next != MPI_PROC_NULL)
+            MPI_Send(w.local.data(), w.count, MPI_INT, c.next, 0, MPI_COMM_WORLD);
+        if (c.prev != MPI_PROC_NULL)
+            MPI_Recv(w.base, w.count, MPI_INT, c.prev, 0, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+    } else {
+        if (c.next != MPI_PROC_NULL)
+            MPI_Send(w.base, w.count, MPI_INT, c.next, 0, MPI_COMM_WORLD);
+        if (c.prev != MPI_PROC_NULL)
+            MPI_Recv(w.local.data(), w.count, MPI_INT, c.prev, 0, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+    }
+}
+
+void fill(Window &w, const Chain &c)
+{
+    int *send = c.put ? w.local.data() : w.base;
+    int *recv = c.put ? w.base : w.local.data();
+    std::fill(send, send + w.count, c.rank);
+    std::fill(recv, recv + w.count, -1);
+}
+
+bool check(Window &w, const Chain &c)
+{
+    int *recv = c.put ? w.base : w.local.data();
+    int expected = c.prev == MPI_PROC_NULL ? -1 : c.prev;
+    return std::all_of(recv, recv + w.count, [expected](int v) { return v == expected; });
+}
+
+// Pass a counter along the chain: wait for the own counter to reach round,
+// then increment the counter of the next rank
+void pass_counter(MPI_Win win, const Chain &c, long round, bool fetch)
+{
+    long value = 0, one = 1, old;
+    if (c.prev != MPI_PROC_NULL) {
+        do {
+            MPI_Fetch_and_op(nullptr, &value, MPI_LONG, c.rank, 0, MPI_NO_OP, win);
+            MPI_Win_flush(c.rank, win);
+        } while (value < round);
+    }
+    if (c.next != MPI_PROC_NULL) {
+        if (fetch)
+            MPI_Fetch_and_op(&one, &old, MPI_LONG, c.next, 0, MPI_SUM, win);
+        else
+            MPI_Accumulate(&one, 1, MPI_LONG, c.next, 0, 1, MPI_LONG, MPI_SUM, win);
+        MPI_Win_flush(c.next, win);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ntasks, rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    bench::Args args(argc, argv);
+    auto ops = args.get_list("ops", "put,get", "comma separated list of put and get");
+    auto windows = args.get_list("windows", "allocate,create,dynamic",
+                                 "comma separated list of window kinds");
+    auto syncs = args.get_list("sync", "fence,pscw,lock,lock-all,two-sided",
+                               "comma separated list of synchronization modes");
+    int accumulate = args.get_int("accumulate", 1, "run the accumulate chain (0/1)");
+    int min_count = args.get_int("min-count", 1, "smallest message in ints");
+    int max_count = args.get_int("max-count", 10000000, "largest message in ints");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    using Sync = void (*)(Window &, const Chain &);
+    const std::vector<std::pair<std::string, Sync>> all_syncs = {
+        {"fence", fence}, {"pscw", pscw}, {"lock", lock},
+        {"lock-all", flush}, {"two-sided", two_sided},
+    };
+    const char *all_windows[] = {"allocate", "create", "dynamic"};
+
+    bool ok = bench::Reporter::valid(format);
+    for (auto &op : ops)
+        ok = ok && (op == "put" || op == "get");
+    for (auto &kind : windows)
+        ok = ok && std::find(std::begin(all_windows), std::end(all_windows), kind) !=
+                   std::end(all_windows);
+    std::vector<std::pair<std::string, Sync>> selected;
+    for (auto &name : syncs) {
+        auto it = std::find_if(all_syncs.begin(), all_syncs.end(),
+                               [&name](const std::pair<std::string, Sync> &s) {
+                                   return s.first == name;
+                               });
+        if (it == all_syncs.end())
+            ok = false;
+        else
+            selected.push_back(*it);
+    }
+    if (ntasks < 2) {
+        if (0 == rank)
+            fprintf(stderr, "The chain needs at least two tasks\n");
+        ok = false;
+    }
+    if (!ok) {
+        if (0 == rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    Chain c;
+    c.rank = rank;
+    c.ntasks = ntasks;
+    c.prev = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    c.next = rank < ntasks - 1 ? rank + 1 : MPI_PROC_NULL;
+    MPI_Group world;
+    MPI_Comm_group(MPI_COMM_WORLD, &world);
+    MPI_Group_incl(world, c.prev == MPI_PROC_NULL ? 0 : 1, &c.prev, &c.from);
+    MPI_Group_incl(world, c.next == MPI_PROC_NULL ? 0 : 1, &c.next, &c.to);
+    MPI_Group_free(&world);
+
+    bench::Reporter reporter(format, output, MPI_COMM_WORLD);
+    reporter.comment(std::to_string(ntasks) + " ntasks in a chain, method is "
+                     "window-synchronization, setup is the creation of the window");
+
+    for (int count : bench::count_range(min_count, max_count)) {
+        for (auto &kind : windows) {
+            MPI_Barrier(MPI_COMM_WORLD);
+            double t0 = MPI_Wtime();
+            Window w(kind, count);
+            double setup = MPI_Wtime() - t0, max_setup;
+            MPI_Reduce(&setup, &max_setup, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+            for (auto &op : ops) {
+                c.put = op == "put";
+                for (auto &sync : selected) {
+                    // Two-sided does not depend on the window
+                    if (sync.first == "two-sided" && kind != windows.front())
+                        continue;
+                    fill(w, c);
+                    bool all = sync.first == "lock-all";
+                    if (all)
+                        MPI_Win_lock_all(0, w.win);
+                    auto samples = bench::measure(MPI_COMM_WORLD, warmup, repeat,
+                                                  [&] { sync.second(w, c); });
+                    if (all)
+                        MPI_Win_unlock_all(w.win);
+                    // Passive target data is visible after the epoch
+                    MPI_Barrier(MPI_COMM_WORLD);
+
+                    int valid = check(w, c), all_valid;
+                    MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, MPI_COMM_WORLD);
+
+                    // The rank at the end of the chain without a target
+                    // returns at once and would pull the statistics down
+                    if (c.target() == MPI_PROC_NULL)
+                        samples.clear();
+                    auto summary = bench::gather_summary(samples, MPI_COMM_WORLD);
+                    bool two = sync.first == "two-sided";
+                    reporter.add({op, two ? sync.first : kind + "-" + sync.first,
+                                  static_cast<long>(count * sizeof(int)), summary,
+                                  {{"setup_us", two ? 0.0 : max_setup * 1.0e6},
+                                   {"hop_us", summary.median * 1.0e6}}});
+                    if (0 == rank && !all_valid)
+                        fprintf(stderr, "Something is wrong: %s with %s and %d ints "
+                                "gave wrong data!!!\n", op.c_str(), sync.first.c_str(),
+                                count);
+                }
+            }
+        }
+    }
+
+    if (accumulate) {
+        for (bool fetch : {false, true}) {
+            long *counter;
+            MPI_Win win;
+            MPI_Win_allocate(sizeof(long), sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD,
+                             &counter, &win);
+            *counter = 0;
+            MPI_Win_lock_all(0, win);
+            MPI_Barrier(MPI_COMM_WORLD);
+
+            long round = 0;
+            auto samples = bench::measure(MPI_COMM_WORLD, warmup, repeat, [&] {
+                pass_counter(win, c, ++round, fetch);
+            });
+            MPI_Win_unlock_all(win);
+            MPI_Barrier(MPI_COMM_WORLD);
+            int valid = c.prev == MPI_PROC_NULL || *counter == round, all_valid;
+            MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, MPI_COMM_WORLD);
+            MPI_Win_free(&win);
+
+            // Time of the last rank covers the whole chain
+            auto summary = bench::gather_summary(samples, MPI_COMM_WORLD);
+            std::vector<double> last(samples);
+            MPI_Bcast(last.data(), last.size(), MPI_DOUBLE, ntasks - 1, MPI_COMM_WORLD);
+            auto chain = bench::summarize(last);
+            const char *name = fetch ? "fetch-and-op" : "accumulate";
+            reporter.add({"accumulate-chain", name, static_cast<long>(sizeof(long)), summary,
+                          {{"setup_us", 0.0},
+                           {"hop_us", chain.median / (ntasks - 1) * 1.0e6}}});
+            if (0 == rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s chain lost updates!!!\n", name);
+        }
+    }
+
+    reporter.write();
+
+    MPI_Group_free(&c.from);
+    MPI_Group_free(&c.to);
+    MPI_Finalize();
+}
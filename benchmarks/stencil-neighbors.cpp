@@ -0,0 +1,384 @@
+// Halo exchange with all faces, edges and corners (26 neighbours in 3D,
+// 8 in 2D), as needed by stencils with diagonal couplings.
+//
+// Cartesian topologies know only the face neighbours, so the full
+// neighbourhood is described with MPI_Dist_graph_create_adjacent. The
+// neighbourhood collective is compared with point-to-point messages to
+// every neighbour and with the two-phase trick, in which the faces are
+// exchanged one dimension at a time with the halos of the previously
+// exchanged dimensions included, which fills edges and corners implicitly.
+// Run with --help to see the options.
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+
+using bench::Exchange;
+
+// Local block of n points per dimension with a halo of width w, stored in
+// C order. A 2D grid is stored as 3D with a single plane without halo in
+// the last dimension.
+struct Grid {
+    int ndims;
+    int n[3], w[3];
+    int coords[3], dims[3], periods[3];
+    MPI_Comm cart, graph;
+    std::vector<double> data;
+
+    // Offsets of the neighbours, and the ranks in the direction of each
+    // offset (destinations) and in the opposite one (sources)
+    std::vector<std::array<int, 3>> offsets;
+    std::vector<int> dests, sources;
+
+    int extent(int d) const { return n[d] + 2 * w[d]; }
+    long index(int i, int j, int k) const {
+        return (static_cast<long>(i) * extent(1) + j) * extent(2) + k;
+    }
+
+    // Region in direction o: the boundary layer to send, or with ghost
+    // the halo to receive
+    void region(const std::array<int, 3> &o, bool ghost, int start[3], int size[3]) const {
+        for (int e = 0; e < 3; e++) {
+            if (o[e] < 0) {
+                start[e] = ghost ? 0 : w[e];
+                size[e] = w[e];
+            } else if (o[e] > 0) {
+                start[e] = ghost ? n[e] + w[e] : n[e];
+                size[e] = w[e];
+            } else {
+                start[e] = w[e];
+                size[e] = n[e];
+            }
+        }
+    }
+
+    // Face normal to dimension d, extended over the halos of the
+    // dimensions before d (used by the two-phase exchange)
+    void extended_face(int d, int side, bool ghost, int start[3], int size[3]) const {
+        std::array<int, 3> o = {0, 0, 0};
+        o[d] = side;
+        region(o, ghost, start, size);
+        for (int e = 0; e < d; e++) {
+            start[e] = 0;
+            size[e] = extent(e);
+        }
+    }
+};
+
+using Method = std::function<Exchange(Grid &)>;
+
+MPI_Datatype region_type(const Grid &g, const int start[3], const int size[3])
+{
+    int sizes[3] = {g.extent(0), g.extent(1), g.extent(2)};
+    MPI_Datatype type;
+    MPI_Type_create_subarray(3, sizes, size, start, MPI_ORDER_C, MPI_DOUBLE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+// Send and receive datatypes for every neighbour. The block j is sent to
+// the destination at offsets[j] and received from the source at
+// -offsets[j], which keeps the message order consistent on both sides
+// also when several offsets lead to the same rank.
+struct Types {
+    std::vector<MPI_Datatype> send, recv;
+
+    explicit Types(const Grid &g) {
+        for (auto &o : g.offsets) {
+            int start[3], size[3];
+            std::array<int, 3> opposite = {-o[0], -o[1], -o[2]};
+            g.region(o, false, start, size);
+            send.push_back(region_type(g, start, size));
+            g.region(opposite, true, start, size);
+            recv.push_back(region_type(g, start, size));
+        }
+    }
+
+    ~Types() {
+        for (auto &t : send)
+            MPI_Type_free(&t);
+        for (auto &t : recv)
+            MPI_Type_free(&t);
+    }
+};
+
+Exchange neighbor(Grid &g)
+{
+    // Neighbourhood collectives address only the existing neighbours
+    struct Args {
+        std::vector<int> scounts, rcounts;
+        std::vector<MPI_Aint> sdispls, rdispls;
+        std::vector<MPI_Datatype> stypes, rtypes;
+    };
+    auto types = std::make_shared<Types>(g);
+    auto a = std::make_shared<Args>();
+    for (size_t j = 0; j < g.offsets.size(); j++) {
+        if (g.dests[j] != MPI_PROC_NULL) {
+            a->scounts.push_back(1);
+            a->sdispls.push_back(0);
+            a->stypes.push_back(types->send[j]);
+        }
+        if (g.sources[j] != MPI_PROC_NULL) {
+            a->rcounts.push_back(1);
+            a->rdispls.push_back(0);
+            a->rtypes.push_back(types->recv[j]);
+        }
+    }
+    return {[&g, types, a] {
+        MPI_Neighbor_alltoallw(g.data.data(), a->scounts.data(), a->sdispls.data(),
+                               a->stypes.data(), g.data.data(), a->rcounts.data(),
+                               a->rdispls.data(), a->rtypes.data(), g.graph);
+    }};
+}
+
+Exchange isend(Grid &g)
+{
+    auto types = std::make_shared<Types>(g);
+    auto reqs = std::make_shared<std::vector<MPI_Request>>(2 * g.offsets.size());
+    return bench::with_requests(reqs, [&g, types, reqs] {
+        for (size_t j = 0; j < g.offsets.size(); j++) {
+            MPI_Irecv(g.data.data(), 1, types->recv[j], g.sources[j], j, g.cart,
+                      &(*reqs)[2 * j]);
+            MPI_Isend(g.data.data(), 1, types->send[j], g.dests[j], j, g.cart,
+                      &(*reqs)[2 * j + 1]);
+        }
+    });
+}
+
+// One dimension at a time, each phase completes before the next one
+// sends the halos it received
+Exchange two_phase(Grid &g)
+{
+    struct Phases {
+        std::vector<MPI_Datatype> types;  // send lower, send upper, recv lower, recv upper
+        std::vector<int> nghbrs;          // lower, upper
+        ~Phases() {
+            for (auto &t : types)
+                MPI_Type_free(&t);
+        }
+    };
+    auto p = std::make_shared<Phases>();
+    for (int d = 0; d < g.ndims; d++) {
+        int start[3], size[3], lower, upper;
+        for (int ghost = 0; ghost < 2; ghost++)
+            for (int side = -1; side <= 1; side += 2) {
+                g.extended_face(d, side, ghost, start, size);
+                p->types.push_back(region_type(g, start, size));
+            }
+        MPI_Cart_shift(g.cart, d, 1, &lower, &upper);
+        p->nghbrs.push_back(lower);
+        p->nghbrs.push_back(upper);
+    }
+    return {[&g, p] {
+        MPI_Request reqs[4];
+        for (int d = 0; d < g.ndims; d++) {
+            MPI_Datatype *t = &p->types[4 * d];
+            int *nb = &p->nghbrs[2 * d];
+            MPI_Irecv(g.data.data(), 1, t[2], nb[0], 1, g.cart, &reqs[0]);
+            MPI_Irecv(g.data.data(), 1, t[3], nb[1], 0, g.cart, &reqs[1]);
+            MPI_Isend(g.data.data(), 1, t[0], nb[0], 0, g.cart, &reqs[2]);
+            MPI_Isend(g.data.data(), 1, t[1], nb[1], 1, g.cart, &reqs[3]);
+            MPI_Waitall(4, reqs, MPI_STATUSES_IGNORE);
+        }
+    }};
+}
+
+// Interior points hold a value computed from their global position. After
+// the exchange every halo point should hold the value of its global
+// position, or -1 if that lies outside a non-periodic domain.
+bool global_position(const Grid &g, int i, int j, int k, int pos[3])
+{
+    int local[3] = {i, j, k};
+    for (int d = 0; d < 3; d++) {
+        int global = g.n[d] * g.dims[d];
+        pos[d] = g.coords[d] * g.n[d] + local[d] - g.w[d];
+        if (g.periods[d])
+            pos[d] = (pos[d] + global) % global;
+        else if (pos[d] < 0 || pos[d] >= global)
+            return false;
+    }
+    return true;
+}
+
+double value(const Grid &g, const int pos[3])
+{
+    return (static_cast<double>(pos[0]) * g.n[1] * g.dims[1] + pos[1]) *
+           g.n[2] * g.dims[2] + pos[2];
+}
+
+void fill(Grid &g)
+{
+    std::fill(g.data.begin(), g.data.end(), -1.0);
+    int pos[3] = {0, 0, 0};
+    for (int i = g.w[0]; i < g.w[0] + g.n[0]; i++)
+        for (int j = g.w[1]; j < g.w[1] + g.n[1]; j++)
+            for (int k = g.w[2]; k < g.w[2] + g.n[2]; k++) {
+                global_position(g, i, j, k, pos);
+                g.data[g.index(i, j, k)] = value(g, pos);
+            }
+}
+
+bool check(const Grid &g)
+{
+    int pos[3] = {0, 0, 0};
+    for (int i = 0; i < g.extent(0); i++)
+        for (int j = 0; j < g.extent(1); j++)
+            for (int k = 0; k < g.extent(2); k++) {
+                double expected = global_position(g, i, j, k, pos) ? value(g, pos) : -1.0;
+                if (g.data[g.index(i, j, k)] != expected)
+                    return false;
+            }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    const std::vector<std::pair<std::string, Method>> all_methods = {
+        {"neighbor", neighbor},
+        {"isend", isend},
+        {"two-phase", two_phase},
+    };
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "neighbor,isend,two-phase",
+                                 "comma separated list of exchange methods");
+    int ndims = args.get_int("ndims", 3, "dimensions of the grid (2 or 3)");
+    int width = args.get_int("halo", 1, "width of the halo");
+    int periodic = args.get_int("periodic", 0, "periodic boundaries (0/1)");
+    int min_size = args.get_int("min-size", 4, "smallest edge of the local block");
+    int max_size = args.get_int("max-size", 128, "largest edge of the local block");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format) && (ndims == 2 || ndims == 3) &&
+              width >= 1 && min_size >= width;
+    std::vector<std::pair<std::string, const Method *>> selected;
+    for (auto &name : methods) {
+        const Method *m = nullptr;
+        for (auto &known : all_methods)
+            if (known.first == name)
+                m = &known.second;
+        if (m == nullptr) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        }
+        selected.push_back({name, m});
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    Grid g;
+    g.ndims = ndims;
+    for (int d = 0; d < 3; d++) {
+        g.dims[d] = d < ndims ? 0 : 1;
+        g.periods[d] = periodic;
+        g.coords[d] = 0;
+    }
+    MPI_Dims_create(ntasks, ndims, g.dims);
+    MPI_Cart_create(MPI_COMM_WORLD, ndims, g.dims, g.periods, 1, &g.cart);
+    MPI_Comm_rank(g.cart, &rank);
+    MPI_Cart_coords(g.cart, rank, ndims, g.coords);
+
+    // All 3^ndims - 1 neighbours, MPI_PROC_NULL outside the domain
+    auto neighbour_rank = [&g, ndims](const std::array<int, 3> &o, int sign) {
+        int c[3];
+        for (int d = 0; d < ndims; d++) {
+            c[d] = g.coords[d] + sign * o[d];
+            if (g.periods[d])
+                c[d] = (c[d] + g.dims[d]) % g.dims[d];
+            else if (c[d] < 0 || c[d] >= g.dims[d])
+                return static_cast<int>(MPI_PROC_NULL);
+        }
+        int r;
+        MPI_Cart_rank(g.cart, c, &r);
+        return r;
+    };
+    int span = ndims == 3 ? 1 : 0;
+    for (int i = -1; i <= 1; i++)
+        for (int j = -1; j <= 1; j++)
+            for (int k = -span; k <= span; k++) {
+                if (i == 0 && j == 0 && k == 0)
+                    continue;
+                std::array<int, 3> o = {i, j, k};
+                g.offsets.push_back(o);
+                g.dests.push_back(neighbour_rank(o, 1));
+                g.sources.push_back(neighbour_rank(o, -1));
+            }
+
+    // Graph of the existing neighbours, in the same order as the offsets.
+    // Ranks are not reordered so that they match the Cartesian ones.
+    std::vector<int> dests, sources;
+    for (size_t j = 0; j < g.offsets.size(); j++) {
+        if (g.dests[j] != MPI_PROC_NULL)
+            dests.push_back(g.dests[j]);
+        if (g.sources[j] != MPI_PROC_NULL)
+            sources.push_back(g.sources[j]);
+    }
+    MPI_Dist_graph_create_adjacent(g.cart, sources.size(), sources.data(),
+                                   MPI_UNWEIGHTED, dests.size(), dests.data(),
+                                   MPI_UNWEIGHTED, MPI_INFO_NULL, 0, &g.graph);
+
+    bench::Reporter reporter(format, output, g.cart);
+    std::string grid;
+    for (int d = 0; d < ndims; d++)
+        grid += (d ? " x " : "") + std::to_string(g.dims[d]);
+    reporter.comment(std::to_string(ntasks) + " ntasks in " + grid + " grid, " +
+                     std::to_string(g.offsets.size()) + " neighbours, halo width " +
+                     std::to_string(width) + ", bytes is the halo volume per rank");
+
+    for (int size : bench::count_range(min_size, max_size)) {
+        for (int d = 0; d < 3; d++) {
+            g.n[d] = d < ndims ? size : 1;
+            g.w[d] = d < ndims ? width : 0;
+        }
+        long halo = (static_cast<long>(g.extent(0)) * g.extent(1) * g.extent(2) -
+                     static_cast<long>(g.n[0]) * g.n[1] * g.n[2]) * sizeof(double);
+        g.data.assign(static_cast<long>(g.extent(0)) * g.extent(1) * g.extent(2), -1.0);
+
+        for (auto &method : selected) {
+            fill(g);
+            Exchange ex = (*method.second)(g);
+            auto samples = bench::measure(g.cart, warmup, repeat, [&ex] { ex.run(); });
+
+            int valid = check(g), all_valid;
+            MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, g.cart);
+            ex.free();
+
+            auto summary = bench::gather_summary(samples, g.cart);
+            reporter.add({"n=" + std::to_string(size), method.first, halo, summary, {}});
+            if (0 == rank && !all_valid)
+                fprintf(stderr, "Something is wrong: %s with n = %d gave wrong "
+                        "data!!!\n", method.first.c_str(), size);
+        }
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&g.graph);
+    MPI_Comm_free(&g.cart);
+    MPI_Finalize();
+}
@@ -0,0 +1,97 @@
+// Checks of the datatypes of struct-type.hpp: the padding detection at
+// compile time, and the size and extent of the committed types. Run on
+// any number of ranks.
+
+#include <cstdio>
+#include <mpi.h>
+
+#include "struct-type.hpp"
+
+// The particle of the struct datatype exercise, two bytes of padding
+struct Particle {
+    float coords[3];
+    int charge;
+    char label[2];
+};
+MPI_STRUCT_TYPE(Particle, coords, charge, label)
+
+// No padding
+struct Point {
+    double x[3];
+    long id;
+};
+MPI_STRUCT_TYPE(Point, x, id)
+
+// Nested listed struct and a two-dimensional array
+struct Cell {
+    Point centre;
+    float weights[2][3];
+};
+MPI_STRUCT_TYPE(Cell, centre, weights)
+
+// A member left out of the list is not sent, like padding
+struct Partial {
+    int sent;
+    int skipped;
+};
+MPI_STRUCT_TYPE(Partial, sent)
+
+static_assert(!dtype::is_contiguous<Particle>(), "Particle has padding");
+static_assert(dtype::is_contiguous<Point>(), "Point has no padding");
+static_assert(dtype::is_contiguous<Cell>(), "Cell has no padding");
+static_assert(!dtype::is_contiguous<Partial>(), "Partial has an unlisted member");
+
+// The size of the type is the listed data, the extent that of the struct
+template <typename T>
+bool check(const char *name, int data_bytes)
+{
+    MPI_Datatype type = dtype::get<T>();
+    MPI_Aint lb, extent;
+    int size;
+    MPI_Type_get_extent(type, &lb, &extent);
+    MPI_Type_size(type, &size);
+    bool ok = lb == 0 && extent == static_cast<MPI_Aint>(sizeof(T)) && size == data_bytes;
+    if (!ok)
+        fprintf(stderr, "Something is wrong: %s has size %d and extent %ld, expected %d and "
+                "%zu!!!\n", name, size, static_cast<long>(extent), data_bytes, sizeof(T));
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    bool ok = check<Particle>("Particle", 3 * sizeof(float) + sizeof(int) + 2);
+    ok = check<Point>("Point", sizeof(Point)) && ok;
+    ok = check<Cell>("Cell", sizeof(Cell)) && ok;
+    ok = check<Partial>("Partial", sizeof(int)) && ok;
+
+    // Send an array of padded particles around a ring
+    int ntasks;
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    Particle out[4], in[4] = {};
+    for (int i = 0; i < 4; i++)
+        out[i] = {{1.0f * rank, 2.0f * i, 3.0f}, rank * 10 + i, {'p', static_cast<char>('0' + i)}};
+    int source = (rank + ntasks - 1) % ntasks;
+    MPI_Sendrecv(out, 4, dtype::get<Particle>(), (rank + 1) % ntasks, 0, in, 4,
+                 dtype::get<Particle>(), source, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    for (int i = 0; i < 4; i++)
+        if (in[i].coords[0] != 1.0f * source || in[i].coords[1] != 2.0f * i ||
+            in[i].charge != source * 10 + i || in[i].label[1] != '0' + i) {
+            fprintf(stderr, "Something is wrong: particle %d from rank %d gave wrong "
+                    "data!!!\n", i, source);
+            ok = false;
+        }
+
+    int all_ok = ok;
+    MPI_Reduce(0 == rank ? MPI_IN_PLACE : &all_ok, &all_ok, 1, MPI_INT, MPI_LAND, 0,
+               MPI_COMM_WORLD);
+    if (0 == rank && all_ok)
+        printf("struct-type.hpp: all checks passed\n");
+
+    MPI_Finalize();
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,262 @@
+// MPI datatypes for C++ structs from a list of their members.
+//
+// Building the type of a struct by hand (MPI_Get_address of every member,
+// displacements relative to the first one, MPI_Type_create_struct and a
+// resize to the size of the struct) is easy to get wrong when the struct
+// changes. Instead, the members are listed once next to the struct
+//
+//     struct Particle {
+//         float coords[3];
+//         int charge;
+//         char label[2];
+//     };
+//     MPI_STRUCT_TYPE(Particle, coords, charge, label)
+//
+// (at global scope, after the struct), and dtype::get<Particle>() returns
+// the committed datatype, created on first use and freed in MPI_Finalize.
+// Members can be arithmetic types, arrays of them and other listed
+// structs.
+//
+// A struct that is trivially copyable and whose listed members cover all
+// of its bytes has no padding, which is known at compile time
+// (dtype::is_contiguous<T>()). Its type is a contiguous block of bytes,
+// the fast path of MPI libraries, like MPI_BYTE in the exercise but with
+// the right extent. This assumes the same representation on all ranks as
+// any MPI_BYTE transfer does. Structs with padding get a struct type.
+
+#ifndef __STRUCT_TYPE_HPP__
+#define __STRUCT_TYPE_HPP__
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <mpi.h>
+
+namespace dtype {
+
+// Specialised by MPI_STRUCT_TYPE, list() returns the member pointers
+template <typename T>
+struct members {
+    static constexpr bool listed = false;
+};
+
+template <typename T>
+constexpr bool is_listed() { return members<T>::listed; }
+
+// Predefined datatypes of the arithmetic types
+template <typename T> struct builtin;
+#define DTYPE_BUILTIN(T, mpi_type) \
+    template <> struct builtin<T> { static MPI_Datatype get() { return mpi_type; } };
+DTYPE_BUILTIN(char, MPI_CHAR)
+DTYPE_BUILTIN(signed char, MPI_SIGNED_CHAR)
+DTYPE_BUILTIN(unsigned char, MPI_UNSIGNED_CHAR)
+DTYPE_BUILTIN(short, MPI_SHORT)
+DTYPE_BUILTIN(unsigned short, MPI_UNSIGNED_SHORT)
+DTYPE_BUILTIN(int, MPI_INT)
+DTYPE_BUILTIN(unsigned, MPI_UNSIGNED)
+DTYPE_BUILTIN(long, MPI_LONG)
+DTYPE_BUILTIN(unsigned long, MPI_UNSIGNED_LONG)
+DTYPE_BUILTIN(long long, MPI_LONG_LONG)
+DTYPE_BUILTIN(unsigned long long, MPI_UNSIGNED_LONG_LONG)
+DTYPE_BUILTIN(float, MPI_FLOAT)
+DTYPE_BUILTIN(double, MPI_DOUBLE)
+DTYPE_BUILTIN(long double, MPI_LONG_DOUBLE)
+DTYPE_BUILTIN(bool, MPI_CXX_BOOL)
+#undef DTYPE_BUILTIN
+
+namespace detail {
+
+template <typename T, bool = is_listed<T>()>
+struct layout;
+
+template <typename... M>
+struct member_bytes;
+
+template <>
+struct member_bytes<> {
+    static constexpr size_t value = 0;
+};
+
+// Bytes holding data, without padding
+template <typename T>
+constexpr size_t data_bytes() { return layout<std::remove_all_extents_t<T>>::data_bytes
+                                      * (sizeof(T) / sizeof(std::remove_all_extents_t<T>)); }
+
+template <typename C, typename M, typename... Rest>
+struct member_bytes<M C::*, Rest...> {
+    static constexpr size_t value = data_bytes<M>() + member_bytes<Rest...>::value;
+};
+
+template <typename T>
+struct layout<T, false> {
+    static_assert(std::is_arithmetic<T>::value,
+                  "Members must be arithmetic, arrays or structs listed with MPI_STRUCT_TYPE");
+    static constexpr size_t data_bytes = sizeof(T);
+};
+
+template <typename T>
+struct layout<T, true> {
+    template <typename... M>
+    static constexpr size_t sum(std::tuple<M...>) { return member_bytes<M...>::value; }
+    static constexpr size_t data_bytes = sum(members<T>::list());
+};
+
+} // namespace detail
+
+// No padding and nothing but the bytes to copy
+template <typename T>
+constexpr bool is_contiguous()
+{
+    return std::is_trivially_copyable<T>::value && detail::data_bytes<T>() == sizeof(T);
+}
+
+template <typename T>
+MPI_Datatype get();
+
+namespace detail {
+
+// Committed types, freed with the attributes of MPI_COMM_SELF at the
+// start of MPI_Finalize
+inline std::vector<MPI_Datatype> *&registry()
+{
+    static std::vector<MPI_Datatype> *types = nullptr;
+    return types;
+}
+
+inline int free_types(MPI_Comm, int, void *, void *)
+{
+    for (auto &t : *registry())
+        MPI_Type_free(&t);
+    delete registry();
+    registry() = nullptr;
+    return MPI_SUCCESS;
+}
+
+inline MPI_Datatype keep(MPI_Datatype type)
+{
+    if (registry() == nullptr) {
+        int key;
+        registry() = new std::vector<MPI_Datatype>;
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, free_types, &key, nullptr);
+        MPI_Comm_set_attr(MPI_COMM_SELF, key, registry());
+        MPI_Comm_free_keyval(&key);
+    }
+    registry()->push_back(type);
+    return type;
+}
+
+template <typename T, bool = is_listed<T>()>
+struct element {
+    static MPI_Datatype get() { return builtin<T>::get(); }
+};
+
+template <typename T>
+struct element<T, true> {
+    static MPI_Datatype get() { return dtype::get<T>(); }
+};
+
+// Appends one member (an array is a block of its elements) with its
+// displacement from the start of the struct
+template <typename C, typename M>
+void add(const C &object, M C::*member, std::vector<int> &blocklens,
+         std::vector<MPI_Aint> &displs, std::vector<MPI_Datatype> &types)
+{
+    using E = std::remove_all_extents_t<M>;
+    MPI_Aint base, address;
+    MPI_Get_address(&object, &base);
+    MPI_Get_address(&(object.*member), &address);
+    blocklens.push_back(sizeof(M) / sizeof(E));
+    displs.push_back(MPI_Aint_diff(address, base));
+    types.push_back(element<E>::get());
+}
+
+template <typename T, typename List, size_t... I>
+MPI_Datatype create_struct(const List &list, std::index_sequence<I...>)
+{
+    std::vector<int> blocklens;
+    std::vector<MPI_Aint> displs;
+    std::vector<MPI_Datatype> types;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage = {};
+    const T &object = *reinterpret_cast<const T *>(&storage);
+    // Expands to one add() per member, in order
+    int expand[] = {0, (add(object, std::get<I>(list), blocklens, displs, types), 0)...};
+    (void)expand;
+
+    MPI_Datatype packed, type;
+    MPI_Type_create_struct(blocklens.size(), blocklens.data(), displs.data(), types.data(),
+                           &packed);
+    // Extent of the struct in an array, including the padding at the end
+    MPI_Type_create_resized(packed, 0, sizeof(T), &type);
+    MPI_Type_free(&packed);
+    return type;
+}
+
+template <typename T>
+MPI_Datatype create()
+{
+    static_assert(is_listed<T>(), "List the members of the struct with MPI_STRUCT_TYPE");
+    MPI_Datatype type;
+    if (is_contiguous<T>())
+        MPI_Type_contiguous(sizeof(T), MPI_BYTE, &type);
+    else
+        type = create_struct<T>(members<T>::list(),
+                                std::make_index_sequence<
+                                    std::tuple_size<decltype(members<T>::list())>::value>());
+    MPI_Type_commit(&type);
+    return keep(type);
+}
+
+} // namespace detail
+
+// Committed datatype of T, created on the first call after MPI_Init.
+// Do not free it. The first calls for different types must not run
+// concurrently.
+template <typename T>
+MPI_Datatype get()
+{
+    static MPI_Datatype type = detail::create<T>();
+    return type;
+}
+
+} // namespace dtype
+
+// Member pointers for the list, up to 16 members
+#define DTYPE_MEMBER(T, m) &T::m
+#define DTYPE_MAP1(T, m) DTYPE_MEMBER(T, m)
+#define DTYPE_MAP2(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP1(T, __VA_ARGS__)
+#define DTYPE_MAP3(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP2(T, __VA_ARGS__)
+#define DTYPE_MAP4(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP3(T, __VA_ARGS__)
+#define DTYPE_MAP5(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP4(T, __VA_ARGS__)
+#define DTYPE_MAP6(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP5(T, __VA_ARGS__)
+#define DTYPE_MAP7(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP6(T, __VA_ARGS__)
+#define DTYPE_MAP8(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP7(T, __VA_ARGS__)
+#define DTYPE_MAP9(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP8(T, __VA_ARGS__)
+#define DTYPE_MAP10(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP9(T, __VA_ARGS__)
+#define DTYPE_MAP11(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP10(T, __VA_ARGS__)
+#define DTYPE_MAP12(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP11(T, __VA_ARGS__)
+#define DTYPE_MAP13(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP12(T, __VA_ARGS__)
+#define DTYPE_MAP14(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP13(T, __VA_ARGS__)
+#define DTYPE_MAP15(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP14(T, __VA_ARGS__)
+#define DTYPE_MAP16(T, m, ...) DTYPE_MEMBER(T, m), DTYPE_MAP15(T, __VA_ARGS__)
+#define DTYPE_SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, \
+                     _16, name, ...) name
+#define DTYPE_MAP(T, ...) \
+    DTYPE_SELECT(__VA_ARGS__, DTYPE_MAP16, DTYPE_MAP15, DTYPE_MAP14, DTYPE_MAP13, \
+                 DTYPE_MAP12, DTYPE_MAP11, DTYPE_MAP10, DTYPE_MAP9, DTYPE_MAP8, DTYPE_MAP7, \
+                 DTYPE_MAP6, DTYPE_MAP5, DTYPE_MAP4, DTYPE_MAP3, DTYPE_MAP2, \
+                 DTYPE_MAP1, )(T, __VA_ARGS__)
+
+// Lists the members of struct T (a name usable at global scope) that are
+// sent, in any order
+#define MPI_STRUCT_TYPE(T, ...) \
+    namespace dtype { \
+    template <> \
+    struct members<T> { \
+        static constexpr bool listed = true; \
+        static constexpr auto list() { return std::make_tuple(DTYPE_MAP(T, __VA_ARGS__)); } \
+    }; \
+    }
+
+#endif  // __STRUCT_TYPE_HPP__
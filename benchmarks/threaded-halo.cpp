@@ -0,0 +1,233 @@
+// Halo exchange from several threads per rank in a Cartesian topology.
+//
+// With MPI_THREAD_MULTIPLE every OpenMP thread exchanges its own part of
+// the halo with all neighbours, either on a duplicate of the communicator
+// of its own (as with endpoints, no matching between threads) or on the
+// shared communicator with the thread number in the tag. These are
+// compared with funneled communication of the same volume by the master
+// thread, either as one aggregated message per neighbour or as one message
+// per thread and neighbour. Run with --help to see the options.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mpi.h>
+#include <omp.h>
+
+#include "bench.hpp"
+
+// The halo of all threads: block b (neighbour in the neighbourhood
+// collective order) of thread t starts at (b * nthreads + t) * count, so
+// that the blocks of all threads for one neighbour are contiguous.
+struct Context {
+    MPI_Comm cart;
+    std::vector<MPI_Comm> comms;   // one duplicate per thread
+    std::vector<int> nghbrs;
+    int nthreads, count;
+    std::vector<double> sendbuf, recvbuf;
+
+    int nblocks() const { return nghbrs.size(); }
+    long offset(int b, int t) const { return (static_cast<long>(b) * nthreads + t) * count; }
+    static int opposite(int b) { return b ^ 1; }
+};
+
+enum class Mode { funneled, funneled_msgs, multiple_comm, multiple_tag };
+
+const std::vector<std::pair<std::string, Mode>> all_modes = {
+    {"funneled", Mode::funneled},
+    {"funneled-msgs", Mode::funneled_msgs},
+    {"multiple-comm", Mode::multiple_comm},
+    {"multiple-tag", Mode::multiple_tag},
+};
+
+// Messages of thread t (or of all threads when t < 0, with one message
+// per neighbour holding the blocks of all threads)
+void exchange(Context &c, int t, MPI_Comm comm, bool tagged)
+{
+    int nb = c.nblocks();
+    std::vector<MPI_Request> reqs(2 * nb);
+    int count = t < 0 ? c.count * c.nthreads : c.count;
+    int first = std::max(t, 0);
+    for (int b = 0; b < nb; b++) {
+        int o = Context::opposite(b);
+        int stag = tagged ? first * nb + b : b;
+        int rtag = tagged ? first * nb + o : o;
+        MPI_Irecv(&c.recvbuf[c.offset(b, first)], count, MPI_DOUBLE, c.nghbrs[b],
+                  rtag, comm, &reqs[2 * b]);
+        MPI_Isend(&c.sendbuf[c.offset(b, first)], count, MPI_DOUBLE, c.nghbrs[b],
+                  stag, comm, &reqs[2 * b + 1]);
+    }
+    MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+}
+
+void run(Context &c, Mode mode)
+{
+#pragma omp parallel num_threads(c.nthreads)
+    {
+        int t = omp_get_thread_num();
+        switch (mode) {
+        case Mode::funneled:
+#pragma omp master
+            exchange(c, -1, c.cart, false);
+            break;
+        case Mode::funneled_msgs:
+#pragma omp master
+            for (int s = 0; s < c.nthreads; s++)
+                exchange(c, s, c.cart, true);
+            break;
+        case Mode::multiple_comm:
+            exchange(c, t, c.comms[t], false);
+            break;
+        case Mode::multiple_tag:
+            exchange(c, t, c.cart, true);
+            break;
+        }
+    }
+}
+
+// Funneled messages to one neighbour are posted one after another, so they
+// are all in flight at the same time only with the aggregated message.
+int messages(const Context &c, Mode mode)
+{
+    return mode == Mode::funneled ? c.nblocks() : c.nblocks() * c.nthreads;
+}
+
+void fill(Context &c, int rank)
+{
+    for (int b = 0; b < c.nblocks(); b++)
+        for (int t = 0; t < c.nthreads; t++)
+            std::fill(&c.sendbuf[c.offset(b, t)], &c.sendbuf[c.offset(b, t)] + c.count,
+                      (rank * 100.0 + b) * 64 + t);
+    std::fill(c.recvbuf.begin(), c.recvbuf.end(), -1.0);
+}
+
+bool check(const Context &c)
+{
+    for (int b = 0; b < c.nblocks(); b++)
+        for (int t = 0; t < c.nthreads; t++) {
+            double expected = -1.0;
+            if (c.nghbrs[b] != MPI_PROC_NULL)
+                expected = (c.nghbrs[b] * 100.0 + Context::opposite(b)) * 64 + t;
+            for (int i = 0; i < c.count; i++)
+                if (c.recvbuf[c.offset(b, t) + i] != expected)
+                    return false;
+        }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int world_rank, rank, ntasks, provided;
+
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    bench::Args args(argc, argv);
+    auto modes = args.get_list("methods", "funneled,funneled-msgs,multiple-comm,multiple-tag",
+                               "comma separated list of threading modes");
+    auto threads = args.get_list("threads", "1,2,4,8", "comma separated thread counts");
+    int ndims = args.get_int("ndims", 3, "dimensions of the Cartesian grid");
+    int periodic = args.get_int("periodic", 0, "periodic boundaries (0/1)");
+    int min_count = args.get_int("min-count", 1, "smallest message in doubles per thread");
+    int max_count = args.get_int("max-count", 64 * 1024, "largest message in doubles per thread");
+    int warmup = args.get_int("warmup", 5, "untimed iterations per size");
+    int repeat = args.get_int("repeat", 50, "timed iterations per size");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(world_rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format);
+    std::vector<std::pair<std::string, Mode>> selected;
+    for (auto &name : modes) {
+        auto it = std::find_if(all_modes.begin(), all_modes.end(),
+                               [&name](const std::pair<std::string, Mode> &m) {
+                                   return m.first == name;
+                               });
+        if (it == all_modes.end()) {
+            if (0 == world_rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        } else if ((it->second == Mode::multiple_comm || it->second == Mode::multiple_tag) &&
+                   provided < MPI_THREAD_MULTIPLE) {
+            if (0 == world_rank)
+                fprintf(stderr, "Skipping %s: MPI library does not provide "
+                        "MPI_THREAD_MULTIPLE\n", name.c_str());
+        } else {
+            selected.push_back(*it);
+        }
+    }
+    if (!ok) {
+        if (0 == world_rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    std::vector<int> dims(ndims, 0), periods(ndims, periodic);
+    MPI_Dims_create(ntasks, ndims, dims.data());
+
+    Context c;
+    MPI_Cart_create(MPI_COMM_WORLD, ndims, dims.data(), periods.data(), 1, &c.cart);
+    MPI_Comm_rank(c.cart, &rank);
+    c.nghbrs.resize(2 * ndims);
+    for (int i = 0; i < ndims; i++)
+        MPI_Cart_shift(c.cart, i, 1, &c.nghbrs[2 * i], &c.nghbrs[2 * i + 1]);
+
+    bench::Reporter reporter(format, output, c.cart);
+    std::string grid;
+    for (int i = 0; i < ndims; i++)
+        grid += (i ? " x " : "") + std::to_string(dims[i]);
+    reporter.comment(std::to_string(ntasks) + " ntasks in " + grid + " grid, "
+                     "bytes is the volume sent per rank");
+
+    for (auto &nt : threads) {
+        c.nthreads = std::max(1, std::atoi(nt.c_str()));
+        c.comms.resize(c.nthreads);
+        for (auto &comm : c.comms)
+            MPI_Comm_dup(c.cart, &comm);
+
+        for (int count : bench::count_range(min_count, max_count)) {
+            c.count = count;
+            c.sendbuf.resize(c.offset(c.nblocks(), 0));
+            c.recvbuf.resize(c.sendbuf.size());
+
+            for (auto &mode : selected) {
+                fill(c, rank);
+                auto samples = bench::measure(c.cart, warmup, repeat,
+                                              [&c, &mode] { run(c, mode.second); });
+
+                int valid = check(c), all_valid;
+                MPI_Reduce(&valid, &all_valid, 1, MPI_INT, MPI_LAND, 0, c.cart);
+
+                auto summary = bench::gather_summary(samples, c.cart);
+                int nmsgs = messages(c, mode.second);
+                double rate = summary.median > 0.0 ? nmsgs / summary.median : 0.0;
+                reporter.add({"T=" + nt, mode.first,
+                              static_cast<long>(c.sendbuf.size() * sizeof(double)),
+                              summary,
+                              {{"threads", static_cast<double>(c.nthreads)},
+                               {"msg_bytes", count * sizeof(double) *
+                                             (mode.second == Mode::funneled ? c.nthreads : 1.0)},
+                               {"msgs_per_s", rate}}});
+                if (0 == rank && !all_valid)
+                    fprintf(stderr, "Something is wrong: %s with %d threads and %d "
+                            "doubles gave wrong data!!!\n", mode.first.c_str(),
+                            c.nthreads, count);
+            }
+        }
+
+        for (auto &comm : c.comms)
+            MPI_Comm_free(&comm);
+    }
+
+    reporter.write();
+
+    MPI_Comm_free(&c.cart);
+    MPI_Finalize();
+}
@@ -0,0 +1,222 @@
+// Distributed task queue with work stealing on one-sided communication.
+//
+// Every rank owns a queue of task descriptors (64-bit integers, e.g. an
+// index to a list of snapshots or tiles) in a window from
+// MPI_Win_allocate. The queue is a range [head, tail) of the task array,
+// and both counters are packed into one 64-bit word together with a
+// generation, so that a single MPI_Compare_and_swap claims tasks without
+// locks: the owner takes tasks from the tail and idle ranks steal half of
+// the remaining tasks from the head of a random victim.
+//
+// A thief reads the range before it claims it, and the claim succeeds only
+// if the word has not changed in between. It then writes the stolen tasks
+// to its own, empty queue and publishes them with a new generation, so
+// that they can be stolen again. Only the owner writes the task array of a
+// queue, and only while the queue is empty; the generation makes sure that
+// a thief that read the array before such a write fails to claim.
+//
+// No tasks are created during a run, but tasks in the hands of a thief are
+// in no queue. A counter of started and finished steals on rank 0 tells
+// whether a sweep over all queues that found them empty saw a consistent
+// state, and a rank is done only after such a sweep.
+
+#ifndef __WORK_QUEUE_HPP__
+#define __WORK_QUEUE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <mpi.h>
+
+namespace workq {
+
+class Queue {
+public:
+    // Collective over comm. Each rank can hold up to capacity tasks, the
+    // own ones and the stolen ones, at most max_capacity.
+    Queue(MPI_Comm comm, int capacity) : comm(comm), capacity(capacity) {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &ntasks);
+        if (capacity < 0 || capacity > max_capacity) {
+            fprintf(stderr, "Rank %d: queue capacity %d is beyond the limit of %d tasks\n",
+                    rank, capacity, max_capacity);
+            MPI_Abort(comm, 1);
+        }
+        MPI_Win_allocate((capacity + first_task) * sizeof(int64_t), sizeof(int64_t),
+                         MPI_INFO_NULL, comm, &base, &win);
+        base[queue_word] = 0;
+        base[steal_word] = 0;
+        gen.seed(12345 + rank);
+        MPI_Win_lock_all(0, win);
+        MPI_Barrier(comm);
+    }
+
+    // Head and tail are 24-bit fields of the queue word
+    static constexpr int max_capacity = (1 << 24) - 1;
+
+    Queue(const Queue &) = delete;
+    Queue &operator=(const Queue &) = delete;
+
+    ~Queue() {
+        MPI_Win_unlock_all(win);
+        MPI_Win_free(&win);
+    }
+
+    // Collective. Replace the tasks of this rank, at most capacity.
+    // No rank may still be taking tasks from the previous load.
+    void load(const std::vector<int64_t> &tasks) {
+        MPI_Barrier(comm);
+        int n = std::min(static_cast<int>(tasks.size()), capacity);
+        std::copy(tasks.begin(), tasks.begin() + n, base + first_task);
+        base[queue_word] = pack(0, 0, n);
+        base[steal_word] = 0;
+        MPI_Win_sync(win);
+        steals = 0;
+        MPI_Barrier(comm);
+    }
+
+    // Next task to run: from the own queue, or else stolen (if allowed).
+    // Returns false when no task is left anywhere.
+    bool next(int64_t &task, bool steal = true) {
+        if (pop(task))
+            return true;
+        if (!steal || ntasks == 1)
+            return false;
+
+        std::uniform_int_distribution<int> other(0, ntasks - 2);
+        for (;;) {
+            // Random victims first, then every rank once
+            bool found;
+            for (int attempt = 0; attempt < ntasks; attempt++) {
+                int victim = other(gen);
+                victim += victim >= rank;
+                if (steal_from(victim, found) && pop(task))
+                    return true;
+            }
+            int64_t before = read(0, steal_word);
+            bool empty = true;
+            for (int i = 1; i < ntasks; i++) {
+                if (steal_from((rank + i) % ntasks, found) && pop(task))
+                    return true;
+                empty = empty && !found;
+            }
+            // Without steals in flight or started during the sweep, no
+            // task can have moved to a queue that was already swept
+            if (empty && started(before) == finished(before) &&
+                read(0, steal_word) == before)
+                return false;
+        }
+    }
+
+    // Successful steals since the last load
+    long stolen() const { return steals; }
+
+private:
+    // Layout of the window: packed queue word, steal counter (used on
+    // rank 0), tasks
+    static constexpr int queue_word = 0, steal_word = 1, first_task = 2;
+
+    // Generation (15 bits), head and tail (24 bits each)
+    static constexpr int64_t mask = (int64_t(1) << 24) - 1;
+    static int64_t pack(int64_t generation, int64_t head, int64_t tail) {
+        return ((generation & 0x7fff) << 48) | (head << 24) | tail;
+    }
+    static int64_t generation_of(int64_t word) { return word >> 48; }
+    static int64_t head_of(int64_t word) { return (word >> 24) & mask; }
+    static int64_t tail_of(int64_t word) { return word & mask; }
+
+    // Started steals in the upper, finished ones in the lower half
+    static constexpr int64_t steal_started = int64_t(1) << 32, steal_finished = 1;
+    static int64_t started(int64_t word) { return word >> 32; }
+    static int64_t finished(int64_t word) { return word & 0xffffffff; }
+
+    int64_t read(int target, int disp = queue_word) {
+        int64_t word;
+        MPI_Fetch_and_op(nullptr, &word, MPI_INT64_T, target, disp, MPI_NO_OP, win);
+        MPI_Win_flush(target, win);
+        return word;
+    }
+
+    void add(int target, int disp, int64_t value) {
+        MPI_Accumulate(&value, 1, MPI_INT64_T, target, disp, 1, MPI_INT64_T, MPI_SUM, win);
+        MPI_Win_flush(target, win);
+    }
+
+    // Replace expected by desired, returns whether it succeeded
+    bool swap(int target, int64_t expected, int64_t desired) {
+        int64_t result;
+        MPI_Compare_and_swap(&desired, &expected, &result, MPI_INT64_T, target, queue_word,
+                             win);
+        MPI_Win_flush(target, win);
+        return result == expected;
+    }
+
+    // Take one task from the tail of the own queue
+    bool pop(int64_t &task) {
+        int64_t word = read(rank);
+        while (head_of(word) < tail_of(word)) {
+            int64_t tail = tail_of(word) - 1;
+            if (swap(rank, word, pack(generation_of(word), head_of(word), tail))) {
+                MPI_Win_sync(win);
+                task = base[first_task + tail];
+                return true;
+            }
+            word = read(rank);
+        }
+        return false;
+    }
+
+    // Take half of the tasks (at least one) from the head of the victim
+    // and put them into the own queue, which is empty. found tells whether
+    // the victim had tasks when it was first read.
+    bool steal_from(int victim, bool &found) {
+        int64_t word = read(victim);
+        found = head_of(word) < tail_of(word);
+        if (!found)
+            return false;
+
+        add(0, steal_word, steal_started);
+        bool stolen = false;
+        std::vector<int64_t> tasks;
+        while (head_of(word) < tail_of(word)) {
+            int64_t head = head_of(word);
+            int64_t n = std::min<int64_t>((tail_of(word) - head + 1) / 2, capacity);
+            tasks.resize(n);
+            MPI_Get(tasks.data(), n, MPI_INT64_T, victim, first_task + head, n, MPI_INT64_T,
+                    win);
+            MPI_Win_flush(victim, win);
+            // The tasks read are valid if the word is still the same
+            if (swap(victim, word, pack(generation_of(word), head + n, tail_of(word)))) {
+                publish(tasks);
+                steals++;
+                stolen = true;
+                break;
+            }
+            word = read(victim);
+        }
+        add(0, steal_word, steal_finished);
+        return stolen;
+    }
+
+    // Fill the empty own queue, with a new generation so that thieves that
+    // read the previous contents cannot claim them
+    void publish(const std::vector<int64_t> &tasks) {
+        int64_t word = read(rank);
+        std::copy(tasks.begin(), tasks.end(), base + first_task);
+        MPI_Win_sync(win);
+        swap(rank, word, pack(generation_of(word) + 1, 0, tasks.size()));
+    }
+
+    MPI_Comm comm;
+    MPI_Win win;
+    int64_t *base;               // see the layout above
+    int rank, ntasks, capacity;
+    long steals = 0;
+    std::mt19937 gen;
+};
+
+} // namespace workq
+
+#endif  // __WORK_QUEUE_HPP__
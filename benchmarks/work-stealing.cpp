@@ -0,0 +1,162 @@
+// Throughput of dynamic load balancing with the work stealing queue of
+// work-queue.hpp as a function of the task granularity.
+//
+// Irregular post-processing (analysis of snapshots, rendering of tiles)
+// is a bag of independent tasks of unknown cost. The tasks are first
+// distributed over the ranks, each task is a calibrated busy loop of the
+// given length, and the run ends when all tasks are done:
+//  - static:   every rank runs only the tasks it was given
+//  - stealing: ranks that run out of work steal half of the remaining
+//              tasks of a random victim
+// Small tasks show the overhead of the atomic operations on the queues,
+// an uneven distribution the gain from balancing. Run with --help to see
+// the options.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include "bench.hpp"
+#include "work-queue.hpp"
+
+// Tasks of this rank, numbered consecutively over all ranks
+std::vector<int64_t> distribute(const std::string &distribution, int tasks, int rank,
+                                int ntasks)
+{
+    long total = static_cast<long>(tasks) * ntasks;
+    std::vector<long> first(ntasks + 1, 0);
+    for (int r = 0; r < ntasks; r++) {
+        long n = tasks;
+        if (distribution == "single")
+            n = 0 == r ? total : 0;
+        else if (distribution == "skewed")    // linearly growing with rank
+            n = 2 * total * (r + 1) / (static_cast<long>(ntasks) * (ntasks + 1));
+        first[r + 1] = first[r] + n;
+    }
+    first[ntasks] = total;                    // rounding goes to the last rank
+    std::vector<int64_t> mine;
+    for (long t = first[rank]; t < first[rank + 1]; t++)
+        mine.push_back(t);
+    return mine;
+}
+
+int main(int argc, char **argv)
+{
+    int ntasks, rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ntasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    bench::Args args(argc, argv);
+    auto methods = args.get_list("methods", "static,stealing",
+                                 "comma separated list of static and stealing");
+    auto granularities = args.get_list("granularity", "1,10,100,1000",
+                                       "comma separated task lengths in us");
+    int tasks = args.get_int("tasks", 1000, "tasks per rank");
+    auto distribution = args.get("distribution", "skewed",
+                                 "initial tasks: even, skewed or single (all on rank 0)");
+    int repeat = args.get_int("repeat", 5, "timed runs per granularity");
+    auto format = args.get("format", "table", "table, csv or json");
+    auto output = args.get("output", "", "output file (default stdout)");
+    if (!args.finish(rank)) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    bool ok = bench::Reporter::valid(format);
+    for (auto &name : methods)
+        if (name != "static" && name != "stealing") {
+            if (0 == rank)
+                fprintf(stderr, "Unknown method %s\n", name.c_str());
+            ok = false;
+        }
+    if (distribution != "even" && distribution != "skewed" && distribution != "single") {
+        if (0 == rank)
+            fprintf(stderr, "Unknown distribution %s\n", distribution.c_str());
+        ok = false;
+    }
+    if (!ok || tasks < 1) {
+        if (0 == rank)
+            fprintf(stderr, "Invalid options, see --help\n");
+        MPI_Finalize();
+        return 1;
+    }
+
+    long total = static_cast<long>(tasks) * ntasks;
+    auto mine = distribute(distribution, tasks, rank, ntasks);
+    // Room for half of the largest queue, which a thief can steal
+    long capacity = mine.size();
+    MPI_Allreduce(MPI_IN_PLACE, &capacity, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+    if (capacity > workq::Queue::max_capacity) {
+        if (0 == rank)
+            fprintf(stderr, "%ld tasks on one rank, at most %d fit into a queue\n", capacity,
+                    workq::Queue::max_capacity);
+        MPI_Finalize();
+        return 1;
+    }
+    // The queue has to be freed before MPI_Finalize
+    {
+        workq::Queue queue(MPI_COMM_WORLD, capacity);
+
+        bench::Reporter reporter(format, output, MPI_COMM_WORLD);
+        reporter.comment(std::to_string(ntasks) + " ntasks, " + std::to_string(total) +
+                         " tasks with " + distribution + " distribution, times are per run "
+                         "until the last rank is done");
+
+        for (auto &g : granularities) {
+            double granularity = std::atof(g.c_str()) * 1.0e-6;
+            bench::Workload work(granularity);
+
+            for (auto &method : methods) {
+                bool steal = method == "stealing";
+                std::vector<double> samples;
+                long steals = 0;
+                int valid = 1;
+                for (int n = 0; n < repeat + 1; n++) {
+                    queue.load(mine);
+                    long done = 0, sum = 0;
+                    int64_t task;
+                    double t0 = MPI_Wtime();
+                    while (queue.next(task, steal)) {
+                        work.run();
+                        done++;
+                        sum += task;
+                    }
+                    double t = MPI_Wtime() - t0;
+
+                    // Every task has to be run exactly once
+                    long counts[2] = {done, sum};
+                    MPI_Allreduce(MPI_IN_PLACE, counts, 2, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+                    valid = valid && counts[0] == total && counts[1] == total * (total - 1) / 2;
+                    MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+                    if (n > 0) {
+                        samples.push_back(t);
+                        steals += queue.stolen();
+                    }
+                }
+                MPI_Allreduce(MPI_IN_PLACE, &steals, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+                auto summary = bench::summarize(samples);
+                double t = summary.median > 0.0 ? summary.median : 1.0;
+                reporter.add({"granularity=" + g + "us", method,
+                              static_cast<long>(sizeof(int64_t)), summary,
+                              {{"granularity_us", granularity * 1.0e6},
+                               {"tasks_per_s", total / t},
+                               {"efficiency", total * granularity / ntasks / t},
+                               {"steals", static_cast<double>(steals) / repeat}}});
+                if (0 == rank && !valid)
+                    fprintf(stderr, "Something is wrong: %s with %s us tasks gave wrong "
+                            "data!!!\n", method.c_str(), g.c_str());
+            }
+        }
+
+        reporter.write();
+    }
+
+    MPI_Finalize();
+}
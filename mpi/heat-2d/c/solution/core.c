@@ -8,35 +8,415 @@
 
 #include "heat.h"
 
-/* Exchange the boundary values */
-void exchange(field *temperature, parallel_data *parallel)
+#define CALIBRATION_STEPS 20  // Timed exchanges per method in setup_packing
+
+/* Copy count values, stride apart, to a contiguous buffer and back. The
+ * plain loops over restrict pointers let the compiler vectorize them. */
+static void gather(double *restrict buf, const double *restrict src,
+                   int count, int stride)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        buf[i] = src[i * stride];
+}
+
+static void scatter(double *restrict dst, const double *restrict buf,
+                    int count, int stride)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        dst[i * stride] = buf[i];
+}
+
+/* Send count values with the given stride starting from send to dest,
+ * receive the same from source to recv, through contiguous buffers */
+static void sendrecv_packed(double *send, int dest, double *recv, int source,
+                            int count, int stride, int tag,
+                            parallel_data *parallel)
+{
+    if (dest != MPI_PROC_NULL)
+        gather(parallel->packbuf, send, count, stride);
+    MPI_Sendrecv(parallel->packbuf, count, MPI_DOUBLE, dest, tag,
+                 parallel->unpackbuf, count, MPI_DOUBLE, source, tag,
+                 parallel->comm, MPI_STATUS_IGNORE);
+    /* Nothing arrives at the outer boundary, keep its ghost values */
+    if (source != MPI_PROC_NULL)
+        scatter(recv, parallel->unpackbuf, count, stride);
+}
+
+/* Exchange the ghost rows with the neighbours above and below */
+static void exchange_rows(field *temperature, parallel_data *parallel)
 {
+    int nx = temperature->nx, ny = temperature->ny;
+
+    if (parallel->packing[0] == PACK_MANUAL) {
+        sendrecv_packed(temperature->data[1], parallel->nup,
+                        temperature->data[nx + 1], parallel->ndown,
+                        ny + 2, 1, 11, parallel);
+        sendrecv_packed(temperature->data[nx], parallel->ndown,
+                        temperature->data[0], parallel->nup,
+                        ny + 2, 1, 12, parallel);
+        return;
+    }
     // Send to the up, receive from down
     MPI_Sendrecv(temperature->data[1], 1, parallel->rowtype,
                  parallel->nup, 11,
-                 temperature->data[temperature->nx + 1], 1,
+                 temperature->data[nx + 1], 1,
                  parallel->rowtype, parallel->ndown, 11, parallel->comm,
                  MPI_STATUS_IGNORE);
     // Send to the down, receive from up
-    MPI_Sendrecv(temperature->data[temperature->nx], 1,
+    MPI_Sendrecv(temperature->data[nx], 1,
                  parallel->rowtype, parallel->ndown, 12,
                  temperature->data[0], 1, parallel->rowtype,
                  parallel->nup, 12, parallel->comm, MPI_STATUS_IGNORE);
+}
+
+/* Exchange the ghost columns with the neighbours on the left and right,
+ * including the ghost rows. After exchange_rows() these hold the rows of
+ * the neighbours above and below, so the corners of the ghost layers get
+ * the values of the diagonal neighbours (not with PACK_EDGES). */
+static void exchange_columns(field *temperature, parallel_data *parallel)
+{
+    int nx = temperature->nx, ny = temperature->ny;
+
+    if (parallel->packing[1] == PACK_EDGES) {
+        /* Contiguous without copies, only the inner rows are needed */
+        MPI_Sendrecv(&temperature->edge[EDGE_LEFT][1], nx, MPI_DOUBLE,
+                     parallel->nleft, 13,
+                     &temperature->edge[GHOST_RIGHT][1], nx, MPI_DOUBLE,
+                     parallel->nright, 13, parallel->comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(&temperature->edge[EDGE_RIGHT][1], nx, MPI_DOUBLE,
+                     parallel->nright, 14,
+                     &temperature->edge[GHOST_LEFT][1], nx, MPI_DOUBLE,
+                     parallel->nleft, 14, parallel->comm, MPI_STATUS_IGNORE);
+        return;
+    }
+    if (parallel->packing[1] == PACK_MANUAL) {
+        sendrecv_packed(&temperature->data[0][1], parallel->nleft,
+                        &temperature->data[0][ny + 1], parallel->nright,
+                        nx + 2, ny + 2, 13, parallel);
+        sendrecv_packed(&temperature->data[0][ny], parallel->nright,
+                        &temperature->data[0][0], parallel->nleft,
+                        nx + 2, ny + 2, 14, parallel);
+        return;
+    }
     // Send to the left, receive from right
     MPI_Sendrecv(&temperature->data[0][1], 1, parallel->columntype,
                  parallel->nleft, 13,
-                 &temperature->data[0][temperature->ny + 1], 1,
+                 &temperature->data[0][ny + 1], 1,
                  parallel->columntype, parallel->nright, 13,
                  parallel->comm, MPI_STATUS_IGNORE);
     // Send to the right, receive from left
-    MPI_Sendrecv(&temperature->data[0][temperature->ny], 1,
+    MPI_Sendrecv(&temperature->data[0][ny], 1,
                  parallel->columntype,
                  parallel->nright, 14, &temperature->data[0][0], 1,
                  parallel->columntype,
                  parallel->nleft, 14, parallel->comm, MPI_STATUS_IGNORE);
+}
 
+/* Exchange the boundary values with two-sided communication, in two
+ * phases: the order fills also the corners (see exchange_columns) */
+static void exchange_sendrecv(field *temperature, parallel_data *parallel)
+{
+    exchange_rows(temperature, parallel);
+    exchange_columns(temperature, parallel);
 }
 
+/* Time of one exchange of rows (dim 0) or columns (dim 1) with the given
+ * packing, on the slowest rank */
+static double time_exchange(field *temperature, parallel_data *parallel,
+                            int dim, enum halo_packing packing)
+{
+    double t0 = 0.0, t;
+    int i;
+
+    parallel->packing[dim] = packing;
+    /* Two untimed exchanges first */
+    for (i = -2; i < CALIBRATION_STEPS; i++) {
+        if (i == 0) {
+            MPI_Barrier(parallel->comm);
+            t0 = MPI_Wtime();
+        }
+        if (dim == 0)
+            exchange_rows(temperature, parallel);
+        else
+            exchange_columns(temperature, parallel);
+    }
+    t = (MPI_Wtime() - t0) / CALIBRATION_STEPS;
+    MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, parallel->comm);
+    return t;
+}
+
+/* Allocate the edge arrays of a field and copy the columns to them */
+static void allocate_edges(field *temperature)
+{
+    int nx = temperature->nx, ny = temperature->ny;
+    int columns[4] = { 1, ny, 0, ny + 1 };
+    int i, k;
+
+    temperature->edge[0] = (double *) malloc(4 * (nx + 2) * sizeof(double));
+    for (k = 0; k < 4; k++) {
+        temperature->edge[k] = temperature->edge[0] + k * (nx + 2);
+        for (i = 0; i < nx + 2; i++)
+            temperature->edge[k][i] = temperature->data[i][columns[k]];
+    }
+}
+
+/* Choose between the datatypes and manual packing for the sendrecv
+ * exchange of rows and columns. Whether strided columns are faster as a
+ * vector datatype or packed depends on the MPI library, so unless
+ * HEAT_PACK is datatype or pack, both are timed with the exchanges of the
+ * initial field (which does not change it) and the faster one is used.
+ * HEAT_PACK=edges avoids the strided columns altogether: the columns are
+ * kept in contiguous edge arrays of both fields. */
+void setup_packing(field *temperature1, field *temperature2,
+                   parallel_data *parallel)
+{
+    char *choice = getenv("HEAT_PACK");
+    const char *names[2] = { "rows", "columns" };
+    int count = (temperature1->nx > temperature1->ny ?
+                 temperature1->nx : temperature1->ny) + 2;
+    double t_datatype, t_pack;
+    int dim;
+
+    parallel->packbuf = (double *) malloc(count * sizeof(double));
+    parallel->unpackbuf = (double *) malloc(count * sizeof(double));
+
+    if (choice != NULL && strcmp(choice, "edges") == 0) {
+        parallel->packing[0] = PACK_DATATYPE;
+        parallel->packing[1] = PACK_EDGES;
+        allocate_edges(temperature1);
+        allocate_edges(temperature2);
+        if (parallel->rank == 0)
+            printf("Exchange of rows with datatype, columns with edge "
+                   "arrays\n");
+        return;
+    }
+
+    for (dim = 0; dim < 2; dim++) {
+        if (choice == NULL || strcmp(choice, "auto") == 0) {
+            t_datatype = time_exchange(temperature1, parallel, dim,
+                                       PACK_DATATYPE);
+            t_pack = time_exchange(temperature1, parallel, dim, PACK_MANUAL);
+            parallel->packing[dim] = t_pack < t_datatype ?
+                                     PACK_MANUAL : PACK_DATATYPE;
+            if (parallel->rank == 0)
+                printf("Exchange of %s: datatype %.1f us, pack %.1f us, "
+                       "using %s\n", names[dim], t_datatype * 1.0e6,
+                       t_pack * 1.0e6, parallel->packing[dim] == PACK_MANUAL ?
+                       "pack" : "datatype");
+        } else if (strcmp(choice, "datatype") == 0) {
+            parallel->packing[dim] = PACK_DATATYPE;
+        } else if (strcmp(choice, "pack") == 0) {
+            parallel->packing[dim] = PACK_MANUAL;
+        } else {
+            if (parallel->rank == 0)
+                printf("Unknown HEAT_PACK %s, use auto, datatype, pack or "
+                       "edges\n", choice);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+    if (choice != NULL && strcmp(choice, "auto") != 0 && parallel->rank == 0)
+        printf("Exchange of rows and columns with %s\n", choice);
+}
+
+/* Put the boundary of the own domain directly into the ghost layers of the
+ * neighbours. Only the inner points are sent, so that the ghost layers
+ * which the neighbours are writing at the same time are not read. */
+static void put_boundary(field *temperature, parallel_data *parallel)
+{
+    int nx = temperature->nx, ny = temperature->ny;
+
+    // Upper row to the lower ghost row of the neighbour above
+    MPI_Put(&temperature->data[1][1], ny, MPI_DOUBLE, parallel->nup,
+            (nx + 1) * (ny + 2) + 1, ny, MPI_DOUBLE, temperature->win);
+    // Lower row to the upper ghost row of the neighbour below
+    MPI_Put(&temperature->data[nx][1], ny, MPI_DOUBLE, parallel->ndown,
+            1, ny, MPI_DOUBLE, temperature->win);
+    // Left column to the right ghost column of the left neighbour
+    MPI_Put(&temperature->data[1][1], 1, parallel->innercolumntype,
+            parallel->nleft, (ny + 2) + ny + 1, 1, parallel->innercolumntype,
+            temperature->win);
+    // Right column to the left ghost column of the right neighbour
+    MPI_Put(&temperature->data[1][ny], 1, parallel->innercolumntype,
+            parallel->nright, (ny + 2), 1, parallel->innercolumntype,
+            temperature->win);
+}
+
+/* Exchange the boundary values with MPI_Put, synchronizing only with the
+ * four neighbours (general active target synchronization) */
+static void exchange_rma_pscw(field *temperature, parallel_data *parallel)
+{
+    MPI_Win_post(parallel->nghbrgroup, 0, temperature->win);
+    MPI_Win_start(parallel->nghbrgroup, 0, temperature->win);
+    put_boundary(temperature, parallel);
+    MPI_Win_complete(temperature->win);
+    MPI_Win_wait(temperature->win);
+}
+
+/* Exchange the boundary values with MPI_Put in a passive target epoch
+ * that lasts the whole run. After the data, the number of the exchange is
+ * written atomically to a flag of the neighbour, one flag per ghost side, and the
+ * exchange is over when the flags of all own ghost sides have arrived.
+ *
+ * The two fields alternate, so a rank can be at most one exchange ahead
+ * of its neighbours: it cannot overwrite a ghost layer that a neighbour
+ * still reads in evolve(). */
+static void exchange_rma_notify(field *temperature, parallel_data *parallel)
+{
+    int nghbrs[4] = { parallel->nup, parallel->ndown,
+                      parallel->nleft, parallel->nright };
+    /* Ghost side of the neighbour that our boundary goes to */
+    int remote_side[4] = { 1, 0, 3, 2 };
+    int count = ++parallel->exchanges;
+    int i, value;
+
+    put_boundary(temperature, parallel);
+    for (i = 0; i < 4; i++) {
+        if (nghbrs[i] == MPI_PROC_NULL)
+            continue;
+        MPI_Win_flush(nghbrs[i], temperature->win);
+        /* Atomic like the reads of the owner, a Put to the same location
+         * would be erroneous */
+        MPI_Accumulate(&count, 1, MPI_INT, nghbrs[i], remote_side[i], 1,
+                       MPI_INT, MPI_REPLACE, parallel->flagwin);
+        MPI_Win_flush(nghbrs[i], parallel->flagwin);
+    }
+
+    /* Atomic reads of the own flags, which also drive the progress */
+    for (i = 0; i < 4; i++) {
+        if (nghbrs[i] == MPI_PROC_NULL)
+            continue;
+        do {
+            MPI_Fetch_and_op(NULL, &value, MPI_INT, parallel->rank, i,
+                             MPI_NO_OP, parallel->flagwin);
+            MPI_Win_flush(parallel->rank, parallel->flagwin);
+        } while (value < count);
+    }
+    MPI_Win_sync(temperature->win);
+}
+
+/* Exchange the boundary values with all eight neighbours at once: inner
+ * rows and columns with the neighbours on the sides and single corner
+ * points with the diagonal ones. Unlike in the two phases of
+ * exchange_sendrecv, no message depends on another. */
+static void exchange_diagonal(field *temperature, parallel_data *parallel)
+{
+    int nx = temperature->nx, ny = temperature->ny;
+    double **data = temperature->data;
+    /* Up, down, left, right, up-left, up-right, down-left, down-right */
+    int nghbrs[8] = { parallel->nup, parallel->ndown, parallel->nleft,
+                      parallel->nright, parallel->ndiag[0],
+                      parallel->ndiag[1], parallel->ndiag[2],
+                      parallel->ndiag[3] };
+    int opposite[8] = { 1, 0, 3, 2, 7, 6, 5, 4 };
+    double *send[8] = { &data[1][1], &data[nx][1], &data[1][1], &data[1][ny],
+                        &data[1][1], &data[1][ny], &data[nx][1],
+                        &data[nx][ny] };
+    double *recv[8] = { &data[0][1], &data[nx + 1][1], &data[1][0],
+                        &data[1][ny + 1], &data[0][0], &data[0][ny + 1],
+                        &data[nx + 1][0], &data[nx + 1][ny + 1] };
+    int counts[8] = { ny, ny, 1, 1, 1, 1, 1, 1 };
+    MPI_Datatype types[8] = { MPI_DOUBLE, MPI_DOUBLE,
+                              parallel->innercolumntype,
+                              parallel->innercolumntype, MPI_DOUBLE,
+                              MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE };
+    MPI_Request requests[16];
+    int k;
+
+    /* The tag is the direction of the message */
+    for (k = 0; k < 8; k++)
+        MPI_Irecv(recv[k], counts[k], types[k], nghbrs[k], opposite[k],
+                  parallel->comm, &requests[k]);
+    for (k = 0; k < 8; k++)
+        MPI_Isend(send[k], counts[k], types[k], nghbrs[k], k,
+                  parallel->comm, &requests[8 + k]);
+    MPI_Waitall(16, requests, MPI_STATUSES_IGNORE);
+}
+
+/* Exchange the boundary values */
+void exchange(field *temperature, parallel_data *parallel)
+{
+    switch (parallel->exchange_mode) {
+    case EXCHANGE_DIAGONAL:
+        exchange_diagonal(temperature, parallel);
+        break;
+    case EXCHANGE_RMA_PSCW:
+        exchange_rma_pscw(temperature, parallel);
+        break;
+    case EXCHANGE_RMA_NOTIFY:
+        exchange_rma_notify(temperature, parallel);
+        break;
+    default:
+        exchange_sendrecv(temperature, parallel);
+    }
+}
+
+
+/* Five-point stencil at one point */
+static inline double stencil(double up, double centre, double down,
+                             double left, double right, double a, double dt,
+                             double dx2, double dy2)
+{
+    return centre + a * dt * ((down - 2.0 * centre + up) / dx2 +
+                              (right - 2.0 * centre + left) / dy2);
+}
+
+/* evolve() with PACK_EDGES: the ghost columns are read from the contiguous
+ * ghost arrays, and the new first and last inner columns are copied to the
+ * edge arrays as they are computed, ready for the next exchange */
+static void evolve_edges(field *curr, field *prev, double a, double dt)
+{
+    int i, j, ny = curr->ny;
+    double dx2, dy2, left, right;
+    double *up, *row, *down, *out;
+
+    dx2 = prev->dx * prev->dx;
+    dy2 = prev->dy * prev->dy;
+    for (i = 1; i < curr->nx + 1; i++) {
+        up = prev->data[i - 1];
+        row = prev->data[i];
+        down = prev->data[i + 1];
+        out = curr->data[i];
+        left = prev->edge[GHOST_LEFT][i];
+        right = prev->edge[GHOST_RIGHT][i];
+
+        out[1] = stencil(up[1], row[1], down[1], left,
+                         ny > 1 ? row[2] : right, a, dt, dx2, dy2);
+        for (j = 2; j < ny; j++)
+            out[j] = stencil(up[j], row[j], down[j], row[j - 1], row[j + 1],
+                             a, dt, dx2, dy2);
+        if (ny > 1)
+            out[ny] = stencil(up[ny], row[ny], down[ny], row[ny - 1], right,
+                              a, dt, dx2, dy2);
+
+        curr->edge[EDGE_LEFT][i] = out[1];
+        curr->edge[EDGE_RIGHT][i] = out[ny];
+    }
+}
+
+/* Update with the nine-point stencil, which uses also the diagonal
+ * neighbours of each point. Its truncation error does not depend on the
+ * direction, unlike that of the five-point stencil. The weights are
+ * those of the square grid (dx == dy) that the solver uses. */
+static void evolve_nine(field *curr, field *prev, double a, double dt)
+{
+    int i, j;
+    double dx2;
+    double **p = prev->data;
+
+    dx2 = prev->dx * prev->dx;
+    for (i = 1; i < curr->nx + 1; i++) {
+        for (j = 1; j < curr->ny + 1; j++) {
+            curr->data[i][j] = p[i][j] + a * dt *
+                               (4.0 * (p[i + 1][j] + p[i - 1][j] +
+                                       p[i][j + 1] + p[i][j - 1]) +
+                                p[i + 1][j + 1] + p[i + 1][j - 1] +
+                                p[i - 1][j + 1] + p[i - 1][j - 1] -
+                                20.0 * p[i][j]) / (6.0 * dx2);
+        }
+    }
+}
 
 /* Update the temperature values using five-point stencil */
 void evolve(field *curr, field *prev, double a, double dt)
@@ -44,6 +424,15 @@ void evolve(field *curr, field *prev, double a, double dt)
     int i, j;
     double dx2, dy2;
 
+    if (prev->stencil == 9) {
+        evolve_nine(curr, prev, a, dt);
+        return;
+    }
+    if (prev->edge[0] != NULL) {
+        evolve_edges(curr, prev, a, dt);
+        return;
+    }
+
     /* Determine the temperature field at next time step
      * As we have fixed boundary conditions, the outermost gridpoints
      * are not updated. */
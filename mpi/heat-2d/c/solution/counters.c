@@ -0,0 +1,318 @@
+/* Hardware performance counters of the phases of the time step and the
+ * position of evolve() in the roofline model, enabled with the
+ * environment variable HEAT_COUNTERS=1.
+ *
+ * The counters (cycles, instructions, last level cache references and
+ * misses of the own process in user space) are read with the Linux
+ * perf_event_open system call as one group at the start and end of every
+ * phase. When the kernel multiplexes the group with other events, the
+ * counts of a phase are scaled by the time the group was enabled over the
+ * time it was running, and phases in which it never ran or whose reading
+ * failed are left out. If the counters are not available (other systems,
+ * perf_event_paranoid, virtual machines without a PMU), only the derived
+ * model numbers are reported.
+ *
+ * The bandwidth ceiling is measured at startup with the STREAM triad on
+ * all ranks at the same time, so that the ranks of a node share the memory
+ * bandwidth as they do in the solver. As in STREAM, the write-allocate
+ * traffic is not counted, neither in the triad nor in the bytes of
+ * evolve(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <mpi.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#include "heat.h"
+
+enum counter {
+    COUNT_CYCLES,
+    COUNT_INSTRUCTIONS,
+    COUNT_LLC_REFERENCES,
+    COUNT_LLC_MISSES,
+    NCOUNTERS
+};
+
+/* Elements of each triad array, well above the cache of one core */
+#define TRIAD_SIZE (1 << 21)
+#define TRIAD_REPEAT 10
+#define CACHE_LINE 64
+
+/* Floating point operations of one point in evolve(), as written in the
+ * code, and the bytes of one point: read of prev and write of curr. This
+ * is the compulsory memory traffic, so evolve() can exceed the bound when
+ * the fields fit in the caches. */
+#define FLOPS_FIVE 12
+#define FLOPS_NINE 15
+#define BYTES_POINT 16
+
+/* Reading of the group: times in ns, in the order of the read format */
+typedef struct {
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t values[NCOUNTERS];
+} reading;
+
+static struct {
+    int enabled;
+    int available;              /* Hardware counters could be opened */
+    int fds[NCOUNTERS];
+    reading start[NPHASES];
+    int start_valid[NPHASES];
+    double counts[NPHASES][NCOUNTERS];
+    double started[NPHASES];
+    double time[NPHASES];
+    long calls[NPHASES];
+    long scaled;                /* Phases with multiplexed counters */
+    long skipped;               /* Phases without counts */
+    double points;              /* Inner points of the local field */
+    int flops;                  /* Per point */
+    double bandwidth;           /* Triad bytes / s of this rank */
+} counters;
+
+#ifdef __linux__
+static int open_counter(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/* Opens the counters as a group led by the cycles, returns 0 on success */
+static int open_counters(void)
+{
+#ifdef __linux__
+    uint64_t configs[NCOUNTERS] = { PERF_COUNT_HW_CPU_CYCLES,
+                                    PERF_COUNT_HW_INSTRUCTIONS,
+                                    PERF_COUNT_HW_CACHE_REFERENCES,
+                                    PERF_COUNT_HW_CACHE_MISSES };
+    int i, j;
+
+    for (i = 0; i < NCOUNTERS; i++) {
+        counters.fds[i] = open_counter(configs[i],
+                                       i == 0 ? -1 : counters.fds[0]);
+        if (counters.fds[i] < 0) {
+            for (j = 0; j < i; j++)
+                close(counters.fds[j]);
+            return errno;
+        }
+    }
+    ioctl(counters.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+static void close_counters(void)
+{
+#ifdef __linux__
+    int i;
+
+    for (i = 0; i < NCOUNTERS; i++)
+        close(counters.fds[i]);
+#endif
+}
+
+/* Returns 1 if the whole group was read */
+static int read_counters(reading *r)
+{
+#ifdef __linux__
+    uint64_t group[1 + sizeof(reading) / sizeof(uint64_t)];
+
+    if (read(counters.fds[0], group, sizeof(group)) != sizeof(group) ||
+        group[0] != NCOUNTERS)
+        return 0;
+    memcpy(r, group + 1, sizeof(reading));
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Best triad bandwidth of this rank, with all ranks running it */
+static double triad_bandwidth(parallel_data *parallel)
+{
+    double *a, *b, *c, t0, best = 0.0;
+    double scalar = 3.0;
+    int i, n;
+
+    a = malloc(TRIAD_SIZE * sizeof(double));
+    b = malloc(TRIAD_SIZE * sizeof(double));
+    c = malloc(TRIAD_SIZE * sizeof(double));
+    for (i = 0; i < TRIAD_SIZE; i++) {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+    for (n = 0; n < TRIAD_REPEAT; n++) {
+        MPI_Barrier(parallel->comm);
+        t0 = timer_now();
+        for (i = 0; i < TRIAD_SIZE; i++)
+            a[i] = b[i] + scalar * c[i];
+        t0 = timer_now() - t0;
+        if (n == 0 || t0 < best)
+            best = t0;
+    }
+    /* Keep the result alive */
+    if (a[TRIAD_SIZE / 2] != 7.0)
+        best = 0.0;
+    free(a);
+    free(b);
+    free(c);
+    return best > 0.0 ? 3.0 * sizeof(double) * TRIAD_SIZE / best : 0.0;
+}
+
+void initialize_counters(field *temperature, parallel_data *parallel)
+{
+    char *mode = getenv("HEAT_COUNTERS");
+    int err, available;
+
+    memset(&counters, 0, sizeof(counters));
+    if (mode == NULL || strcmp(mode, "0") == 0)
+        return;
+    if (strcmp(mode, "1") != 0) {
+        if (parallel->rank == 0)
+            printf("Unknown HEAT_COUNTERS %s, use 0 or 1\n", mode);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    counters.enabled = 1;
+    counters.points = (double) temperature->nx * temperature->ny;
+    counters.flops = temperature->stencil == 9 ? FLOPS_NINE : FLOPS_FIVE;
+    counters.bandwidth = triad_bandwidth(parallel);
+
+    /* Counters only if they work on all ranks, so that the sums over the
+     * ranks are complete */
+    err = open_counters();
+    available = err == 0;
+    MPI_Allreduce(MPI_IN_PLACE, &available, 1, MPI_INT, MPI_LAND,
+                  parallel->comm);
+    if (err == 0 && !available)
+        close_counters();
+    counters.available = available;
+    if (parallel->rank == 0 && !available)
+        printf("Hardware counters not available (%s), reporting the model "
+               "only\n", err != 0 ? strerror(err) : "on some ranks");
+}
+
+void counters_start(enum phase phase)
+{
+    if (!counters.enabled)
+        return;
+    if (counters.available)
+        counters.start_valid[phase] = read_counters(&counters.start[phase]);
+    counters.started[phase] = timer_now();
+}
+
+void counters_stop(enum phase phase)
+{
+    reading now, *start = &counters.start[phase];
+    uint64_t enabled, running;
+    int i;
+
+    if (!counters.enabled)
+        return;
+    counters.time[phase] += timer_now() - counters.started[phase];
+    counters.calls[phase]++;
+    if (!counters.available)
+        return;
+    if (!counters.start_valid[phase] || !read_counters(&now) ||
+        now.running == start->running) {
+        counters.skipped++;
+        return;
+    }
+    enabled = now.enabled - start->enabled;
+    running = now.running - start->running;
+    if (running < enabled)
+        counters.scaled++;
+    for (i = 0; i < NCOUNTERS; i++)
+        counters.counts[phase][i] += (double) (now.values[i] -
+                                               start->values[i]) *
+                                     enabled / running;
+}
+
+/* Sums over the ranks, and rates from the average time of the phase over
+ * the ranks */
+void report_counters(parallel_data *parallel)
+{
+    double counts[NPHASES][NCOUNTERS], times[NPHASES], bandwidth;
+    double work, intensity, flops, bound;
+    long phases[2];
+    int i, size = parallel->size;
+
+    if (!counters.enabled)
+        return;
+    if (counters.available)
+        close_counters();
+
+    work = counters.flops * counters.points * counters.calls[PHASE_EVOLVE];
+    MPI_Reduce(&work, &flops, 1, MPI_DOUBLE, MPI_SUM, 0, parallel->comm);
+    MPI_Reduce(counters.counts, counts, NPHASES * NCOUNTERS, MPI_DOUBLE,
+               MPI_SUM, 0, parallel->comm);
+    MPI_Reduce(counters.time, times, NPHASES, MPI_DOUBLE, MPI_SUM, 0,
+               parallel->comm);
+    MPI_Reduce(&counters.bandwidth, &bandwidth, 1, MPI_DOUBLE, MPI_SUM, 0,
+               parallel->comm);
+    phases[0] = counters.scaled;
+    phases[1] = counters.skipped;
+    MPI_Reduce(parallel->rank == 0 ? MPI_IN_PLACE : phases, phases, 2,
+               MPI_LONG, MPI_SUM, 0, parallel->comm);
+    if (parallel->rank != 0)
+        return;
+
+    if (counters.available) {
+        printf("%-10s %10s %6s %12s %12s %10s\n", "Phase", "time (s)",
+               "IPC", "LLC refs", "LLC misses", "miss GB/s");
+        for (i = 0; i < NPHASES; i++) {
+            double *c = counts[i];
+            if (counters.calls[i] == 0)
+                continue;
+            printf("%-10s %10.4f %6.2f %12.4g %12.4g %10.2f\n",
+                   phase_names[i], times[i] / size,
+                   c[COUNT_CYCLES] > 0 ? c[COUNT_INSTRUCTIONS] / c[COUNT_CYCLES]
+                   : 0.0, c[COUNT_LLC_REFERENCES], c[COUNT_LLC_MISSES],
+                   times[i] > 0 ? c[COUNT_LLC_MISSES] * CACHE_LINE /
+                   (times[i] / size) * 1.0e-9 : 0.0);
+        }
+        if (phases[0] > 0 || phases[1] > 0)
+            printf("Counters multiplexed and scaled in %ld phases, missing "
+                   "in %ld phases\n", phases[0], phases[1]);
+    }
+
+    /* Roofline of evolve(): attainable FLOP/s = intensity x bandwidth */
+    if (times[PHASE_EVOLVE] <= 0.0)
+        return;
+    intensity = (double) counters.flops / BYTES_POINT;
+    flops /= times[PHASE_EVOLVE] / size;
+    bound = intensity * bandwidth;
+    printf("Triad bandwidth: %.2f GB/s over %d ranks, %.2f GB/s per rank\n",
+           bandwidth * 1.0e-9, size, bandwidth * 1.0e-9 / size);
+    printf("evolve(): %d flop and %d bytes per point (compulsory memory "
+           "traffic), intensity %.2f flop/byte\n", counters.flops,
+           BYTES_POINT, intensity);
+    printf("evolve(): %.2f GFLOP/s, %.2f GB/s over %d ranks, %.0f %% of "
+           "the roofline bound %.2f GFLOP/s%s\n", flops * 1.0e-9,
+           flops / intensity * 1.0e-9, size, 100.0 * flops / bound,
+           bound * 1.0e-9, flops > bound ? ", above it as the fields fit "
+           "in the caches" : "");
+}
@@ -12,20 +12,85 @@ typedef struct {
     double dx;
     double dy;
     double **data;
+    MPI_Win win;                /* Window of data for RMA halo exchange */
+    double *edge[4];            /* Contiguous columns for PACK_EDGES (see
+                                 * enum edge_column), otherwise NULL */
+    int stencil;                /* Points of the stencil in evolve(), 5 or 9 */
 } field;
 
+/* Columns kept in contiguous arrays of nx + 2 values, indexed like the
+ * rows, when the columns are exchanged with PACK_EDGES */
+enum edge_column {
+    EDGE_LEFT,                  /* Copy of the first inner column */
+    EDGE_RIGHT,                 /* Copy of the last inner column */
+    GHOST_LEFT,                 /* Left ghost column, used instead of data */
+    GHOST_RIGHT                 /* Right ghost column, used instead of data */
+};
+
+/* Halo exchange methods, selected with the environment variable
+ * HEAT_EXCHANGE (sendrecv, rma-pscw, rma-notify or diagonal) */
+enum exchange_mode {
+    EXCHANGE_SENDRECV,          /* MPI_Sendrecv with rows and columns */
+    EXCHANGE_RMA_PSCW,          /* MPI_Put, post/start/complete/wait */
+    EXCHANGE_RMA_NOTIFY,        /* MPI_Put, passive target with flags */
+    EXCHANGE_DIAGONAL           /* MPI_Isend / MPI_Irecv with all eight
+                                 * neighbours, including the corners */
+};
+
+/* Halo messages of the sendrecv exchange, chosen separately for rows and
+ * columns by a calibration at startup or with the environment variable
+ * HEAT_PACK (auto, datatype, pack or edges) */
+enum halo_packing {
+    PACK_DATATYPE,              /* Sent with rowtype and columntype */
+    PACK_MANUAL,                /* Copied to and from contiguous buffers */
+    PACK_EDGES                  /* Columns only: sent from and received to
+                                 * the edge arrays maintained by evolve() */
+};
+
 /* Datatype for basic parallelization information */
 typedef struct {
     int size;                   /* Number of MPI tasks */
     int rank;
     int nup, ndown, nleft, nright; /* Ranks of neighbouring MPI tasks */
+    int ndiag[4];              /* Up-left, up-right, down-left, down-right,
+                                * only for EXCHANGE_DIAGONAL */
     MPI_Comm comm;             /* Cartesian communicator */
     MPI_Datatype rowtype;      /* MPI Datatype for communication of rows */
     MPI_Datatype columntype;   /* MPI Datatype for communication of columns */
     MPI_Datatype subarraytype; /* MPI Datatype for communication of inner region */
+    enum exchange_mode exchange_mode;
+    MPI_Datatype innercolumntype; /* Column without ghost rows */
+    MPI_Group nghbrgroup;      /* Neighbours for PSCW synchronization */
+    MPI_Win flagwin;           /* Notification flags, one per ghost side */
+    int *flags;
+    int exchanges;             /* Number of halo exchanges done */
+    enum halo_packing packing[2]; /* Rows (up/down) and columns (left/right) */
+    double *packbuf, *unpackbuf;  /* Buffers for PACK_MANUAL */
 } parallel_data;
 
 
+/* Phases of the time step timed with HEAT_TIMERS, the exchange is split
+ * into the wait and the transfer with HEAT_TIMERS=wait */
+enum phase {
+    PHASE_EXCHANGE,
+    PHASE_WAIT,
+    PHASE_TRANSFER,
+    PHASE_EVOLVE,
+    PHASE_OUTPUT,
+    NPHASES
+};
+
+/* Names of the phases in the reports, defined in timing.c */
+extern const char *phase_names[NPHASES];
+
+/* Time spent in each phase on this rank */
+typedef struct {
+    int enabled;
+    int split_wait;             /* Barrier before every exchange */
+    double total[NPHASES];
+} phase_timers;
+
+
 /* We use here fixed grid spacing */
 #define DX 0.01
 #define DY 0.01
@@ -50,6 +115,12 @@ void generate_field(field *temperature, parallel_data *parallel);
 
 void exchange(field *temperature, parallel_data *parallel);
 
+void setup_exchange(field *temperature1, field *temperature2,
+                    parallel_data *parallel);
+
+void setup_packing(field *temperature1, field *temperature2,
+                   parallel_data *parallel);
+
 void evolve(field *curr, field *prev, double a, double dt);
 
 void write_field(field *temperature, int iter, parallel_data *parallel);
@@ -63,6 +134,27 @@ void swap_fields(field *temperature1, field *temperature2);
 
 void allocate_field(field *temperature);
 
+void initialize_timers(phase_timers *timers, parallel_data *parallel);
+
+double timer_now(void);
+
+double timer_start(phase_timers *timers, enum phase phase);
+
+void timer_stop(phase_timers *timers, enum phase phase, double start);
+
+void timed_exchange(field *temperature, parallel_data *parallel,
+                    phase_timers *timers);
+
+void report_timers(phase_timers *timers, parallel_data *parallel);
+
+void initialize_counters(field *temperature, parallel_data *parallel);
+
+void counters_start(enum phase phase);
+
+void counters_stop(enum phase phase);
+
+void report_counters(parallel_data *parallel);
+
 void finalize(field *temperature1, field *temperature2, 
               parallel_data *parallel);
 
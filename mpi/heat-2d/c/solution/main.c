@@ -27,9 +27,14 @@ int main(int argc, char **argv)
 
     double start_clock;        //!< Time stamps
 
+    phase_timers timers;       //!< Times of the phases of the time step
+    double phase_clock;
+
     MPI_Init(&argc, &argv);
 
     initialize(argc, argv, &current, &previous, &nsteps, &parallelization);
+    initialize_timers(&timers, &parallelization);
+    initialize_counters(&current, &parallelization);
 
     /* Output the initial field */
     write_field(&current, 0, &parallelization);
@@ -44,10 +49,14 @@ int main(int argc, char **argv)
 
     /* Time evolve */
     for (iter = 1; iter <= nsteps; iter++) {
-        exchange(&previous, &parallelization);
+        timed_exchange(&previous, &parallelization, &timers);
+        phase_clock = timer_start(&timers, PHASE_EVOLVE);
         evolve(&current, &previous, a, dt);
+        timer_stop(&timers, PHASE_EVOLVE, phase_clock);
         if (iter % image_interval == 0 || iter == nsteps) {
+          phase_clock = timer_start(&timers, PHASE_OUTPUT);
           write_field(&current, iter, &parallelization);
+          timer_stop(&timers, PHASE_OUTPUT, phase_clock);
         }
         /* Swap current field so that it will be used
             as previous for next iteration step */
@@ -59,6 +68,8 @@ int main(int argc, char **argv)
       printf("Iteration took %.3f seconds.\n", (MPI_Wtime() - start_clock));
       printf("Reference value at 5,5: %f\n", previous.data[5][5]);
     }
+    report_timers(&timers, &parallelization);
+    report_counters(&parallelization);
 
     finalize(&current, &previous, &parallelization);
     MPI_Finalize();
@@ -74,6 +74,146 @@ void initialize(int argc, char* argv[], field *current,
         allocate_field(previous);
         copy_field(current, previous);
       }
+
+    setup_exchange(current, previous, parallel);
+}
+
+/* Move the data of a field into memory allocated with MPI_Win_allocate */
+static void allocate_window(field *temperature, parallel_data *parallel)
+{
+    int nx = temperature->nx + 2, ny = temperature->ny + 2;
+    double *base, **array;
+    int i;
+
+    MPI_Win_allocate(nx * ny * sizeof(double), sizeof(double), MPI_INFO_NULL,
+                     parallel->comm, &base, &temperature->win);
+    memcpy(base, temperature->data[0], nx * ny * sizeof(double));
+    free_2d(temperature->data);
+
+    array = (double **) malloc(nx * sizeof(double *));
+    for (i = 0; i < nx; i++) {
+        array[i] = base + i * ny;
+    }
+    temperature->data = array;
+}
+
+/* Ranks of the diagonal neighbours, MPI_PROC_NULL outside the grid */
+static void diagonal_neighbours(parallel_data *parallel)
+{
+    int shifts[4][2] = { { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
+    int dims[2], periods[2], coords[2], c[2], k;
+
+    MPI_Cart_get(parallel->comm, 2, dims, periods, coords);
+    for (k = 0; k < 4; k++) {
+        c[0] = coords[0] + shifts[k][0];
+        c[1] = coords[1] + shifts[k][1];
+        if (c[0] < 0 || c[0] >= dims[0] || c[1] < 0 || c[1] >= dims[1])
+            parallel->ndiag[k] = MPI_PROC_NULL;
+        else
+            MPI_Cart_rank(parallel->comm, c, &parallel->ndiag[k]);
+    }
+}
+
+/* Select the stencil (environment variable HEAT_STENCIL, 5 or 9) and the
+ * halo exchange method (environment variable HEAT_EXCHANGE), and create
+ * the RMA windows it needs, or set up the packing of the sendrecv
+ * exchange. The nine-point stencil also needs the corners of the ghost
+ * layers, which only sendrecv (in its two phases) and diagonal fill. */
+void setup_exchange(field *temperature1, field *temperature2,
+                    parallel_data *parallel)
+{
+    char *mode = getenv("HEAT_EXCHANGE");
+    char *stencil = getenv("HEAT_STENCIL");
+    int nghbrs[4] = { parallel->nup, parallel->ndown,
+                      parallel->nleft, parallel->nright };
+    int ranks[4], n = 0, i;
+    MPI_Group group;
+
+    parallel->exchange_mode = EXCHANGE_SENDRECV;
+    parallel->exchanges = 0;
+    parallel->packing[0] = PACK_DATATYPE;
+    parallel->packing[1] = PACK_DATATYPE;
+    parallel->packbuf = NULL;
+    parallel->unpackbuf = NULL;
+    temperature1->win = MPI_WIN_NULL;
+    temperature2->win = MPI_WIN_NULL;
+    for (i = 0; i < 4; i++) {
+        temperature1->edge[i] = NULL;
+        temperature2->edge[i] = NULL;
+    }
+
+    temperature1->stencil = 5;
+    if (stencil != NULL && strcmp(stencil, "9") == 0) {
+        temperature1->stencil = 9;
+        if (parallel->rank == 0)
+            printf("Nine-point stencil\n");
+    } else if (stencil != NULL && strcmp(stencil, "5") != 0) {
+        if (parallel->rank == 0)
+            printf("Unknown HEAT_STENCIL %s, use 5 or 9\n", stencil);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    temperature2->stencil = temperature1->stencil;
+
+    if (mode == NULL || strcmp(mode, "sendrecv") == 0) {
+        setup_packing(temperature1, temperature2, parallel);
+        if (temperature1->stencil == 9 && parallel->packing[1] == PACK_EDGES) {
+            if (parallel->rank == 0)
+                printf("The edge arrays have no corners for the nine-point "
+                       "stencil\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        return;
+    } else if (strcmp(mode, "rma-pscw") == 0) {
+        parallel->exchange_mode = EXCHANGE_RMA_PSCW;
+    } else if (strcmp(mode, "rma-notify") == 0) {
+        parallel->exchange_mode = EXCHANGE_RMA_NOTIFY;
+    } else if (strcmp(mode, "diagonal") == 0) {
+        parallel->exchange_mode = EXCHANGE_DIAGONAL;
+    } else {
+        if (parallel->rank == 0)
+            printf("Unknown HEAT_EXCHANGE %s, use sendrecv, rma-pscw, "
+                   "rma-notify or diagonal\n", mode);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (parallel->rank == 0)
+        printf("Halo exchange with %s\n", mode);
+    if (temperature1->stencil == 9 &&
+        parallel->exchange_mode != EXCHANGE_DIAGONAL) {
+        if (parallel->rank == 0)
+            printf("The RMA exchanges do not fill the corners for the "
+                   "nine-point stencil, use sendrecv or diagonal\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    MPI_Type_vector(temperature1->nx, 1, temperature1->ny + 2, MPI_DOUBLE,
+                    &parallel->innercolumntype);
+    MPI_Type_commit(&parallel->innercolumntype);
+    if (parallel->exchange_mode == EXCHANGE_DIAGONAL) {
+        diagonal_neighbours(parallel);
+        return;
+    }
+
+    allocate_window(temperature1, parallel);
+    allocate_window(temperature2, parallel);
+
+    if (parallel->exchange_mode == EXCHANGE_RMA_PSCW) {
+        for (i = 0; i < 4; i++)
+            if (nghbrs[i] != MPI_PROC_NULL)
+                ranks[n++] = nghbrs[i];
+        MPI_Comm_group(parallel->comm, &group);
+        MPI_Group_incl(group, n, ranks, &parallel->nghbrgroup);
+        MPI_Group_free(&group);
+    } else {
+        MPI_Win_allocate(4 * sizeof(int), sizeof(int), MPI_INFO_NULL,
+                         parallel->comm, &parallel->flags, &parallel->flagwin);
+        for (i = 0; i < 4; i++)
+            parallel->flags[i] = 0;
+        MPI_Win_lock_all(0, temperature1->win);
+        MPI_Win_lock_all(0, temperature2->win);
+        MPI_Win_lock_all(0, parallel->flagwin);
+        /* Nobody may notify before all flags are initialized */
+        MPI_Barrier(parallel->comm);
+    }
 }
 
 /* Generate initial temperature field.  Pattern is disc with a radius
@@ -239,9 +379,33 @@ void parallel_set_dimensions(parallel_data *parallel, int nx, int ny)
 void finalize(field *temperature1, field *temperature2, 
               parallel_data *parallel)
 {
-    free_2d(temperature1->data);
-    free_2d(temperature2->data);
-
+    if (parallel->exchange_mode == EXCHANGE_SENDRECV ||
+        parallel->exchange_mode == EXCHANGE_DIAGONAL) {
+        free_2d(temperature1->data);
+        free_2d(temperature2->data);
+    } else {
+        if (parallel->exchange_mode == EXCHANGE_RMA_NOTIFY) {
+            MPI_Win_unlock_all(temperature1->win);
+            MPI_Win_unlock_all(temperature2->win);
+            MPI_Win_unlock_all(parallel->flagwin);
+            MPI_Win_free(&parallel->flagwin);
+        } else {
+            MPI_Group_free(&parallel->nghbrgroup);
+        }
+        /* Freeing the windows frees also the data */
+        free(temperature1->data);
+        free(temperature2->data);
+        MPI_Win_free(&temperature1->win);
+        MPI_Win_free(&temperature2->win);
+    }
+    if (parallel->exchange_mode != EXCHANGE_SENDRECV)
+        MPI_Type_free(&parallel->innercolumntype);
+
+    free(parallel->packbuf);
+    free(parallel->unpackbuf);
+    /* The edge arrays of a field are one allocation */
+    free(temperature1->edge[0]);
+    free(temperature2->edge[0]);
     MPI_Type_free(&parallel->rowtype);
     MPI_Type_free(&parallel->columntype);
     MPI_Type_free(&parallel->subarraytype);
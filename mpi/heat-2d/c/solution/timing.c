@@ -0,0 +1,156 @@
+/* Timers of the phases of the time step, enabled with the environment
+ * variable HEAT_TIMERS:
+ *   phases  time exchange(), evolve() and write_field() on every rank
+ *   wait    in addition, a barrier before every exchange separates the
+ *           time waiting for the slowest rank from the transfer itself
+ * Without HEAT_TIMERS every timer call is a single branch.
+ *
+ * Built with TRACE=1, the phases are also marked as regions of the
+ * timeline of tools/trace. The hardware counters of counters.c are read
+ * at the same points. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mpi.h>
+
+#include "heat.h"
+#ifdef HEAT_TRACE
+#include "trace.h"
+#endif
+
+const char *phase_names[NPHASES] = {
+    "exchange", "wait", "transfer", "evolve", "output"
+};
+
+static void mark_begin(enum phase phase)
+{
+#ifdef HEAT_TRACE
+    trace_begin(phase_names[phase]);
+#endif
+    counters_start(phase);
+}
+
+static void mark_end(enum phase phase)
+{
+    counters_stop(phase);
+#ifdef HEAT_TRACE
+    trace_end(phase_names[phase]);
+#endif
+}
+
+void initialize_timers(phase_timers *timers, parallel_data *parallel)
+{
+    char *mode = getenv("HEAT_TIMERS");
+    int i;
+
+    timers->enabled = 0;
+    timers->split_wait = 0;
+    for (i = 0; i < NPHASES; i++)
+        timers->total[i] = 0.0;
+    if (mode == NULL)
+        return;
+
+    if (strcmp(mode, "phases") == 0) {
+        timers->enabled = 1;
+    } else if (strcmp(mode, "wait") == 0) {
+        timers->enabled = 1;
+        timers->split_wait = 1;
+    } else {
+        if (parallel->rank == 0)
+            printf("Unknown HEAT_TIMERS %s, use phases or wait\n", mode);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+/* Monotonic wall clock time in seconds, cheaper than a system call on
+ * Linux */
+double timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+/* Halo exchange, with the barrier of the wait mode in front of it */
+void timed_exchange(field *temperature, parallel_data *parallel,
+                    phase_timers *timers)
+{
+    double t0, t1, t2;
+
+    mark_begin(PHASE_EXCHANGE);
+    if (!timers->enabled) {
+        exchange(temperature, parallel);
+        mark_end(PHASE_EXCHANGE);
+        return;
+    }
+    t0 = timer_now();
+    if (timers->split_wait) {
+        mark_begin(PHASE_WAIT);
+        MPI_Barrier(parallel->comm);
+        mark_end(PHASE_WAIT);
+    }
+    t1 = timer_now();
+    exchange(temperature, parallel);
+    t2 = timer_now();
+    mark_end(PHASE_EXCHANGE);
+    timers->total[PHASE_WAIT] += t1 - t0;
+    timers->total[PHASE_TRANSFER] += t2 - t1;
+    timers->total[PHASE_EXCHANGE] += t2 - t0;
+}
+
+/* Start time of a phase, or zero if the timers are off */
+double timer_start(phase_timers *timers, enum phase phase)
+{
+    mark_begin(phase);
+    return timers->enabled ? timer_now() : 0.0;
+}
+
+void timer_stop(phase_timers *timers, enum phase phase, double start)
+{
+    if (timers->enabled)
+        timers->total[phase] += timer_now() - start;
+    mark_end(phase);
+}
+
+/* Minimum, average and maximum over the ranks of each phase, and the
+ * imbalance max / avg. The ranks with the largest time are the ones the
+ * others wait for. */
+void report_timers(phase_timers *timers, parallel_data *parallel)
+{
+    double mins[NPHASES], sums[NPHASES];
+    struct { double value; int rank; } times[NPHASES], maxs[NPHASES];
+    int i;
+
+    if (!timers->enabled)
+        return;
+
+    for (i = 0; i < NPHASES; i++) {
+        times[i].value = timers->total[i];
+        times[i].rank = parallel->rank;
+    }
+    MPI_Reduce(timers->total, mins, NPHASES, MPI_DOUBLE, MPI_MIN, 0,
+               parallel->comm);
+    MPI_Reduce(timers->total, sums, NPHASES, MPI_DOUBLE, MPI_SUM, 0,
+               parallel->comm);
+    MPI_Reduce(times, maxs, NPHASES, MPI_DOUBLE_INT, MPI_MAXLOC, 0,
+               parallel->comm);
+
+    if (parallel->rank == 0) {
+        printf("%-12s %10s %10s %10s %9s %9s\n", "Phase (s)", "min", "avg",
+               "max", "max rank", "max/avg");
+        for (i = 0; i < NPHASES; i++) {
+            double avg = sums[i] / parallel->size;
+            if ((i == PHASE_WAIT || i == PHASE_TRANSFER) &&
+                !timers->split_wait)
+                continue;
+            printf("%s%-*s %10.4f %10.4f %10.4f %9d %9.2f\n",
+                   i == PHASE_WAIT || i == PHASE_TRANSFER ? "  " : "",
+                   i == PHASE_WAIT || i == PHASE_TRANSFER ? 10 : 12,
+                   phase_names[i], mins[i], avg, maxs[i].value, maxs[i].rank,
+                   avg > 0.0 ? maxs[i].value / avg : 1.0);
+        }
+    }
+}
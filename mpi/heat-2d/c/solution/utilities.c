@@ -45,10 +45,22 @@ void copy_field(field *temperature1, field *temperature2)
 /* Swap the data of fields temperature1 and temperature2 */
 void swap_fields(field *temperature1, field *temperature2)
 {
-    double **tmp;
+    double **tmp, *tmpedge;
+    MPI_Win tmpwin;
+    int i;
     tmp = temperature1->data;
     temperature1->data = temperature2->data;
     temperature2->data = tmp;
+    /* RMA windows belong to the data */
+    tmpwin = temperature1->win;
+    temperature1->win = temperature2->win;
+    temperature2->win = tmpwin;
+    /* And so do the edge arrays */
+    for (i = 0; i < 4; i++) {
+        tmpedge = temperature1->edge[i];
+        temperature1->edge[i] = temperature2->edge[i];
+        temperature2->edge[i] = tmpedge;
+    }
 }
 
 /* Allocate memory for a temperature field and initialise it to zero */
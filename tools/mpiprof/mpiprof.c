@@ -0,0 +1,1305 @@
+/* Profiling layer for MPI programs using the PMPI interface.
+ *
+ * Every wrapped MPI call is timed and counted, together with the bytes it
+ * sends (for receives, the bytes received or posted). Point-to-point sends
+ * and one-sided puts are also recorded per destination rank of
+ * MPI_COMM_WORLD, which gives the rank-to-rank traffic matrix, and the
+ * time spent in blocking point-to-point calls is recorded per peer. So is
+ * the time in MPI_Wait, MPI_Waitall, MPI_Waitany and MPI_Waitsome for the
+ * requests of MPI_Isend, MPI_Issend and MPI_Irecv, whose peers are kept in
+ * a table of the pending requests; a wait that completes several of them
+ * charges an equal share of its time to each.
+ *
+ * In MPI_Finalize the statistics are reduced to rank 0, which prints a
+ * summary to stderr and writes two CSV files:
+ *   <prefix>-calls.csv   rank,call,calls,bytes,time
+ *   <prefix>-matrix.csv  rank,peer,messages,bytes,blocked_time
+ * The prefix is "mpiprof" or the value of the environment variable
+ * MPIPROF_PREFIX. MPI_Pcontrol(0) pauses the recording and MPI_Pcontrol(1)
+ * resumes it.
+ *
+ * The counters are not protected, so with MPI_THREAD_MULTIPLE only one
+ * thread at a time should call MPI. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <mpi.h>
+
+/* Wrapped calls */
+#define MPIPROF_CALLS(X) \
+    X(Send) X(Ssend) X(Isend) X(Issend) X(Recv) X(Irecv) X(Sendrecv) \
+    X(Probe) X(Iprobe) X(Wait) X(Waitall) X(Waitany) X(Waitsome) X(Test) \
+    X(Testall) X(Testany) X(Testsome) X(Request_free) X(Start) X(Startall) \
+    X(Barrier) X(Ibarrier) X(Bcast) X(Reduce) X(Allreduce) X(Gather) \
+    X(Scatter) X(Allgather) X(Alltoall) X(Alltoallv) X(Alltoallw) \
+    X(Neighbor_alltoall) X(Neighbor_alltoallv) X(Neighbor_alltoallw) \
+    X(Ineighbor_alltoall) X(Ineighbor_alltoallv) X(Ineighbor_alltoallw) \
+    X(Put) X(Get) X(Accumulate) X(Get_accumulate) X(Fetch_and_op) \
+    X(Compare_and_swap) X(Win_fence) X(Win_post) X(Win_start) \
+    X(Win_complete) X(Win_wait) X(Win_lock) X(Win_unlock) X(Win_lock_all) \
+    X(Win_unlock_all) X(Win_flush) X(Win_flush_all) X(Win_sync)
+
+#define MPIPROF_ENUM(name) CALL_ ## name,
+#define MPIPROF_NAME(name) "MPI_" #name,
+
+enum call_id { MPIPROF_CALLS(MPIPROF_ENUM) NCALLS };
+
+static const char *call_names[NCALLS] = { MPIPROF_CALLS(MPIPROF_NAME) };
+
+/* Statistics of one call */
+typedef struct {
+    double calls;
+    double bytes;
+    double time;
+} call_stats;
+
+/* Traffic to one rank of MPI_COMM_WORLD */
+typedef struct {
+    double messages;
+    double bytes;
+    double blocked;     /* in blocking point-to-point calls and waits */
+} peer_stats;
+
+static call_stats calls[NCALLS];
+static peer_stats *peers = NULL;
+static int world_size, world_rank;
+static int recording = 0;
+static double start_time;
+static int comm_keyval = MPI_KEYVAL_INVALID, win_keyval = MPI_KEYVAL_INVALID;
+
+#define MAX_LINKS 10
+
+/* Ranks of MPI_COMM_WORLD of the (remote) group of a communicator or the
+ * group of a window, cached as an attribute that is freed with them */
+static int free_ranks(void *ranks)
+{
+    free(ranks);
+    return MPI_SUCCESS;
+}
+
+static int free_comm_ranks(MPI_Comm comm, int keyval, void *ranks, void *extra)
+{
+    (void) comm;
+    (void) keyval;
+    (void) extra;
+    return free_ranks(ranks);
+}
+
+static int free_win_ranks(MPI_Win win, int keyval, void *ranks, void *extra)
+{
+    (void) win;
+    (void) keyval;
+    (void) extra;
+    return free_ranks(ranks);
+}
+
+static int *translate(MPI_Group group)
+{
+    MPI_Group world_group;
+    int i, size, *local, *ranks;
+
+    PMPI_Group_size(group, &size);
+    local = malloc(size * sizeof(int));
+    ranks = malloc(size * sizeof(int));
+    for (i = 0; i < size; i++)
+        local[i] = i;
+    PMPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    PMPI_Group_translate_ranks(group, size, local, world_group, ranks);
+    PMPI_Group_free(&world_group);
+    free(local);
+    return ranks;
+}
+
+/* Rank of MPI_COMM_WORLD, or MPI_UNDEFINED for MPI_PROC_NULL, wildcards
+ * and processes outside MPI_COMM_WORLD */
+static int world_rank_of(MPI_Comm comm, int rank)
+{
+    int *ranks, found, inter;
+    MPI_Group group;
+
+    if (rank < 0)
+        return MPI_UNDEFINED;
+    if (comm == MPI_COMM_WORLD)
+        return rank;
+    PMPI_Comm_get_attr(comm, comm_keyval, &ranks, &found);
+    if (!found) {
+        PMPI_Comm_test_inter(comm, &inter);
+        if (inter)
+            PMPI_Comm_remote_group(comm, &group);
+        else
+            PMPI_Comm_group(comm, &group);
+        ranks = translate(group);
+        PMPI_Group_free(&group);
+        PMPI_Comm_set_attr(comm, comm_keyval, ranks);
+    }
+    return ranks[rank];
+}
+
+static int win_world_rank_of(MPI_Win win, int rank)
+{
+    int *ranks, found;
+    MPI_Group group;
+
+    if (rank < 0)
+        return MPI_UNDEFINED;
+    PMPI_Win_get_attr(win, win_keyval, &ranks, &found);
+    if (!found) {
+        PMPI_Win_get_group(win, &group);
+        ranks = translate(group);
+        PMPI_Group_free(&group);
+        PMPI_Win_set_attr(win, win_keyval, ranks);
+    }
+    return ranks[rank];
+}
+
+static double nbytes(int count, MPI_Datatype type)
+{
+    int size;
+
+    if (count <= 0)
+        return 0.0;
+    PMPI_Type_size(type, &size);
+    return (double) count * size;
+}
+
+static double sum_bytes(int n, const int counts[], const MPI_Datatype types[])
+{
+    double bytes = 0.0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        bytes += nbytes(counts[i], types[i]);
+    return bytes;
+}
+
+/* Number of destinations of a neighbourhood collective */
+static int outdegree(MPI_Comm comm)
+{
+    int topo, n = 0, in, weighted;
+
+    PMPI_Topo_test(comm, &topo);
+    if (topo == MPI_CART) {
+        PMPI_Cartdim_get(comm, &n);
+        n *= 2;
+    } else if (topo == MPI_GRAPH) {
+        int rank;
+        PMPI_Comm_rank(comm, &rank);
+        PMPI_Graph_neighbors_count(comm, rank, &n);
+    } else if (topo == MPI_DIST_GRAPH) {
+        PMPI_Dist_graph_neighbors_count(comm, &in, &n, &weighted);
+    }
+    return n;
+}
+
+static void record(enum call_id id, double bytes, double t0)
+{
+    if (!recording)
+        return;
+    calls[id].calls += 1.0;
+    calls[id].bytes += bytes;
+    calls[id].time += PMPI_Wtime() - t0;
+}
+
+/* Data sent to a world rank, and time blocked with it if t0 >= 0 */
+static void record_peer(int peer, double bytes, double t0)
+{
+    if (!recording || peer == MPI_UNDEFINED)
+        return;
+    if (bytes >= 0.0) {
+        peers[peer].messages += 1.0;
+        peers[peer].bytes += bytes;
+    }
+    if (t0 >= 0.0)
+        peers[peer].blocked += PMPI_Wtime() - t0;
+}
+
+static void record_blocked(int peer, double time)
+{
+    if (recording && peer != MPI_UNDEFINED)
+        peers[peer].blocked += time;
+}
+
+/* Pending nonblocking point-to-point requests and their peers, in an open
+ * addressing hash table keyed by the request handle. A receive from
+ * MPI_ANY_SOURCE takes the peer from the status, so its communicator must
+ * not be freed before the request completes. */
+typedef struct {
+    MPI_Request request;
+    MPI_Comm comm;
+    int peer;           /* world rank, or MPI_ANY_SOURCE */
+    int state;
+} pending_request;
+
+enum { SLOT_EMPTY, SLOT_USED, SLOT_DELETED };
+
+#define PENDING_MIN 256
+#define LOCAL_REQUESTS 64
+
+static pending_request *pending = NULL;
+static size_t pending_size = 0, pending_filled = 0;   /* used or deleted */
+
+static size_t hash_request(MPI_Request request)
+{
+    unsigned long long key = 0;
+
+    memcpy(&key, &request, sizeof(request) < sizeof(key) ? sizeof(request)
+           : sizeof(key));
+    key ^= key >> 29;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    return (size_t) (key ^ (key >> 32));
+}
+
+static void insert_pending(MPI_Request request, MPI_Comm comm, int peer);
+
+/* Twice the size, or the same size to clear the deleted slots */
+static void rehash_pending(void)
+{
+    pending_request *old = pending;
+    size_t i, old_size = pending_size, used = 0;
+
+    for (i = 0; i < old_size; i++)
+        used += old[i].state == SLOT_USED;
+    pending_size = old_size == 0 ? PENDING_MIN
+                   : (4 * used > old_size ? 2 * old_size : old_size);
+    pending = calloc(pending_size, sizeof(pending_request));
+    pending_filled = 0;
+    for (i = 0; i < old_size; i++)
+        if (old[i].state == SLOT_USED)
+            insert_pending(old[i].request, old[i].comm, old[i].peer);
+    free(old);
+}
+
+static void insert_pending(MPI_Request request, MPI_Comm comm, int peer)
+{
+    size_t i;
+
+    if (request == MPI_REQUEST_NULL)
+        return;
+    if (2 * (pending_filled + 1) > pending_size)
+        rehash_pending();
+    i = hash_request(request) & (pending_size - 1);
+    while (pending[i].state == SLOT_USED && pending[i].request != request)
+        i = (i + 1) & (pending_size - 1);
+    if (pending[i].state == SLOT_EMPTY)
+        pending_filled++;
+    pending[i].request = request;
+    pending[i].comm = comm;
+    pending[i].peer = peer;
+    pending[i].state = SLOT_USED;
+}
+
+/* Removes the request from the table, returns the world rank of its peer
+ * or MPI_UNDEFINED if it is not a pending point-to-point request. Without
+ * a status, the peer of a receive from MPI_ANY_SOURCE is not known. */
+static int take_pending(MPI_Request request, const MPI_Status *status)
+{
+    size_t i;
+
+    if (pending_size == 0)
+        return MPI_UNDEFINED;
+    i = hash_request(request) & (pending_size - 1);
+    while (pending[i].state != SLOT_EMPTY) {
+        if (pending[i].state == SLOT_USED && pending[i].request == request) {
+            pending[i].state = SLOT_DELETED;
+            if (pending[i].peer != MPI_ANY_SOURCE)
+                return pending[i].peer;
+            if (status == NULL)
+                return MPI_UNDEFINED;
+            return world_rank_of(pending[i].comm, status->MPI_SOURCE);
+        }
+        i = (i + 1) & (pending_size - 1);
+    }
+    return MPI_UNDEFINED;
+}
+
+/* Forgets the completed requests, given by their handles from before the
+ * call (those at indices if not NULL), and charges an equal share of time
+ * to the peer of each */
+static void complete_requests(int n, const int indices[],
+                              const MPI_Request handles[],
+                              const MPI_Status statuses[], double time)
+{
+    int local[LOCAL_REQUESTS], *found = local;
+    int i, count = 0;
+
+    if (n > LOCAL_REQUESTS)
+        found = malloc(n * sizeof(int));
+    for (i = 0; i < n; i++) {
+        found[i] = take_pending(handles[indices != NULL ? indices[i] : i],
+                                &statuses[i]);
+        count += found[i] != MPI_UNDEFINED;
+    }
+    for (i = 0; i < n && count > 0; i++)
+        record_blocked(found[i], time / count);
+    if (found != local)
+        free(found);
+}
+
+static void start(void)
+{
+    PMPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    PMPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    peers = calloc(world_size, sizeof(peer_stats));
+    PMPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, free_comm_ranks,
+                            &comm_keyval, NULL);
+    PMPI_Win_create_keyval(MPI_WIN_NULL_COPY_FN, free_win_ranks,
+                           &win_keyval, NULL);
+    recording = 1;
+    start_time = PMPI_Wtime();
+}
+
+/* Environment and initialization */
+
+int MPI_Init(int *argc, char ***argv)
+{
+    int err = PMPI_Init(argc, argv);
+    start();
+    return err;
+}
+
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided)
+{
+    int err = PMPI_Init_thread(argc, argv, required, provided);
+    start();
+    return err;
+}
+
+int MPI_Pcontrol(const int level, ...)
+{
+    recording = level != 0;
+    return MPI_SUCCESS;
+}
+
+/* Point-to-point */
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest,
+             int tag, MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(count, datatype);
+    int err = PMPI_Send(buf, count, datatype, dest, tag, comm);
+    record(CALL_Send, bytes, t0);
+    record_peer(world_rank_of(comm, dest), bytes, t0);
+    return err;
+}
+
+int MPI_Ssend(const void *buf, int count, MPI_Datatype datatype, int dest,
+              int tag, MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(count, datatype);
+    int err = PMPI_Ssend(buf, count, datatype, dest, tag, comm);
+    record(CALL_Ssend, bytes, t0);
+    record_peer(world_rank_of(comm, dest), bytes, t0);
+    return err;
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest,
+              int tag, MPI_Comm comm, MPI_Request *request)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(count, datatype);
+    int err = PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+    int peer = world_rank_of(comm, dest);
+    record(CALL_Isend, bytes, t0);
+    record_peer(peer, bytes, -1.0);
+    if (peer != MPI_UNDEFINED)
+        insert_pending(*request, comm, peer);
+    return err;
+}
+
+int MPI_Issend(const void *buf, int count, MPI_Datatype datatype, int dest,
+               int tag, MPI_Comm comm, MPI_Request *request)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(count, datatype);
+    int err = PMPI_Issend(buf, count, datatype, dest, tag, comm, request);
+    int peer = world_rank_of(comm, dest);
+    record(CALL_Issend, bytes, t0);
+    record_peer(peer, bytes, -1.0);
+    if (peer != MPI_UNDEFINED)
+        insert_pending(*request, comm, peer);
+    return err;
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
+             int tag, MPI_Comm comm, MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Status local;
+    int received, err;
+
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+    PMPI_Get_count(status, datatype, &received);
+    record(CALL_Recv, received == MPI_UNDEFINED ? 0.0 : nbytes(received, datatype),
+           t0);
+    record_peer(world_rank_of(comm, status->MPI_SOURCE), -1.0, t0);
+    return err;
+}
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source,
+              int tag, MPI_Comm comm, MPI_Request *request)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+    int peer = source == MPI_ANY_SOURCE ? MPI_ANY_SOURCE
+               : world_rank_of(comm, source);
+    record(CALL_Irecv, nbytes(count, datatype), t0);
+    if (peer != MPI_UNDEFINED)
+        insert_pending(*request, comm, peer);
+    return err;
+}
+
+/* The blocked time is that of the receive from source */
+int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                 int dest, int sendtag, void *recvbuf, int recvcount,
+                 MPI_Datatype recvtype, int source, int recvtag,
+                 MPI_Comm comm, MPI_Status *status)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(sendcount, sendtype);
+    MPI_Status local;
+    int err;
+
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Sendrecv(sendbuf, sendcount, sendtype, dest, sendtag, recvbuf,
+                        recvcount, recvtype, source, recvtag, comm, status);
+    record(CALL_Sendrecv, bytes, t0);
+    record_peer(world_rank_of(comm, dest), bytes, -1.0);
+    record_peer(world_rank_of(comm, status->MPI_SOURCE), -1.0, t0);
+    return err;
+}
+
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Status local;
+    int err;
+
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Probe(source, tag, comm, status);
+    record(CALL_Probe, 0.0, t0);
+    record_peer(world_rank_of(comm, status->MPI_SOURCE), -1.0, t0);
+    return err;
+}
+
+int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag,
+               MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Iprobe(source, tag, comm, flag, status);
+    record(CALL_Iprobe, 0.0, t0);
+    return err;
+}
+
+/* The handles are copied before the call, which sets completed requests
+ * to MPI_REQUEST_NULL, and statuses are provided if the caller ignores
+ * them, for the source of receives from MPI_ANY_SOURCE */
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request handle = *request;
+    MPI_Status local;
+    int err;
+
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Wait(request, status);
+    record(CALL_Wait, 0.0, t0);
+    complete_requests(1, NULL, &handle, status, PMPI_Wtime() - t0);
+    return err;
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[])
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request local_handles[LOCAL_REQUESTS], *handles = local_handles;
+    MPI_Status local_statuses[LOCAL_REQUESTS], *all = statuses;
+    int err;
+
+    if (count > LOCAL_REQUESTS)
+        handles = malloc(count * sizeof(MPI_Request));
+    memcpy(handles, requests, count * sizeof(MPI_Request));
+    if (statuses == MPI_STATUSES_IGNORE)
+        all = count > LOCAL_REQUESTS ? malloc(count * sizeof(MPI_Status))
+              : local_statuses;
+    err = PMPI_Waitall(count, requests, all);
+    record(CALL_Waitall, 0.0, t0);
+    complete_requests(count, NULL, handles, all, PMPI_Wtime() - t0);
+    if (handles != local_handles)
+        free(handles);
+    if (all != statuses && all != local_statuses)
+        free(all);
+    return err;
+}
+
+int MPI_Waitany(int count, MPI_Request requests[], int *index,
+                MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request local_handles[LOCAL_REQUESTS], *handles = local_handles;
+    MPI_Status local;
+    int err;
+
+    if (count > LOCAL_REQUESTS)
+        handles = malloc(count * sizeof(MPI_Request));
+    memcpy(handles, requests, count * sizeof(MPI_Request));
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Waitany(count, requests, index, status);
+    record(CALL_Waitany, 0.0, t0);
+    if (*index != MPI_UNDEFINED)
+        complete_requests(1, NULL, &handles[*index], status,
+                          PMPI_Wtime() - t0);
+    if (handles != local_handles)
+        free(handles);
+    return err;
+}
+
+int MPI_Waitsome(int incount, MPI_Request requests[], int *outcount,
+                 int indices[], MPI_Status statuses[])
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request local_handles[LOCAL_REQUESTS], *handles = local_handles;
+    MPI_Status local_statuses[LOCAL_REQUESTS], *all = statuses;
+    int err;
+
+    if (incount > LOCAL_REQUESTS)
+        handles = malloc(incount * sizeof(MPI_Request));
+    memcpy(handles, requests, incount * sizeof(MPI_Request));
+    if (statuses == MPI_STATUSES_IGNORE)
+        all = incount > LOCAL_REQUESTS ? malloc(incount * sizeof(MPI_Status))
+              : local_statuses;
+    err = PMPI_Waitsome(incount, requests, outcount, indices, all);
+    record(CALL_Waitsome, 0.0, t0);
+    if (*outcount != MPI_UNDEFINED)
+        complete_requests(*outcount, indices, handles, all, PMPI_Wtime() - t0);
+    if (handles != local_handles)
+        free(handles);
+    if (all != statuses && all != local_statuses)
+        free(all);
+    return err;
+}
+
+/* Tests do not block, requests that they complete are only forgotten */
+
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request handle = *request;
+    MPI_Status local;
+    int err;
+
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Test(request, flag, status);
+    record(CALL_Test, 0.0, t0);
+    if (*flag)
+        complete_requests(1, NULL, &handle, status, 0.0);
+    return err;
+}
+
+int MPI_Testall(int count, MPI_Request requests[], int *flag,
+                MPI_Status statuses[])
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request local_handles[LOCAL_REQUESTS], *handles = local_handles;
+    MPI_Status local_statuses[LOCAL_REQUESTS], *all = statuses;
+    int err;
+
+    if (count > LOCAL_REQUESTS)
+        handles = malloc(count * sizeof(MPI_Request));
+    memcpy(handles, requests, count * sizeof(MPI_Request));
+    if (statuses == MPI_STATUSES_IGNORE)
+        all = count > LOCAL_REQUESTS ? malloc(count * sizeof(MPI_Status))
+              : local_statuses;
+    err = PMPI_Testall(count, requests, flag, all);
+    record(CALL_Testall, 0.0, t0);
+    if (*flag)
+        complete_requests(count, NULL, handles, all, 0.0);
+    if (handles != local_handles)
+        free(handles);
+    if (all != statuses && all != local_statuses)
+        free(all);
+    return err;
+}
+
+int MPI_Testany(int count, MPI_Request requests[], int *index, int *flag,
+                MPI_Status *status)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request local_handles[LOCAL_REQUESTS], *handles = local_handles;
+    MPI_Status local;
+    int err;
+
+    if (count > LOCAL_REQUESTS)
+        handles = malloc(count * sizeof(MPI_Request));
+    memcpy(handles, requests, count * sizeof(MPI_Request));
+    if (status == MPI_STATUS_IGNORE)
+        status = &local;
+    err = PMPI_Testany(count, requests, index, flag, status);
+    record(CALL_Testany, 0.0, t0);
+    if (*flag && *index != MPI_UNDEFINED)
+        complete_requests(1, NULL, &handles[*index], status, 0.0);
+    if (handles != local_handles)
+        free(handles);
+    return err;
+}
+
+int MPI_Testsome(int incount, MPI_Request requests[], int *outcount,
+                 int indices[], MPI_Status statuses[])
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request local_handles[LOCAL_REQUESTS], *handles = local_handles;
+    MPI_Status local_statuses[LOCAL_REQUESTS], *all = statuses;
+    int err;
+
+    if (incount > LOCAL_REQUESTS)
+        handles = malloc(incount * sizeof(MPI_Request));
+    memcpy(handles, requests, incount * sizeof(MPI_Request));
+    if (statuses == MPI_STATUSES_IGNORE)
+        all = incount > LOCAL_REQUESTS ? malloc(incount * sizeof(MPI_Status))
+              : local_statuses;
+    err = PMPI_Testsome(incount, requests, outcount, indices, all);
+    record(CALL_Testsome, 0.0, t0);
+    if (*outcount != MPI_UNDEFINED)
+        complete_requests(*outcount, indices, handles, all, 0.0);
+    if (handles != local_handles)
+        free(handles);
+    if (all != statuses && all != local_statuses)
+        free(all);
+    return err;
+}
+
+/* A freed request may still be active, but it can no longer be waited
+ * for, and MPI can reuse its handle */
+int MPI_Request_free(MPI_Request *request)
+{
+    double t0 = PMPI_Wtime();
+    MPI_Request handle = *request;
+    int err = PMPI_Request_free(request);
+    record(CALL_Request_free, 0.0, t0);
+    take_pending(handle, NULL);
+    return err;
+}
+
+/* Persistent requests, their communication is not in the matrix */
+
+int MPI_Start(MPI_Request *request)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Start(request);
+    record(CALL_Start, 0.0, t0);
+    return err;
+}
+
+int MPI_Startall(int count, MPI_Request requests[])
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Startall(count, requests);
+    record(CALL_Startall, 0.0, t0);
+    return err;
+}
+
+/* Collectives, the bytes are those in the send buffers of the rank */
+
+int MPI_Barrier(MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Barrier(comm);
+    record(CALL_Barrier, 0.0, t0);
+    return err;
+}
+
+int MPI_Ibarrier(MPI_Comm comm, MPI_Request *request)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Ibarrier(comm, request);
+    record(CALL_Ibarrier, 0.0, t0);
+    return err;
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root,
+              MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Bcast(buffer, count, datatype, root, comm);
+    record(CALL_Bcast, nbytes(count, datatype), t0);
+    return err;
+}
+
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+               MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm);
+    record(CALL_Reduce, nbytes(count, datatype), t0);
+    return err;
+}
+
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+                  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    record(CALL_Allreduce, nbytes(count, datatype), t0);
+    return err;
+}
+
+int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+               void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
+               MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                          recvtype, root, comm);
+    record(CALL_Gather, sendbuf == MPI_IN_PLACE ? 0.0 :
+           nbytes(sendcount, sendtype), t0);
+    return err;
+}
+
+int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
+                MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes = 0.0;
+    int rank, size, err;
+
+    PMPI_Comm_rank(comm, &rank);
+    if (rank == root) {
+        PMPI_Comm_size(comm, &size);
+        bytes = size * nbytes(sendcount, sendtype);
+    }
+    err = PMPI_Scatter(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                       recvtype, root, comm);
+    record(CALL_Scatter, bytes, t0);
+    return err;
+}
+
+int MPI_Allgather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                  void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                  MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Allgather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                             recvtype, comm);
+    record(CALL_Allgather, sendbuf == MPI_IN_PLACE ?
+           nbytes(recvcount, recvtype) : nbytes(sendcount, sendtype), t0);
+    return err;
+}
+
+int MPI_Alltoall(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                 void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                 MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes;
+    int size, err;
+
+    PMPI_Comm_size(comm, &size);
+    bytes = size * (sendbuf == MPI_IN_PLACE ? nbytes(recvcount, recvtype) :
+                    nbytes(sendcount, sendtype));
+    err = PMPI_Alltoall(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                        recvtype, comm);
+    record(CALL_Alltoall, bytes, t0);
+    return err;
+}
+
+int MPI_Alltoallv(const void *sendbuf, const int sendcounts[],
+                  const int sdispls[], MPI_Datatype sendtype, void *recvbuf,
+                  const int recvcounts[], const int rdispls[],
+                  MPI_Datatype recvtype, MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes = 0.0;
+    int i, size, err;
+
+    PMPI_Comm_size(comm, &size);
+    for (i = 0; i < size; i++)
+        bytes += sendbuf == MPI_IN_PLACE ? nbytes(recvcounts[i], recvtype) :
+                 nbytes(sendcounts[i], sendtype);
+    err = PMPI_Alltoallv(sendbuf, sendcounts, sdispls, sendtype, recvbuf,
+                         recvcounts, rdispls, recvtype, comm);
+    record(CALL_Alltoallv, bytes, t0);
+    return err;
+}
+
+int MPI_Alltoallw(const void *sendbuf, const int sendcounts[],
+                  const int sdispls[], const MPI_Datatype sendtypes[],
+                  void *recvbuf, const int recvcounts[], const int rdispls[],
+                  const MPI_Datatype recvtypes[], MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes;
+    int size, err;
+
+    PMPI_Comm_size(comm, &size);
+    bytes = sendbuf == MPI_IN_PLACE ? sum_bytes(size, recvcounts, recvtypes) :
+            sum_bytes(size, sendcounts, sendtypes);
+    err = PMPI_Alltoallw(sendbuf, sendcounts, sdispls, sendtypes, recvbuf,
+                         recvcounts, rdispls, recvtypes, comm);
+    record(CALL_Alltoallw, bytes, t0);
+    return err;
+}
+
+int MPI_Neighbor_alltoall(const void *sendbuf, int sendcount,
+                          MPI_Datatype sendtype, void *recvbuf, int recvcount,
+                          MPI_Datatype recvtype, MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    double bytes = outdegree(comm) * nbytes(sendcount, sendtype);
+    int err = PMPI_Neighbor_alltoall(sendbuf, sendcount, sendtype, recvbuf,
+                                     recvcount, recvtype, comm);
+    record(CALL_Neighbor_alltoall, bytes, t0);
+    return err;
+}
+
+int MPI_Neighbor_alltoallv(const void *sendbuf, const int sendcounts[],
+                           const int sdispls[], MPI_Datatype sendtype,
+                           void *recvbuf, const int recvcounts[],
+                           const int rdispls[], MPI_Datatype recvtype,
+                           MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime(), bytes = 0.0;
+    int i, n = outdegree(comm), err;
+
+    for (i = 0; i < n; i++)
+        bytes += nbytes(sendcounts[i], sendtype);
+    err = PMPI_Neighbor_alltoallv(sendbuf, sendcounts, sdispls, sendtype,
+                                  recvbuf, recvcounts, rdispls, recvtype,
+                                  comm);
+    record(CALL_Neighbor_alltoallv, bytes, t0);
+    return err;
+}
+
+int MPI_Neighbor_alltoallw(const void *sendbuf, const int sendcounts[],
+                           const MPI_Aint sdispls[],
+                           const MPI_Datatype sendtypes[], void *recvbuf,
+                           const int recvcounts[], const MPI_Aint rdispls[],
+                           const MPI_Datatype recvtypes[], MPI_Comm comm)
+{
+    double t0 = PMPI_Wtime();
+    double bytes = sum_bytes(outdegree(comm), sendcounts, sendtypes);
+    int err = PMPI_Neighbor_alltoallw(sendbuf, sendcounts, sdispls, sendtypes,
+                                      recvbuf, recvcounts, rdispls, recvtypes,
+                                      comm);
+    record(CALL_Neighbor_alltoallw, bytes, t0);
+    return err;
+}
+
+int MPI_Ineighbor_alltoall(const void *sendbuf, int sendcount,
+                           MPI_Datatype sendtype, void *recvbuf,
+                           int recvcount, MPI_Datatype recvtype,
+                           MPI_Comm comm, MPI_Request *request)
+{
+    double t0 = PMPI_Wtime();
+    double bytes = outdegree(comm) * nbytes(sendcount, sendtype);
+    int err = PMPI_Ineighbor_alltoall(sendbuf, sendcount, sendtype, recvbuf,
+                                      recvcount, recvtype, comm, request);
+    record(CALL_Ineighbor_alltoall, bytes, t0);
+    return err;
+}
+
+int MPI_Ineighbor_alltoallv(const void *sendbuf, const int sendcounts[],
+                            const int sdispls[], MPI_Datatype sendtype,
+                            void *recvbuf, const int recvcounts[],
+                            const int rdispls[], MPI_Datatype recvtype,
+                            MPI_Comm comm, MPI_Request *request)
+{
+    double t0 = PMPI_Wtime(), bytes = 0.0;
+    int i, n = outdegree(comm), err;
+
+    for (i = 0; i < n; i++)
+        bytes += nbytes(sendcounts[i], sendtype);
+    err = PMPI_Ineighbor_alltoallv(sendbuf, sendcounts, sdispls, sendtype,
+                                   recvbuf, recvcounts, rdispls, recvtype,
+                                   comm, request);
+    record(CALL_Ineighbor_alltoallv, bytes, t0);
+    return err;
+}
+
+int MPI_Ineighbor_alltoallw(const void *sendbuf, const int sendcounts[],
+                            const MPI_Aint sdispls[],
+                            const MPI_Datatype sendtypes[], void *recvbuf,
+                            const int recvcounts[], const MPI_Aint rdispls[],
+                            const MPI_Datatype recvtypes[], MPI_Comm comm,
+                            MPI_Request *request)
+{
+    double t0 = PMPI_Wtime();
+    double bytes = sum_bytes(outdegree(comm), sendcounts, sendtypes);
+    int err = PMPI_Ineighbor_alltoallw(sendbuf, sendcounts, sdispls,
+                                       sendtypes, recvbuf, recvcounts,
+                                       rdispls, recvtypes, comm, request);
+    record(CALL_Ineighbor_alltoallw, bytes, t0);
+    return err;
+}
+
+/* One-sided communication, puts and accumulates go to the matrix, and so
+ * do the atomic operations that change the target. Those with MPI_NO_OP
+ * only read, like gets. */
+
+int MPI_Put(const void *origin_addr, int origin_count,
+            MPI_Datatype origin_datatype, int target_rank,
+            MPI_Aint target_disp, int target_count,
+            MPI_Datatype target_datatype, MPI_Win win)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(origin_count, origin_datatype);
+    int err = PMPI_Put(origin_addr, origin_count, origin_datatype, target_rank,
+                       target_disp, target_count, target_datatype, win);
+    record(CALL_Put, bytes, t0);
+    record_peer(win_world_rank_of(win, target_rank), bytes, -1.0);
+    return err;
+}
+
+int MPI_Get(void *origin_addr, int origin_count, MPI_Datatype origin_datatype,
+            int target_rank, MPI_Aint target_disp, int target_count,
+            MPI_Datatype target_datatype, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Get(origin_addr, origin_count, origin_datatype, target_rank,
+                       target_disp, target_count, target_datatype, win);
+    record(CALL_Get, nbytes(origin_count, origin_datatype), t0);
+    return err;
+}
+
+int MPI_Accumulate(const void *origin_addr, int origin_count,
+                   MPI_Datatype origin_datatype, int target_rank,
+                   MPI_Aint target_disp, int target_count,
+                   MPI_Datatype target_datatype, MPI_Op op, MPI_Win win)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(origin_count, origin_datatype);
+    int err = PMPI_Accumulate(origin_addr, origin_count, origin_datatype,
+                              target_rank, target_disp, target_count,
+                              target_datatype, op, win);
+    record(CALL_Accumulate, bytes, t0);
+    record_peer(win_world_rank_of(win, target_rank), bytes, -1.0);
+    return err;
+}
+
+int MPI_Get_accumulate(const void *origin_addr, int origin_count,
+                       MPI_Datatype origin_datatype, void *result_addr,
+                       int result_count, MPI_Datatype result_datatype,
+                       int target_rank, MPI_Aint target_disp,
+                       int target_count, MPI_Datatype target_datatype,
+                       MPI_Op op, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    double bytes = op == MPI_NO_OP ? nbytes(result_count, result_datatype)
+                   : nbytes(origin_count, origin_datatype);
+    int err = PMPI_Get_accumulate(origin_addr, origin_count, origin_datatype,
+                                  result_addr, result_count, result_datatype,
+                                  target_rank, target_disp, target_count,
+                                  target_datatype, op, win);
+    record(CALL_Get_accumulate, bytes, t0);
+    if (op != MPI_NO_OP)
+        record_peer(win_world_rank_of(win, target_rank), bytes, -1.0);
+    return err;
+}
+
+int MPI_Fetch_and_op(const void *origin_addr, void *result_addr,
+                     MPI_Datatype datatype, int target_rank,
+                     MPI_Aint target_disp, MPI_Op op, MPI_Win win)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(1, datatype);
+    int err = PMPI_Fetch_and_op(origin_addr, result_addr, datatype,
+                                target_rank, target_disp, op, win);
+    record(CALL_Fetch_and_op, bytes, t0);
+    if (op != MPI_NO_OP)
+        record_peer(win_world_rank_of(win, target_rank), bytes, -1.0);
+    return err;
+}
+
+int MPI_Compare_and_swap(const void *origin_addr, const void *compare_addr,
+                         void *result_addr, MPI_Datatype datatype,
+                         int target_rank, MPI_Aint target_disp, MPI_Win win)
+{
+    double t0 = PMPI_Wtime(), bytes = nbytes(1, datatype);
+    int err = PMPI_Compare_and_swap(origin_addr, compare_addr, result_addr,
+                                    datatype, target_rank, target_disp, win);
+    record(CALL_Compare_and_swap, bytes, t0);
+    record_peer(win_world_rank_of(win, target_rank), bytes, -1.0);
+    return err;
+}
+
+int MPI_Win_fence(int assert, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_fence(assert, win);
+    record(CALL_Win_fence, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_post(MPI_Group group, int assert, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_post(group, assert, win);
+    record(CALL_Win_post, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_start(MPI_Group group, int assert, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_start(group, assert, win);
+    record(CALL_Win_start, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_complete(MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_complete(win);
+    record(CALL_Win_complete, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_wait(MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_wait(win);
+    record(CALL_Win_wait, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_lock(int lock_type, int rank, int assert, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_lock(lock_type, rank, assert, win);
+    record(CALL_Win_lock, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_unlock(int rank, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_unlock(rank, win);
+    record(CALL_Win_unlock, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_lock_all(int assert, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_lock_all(assert, win);
+    record(CALL_Win_lock_all, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_unlock_all(MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_unlock_all(win);
+    record(CALL_Win_unlock_all, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_flush(int rank, MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_flush(rank, win);
+    record(CALL_Win_flush, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_flush_all(MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_flush_all(win);
+    record(CALL_Win_flush_all, 0.0, t0);
+    return err;
+}
+
+int MPI_Win_sync(MPI_Win win)
+{
+    double t0 = PMPI_Wtime();
+    int err = PMPI_Win_sync(win);
+    record(CALL_Win_sync, 0.0, t0);
+    return err;
+}
+
+/* Report */
+
+/* Entry of the traffic matrix */
+typedef struct {
+    double rank, peer, messages, bytes, blocked;
+} link_entry;
+
+static int by_bytes(const void *a, const void *b)
+{
+    double x = ((const link_entry *) a)->bytes;
+    double y = ((const link_entry *) b)->bytes;
+    return (x < y) - (x > y);
+}
+
+static FILE *open_output(const char *suffix)
+{
+    const char *prefix = getenv("MPIPROF_PREFIX");
+    char filename[256];
+    FILE *fp;
+
+    snprintf(filename, sizeof(filename), "%s-%s.csv",
+             prefix != NULL ? prefix : "mpiprof", suffix);
+    fp = fopen(filename, "w");
+    if (fp == NULL)
+        fprintf(stderr, "mpiprof: cannot open %s\n", filename);
+    return fp;
+}
+
+/* Totals over the ranks, and the time of the least and most busy rank */
+static void print_summary(double elapsed)
+{
+    double stats[3 * NCALLS], totals[3 * NCALLS], mins[NCALLS];
+    struct { double value; int rank; } times[NCALLS + 1], maxs[NCALLS + 1];
+    double mpi_time = 0.0, mpi_min, mpi_sum;
+    int i;
+
+    for (i = 0; i < NCALLS; i++) {
+        stats[3 * i] = calls[i].calls;
+        stats[3 * i + 1] = calls[i].bytes;
+        stats[3 * i + 2] = calls[i].time;
+        times[i].value = calls[i].time;
+        times[i].rank = world_rank;
+        mpi_time += calls[i].time;
+    }
+    times[NCALLS].value = mpi_time;
+    times[NCALLS].rank = world_rank;
+
+    PMPI_Reduce(stats, totals, 3 * NCALLS, MPI_DOUBLE, MPI_SUM, 0,
+                MPI_COMM_WORLD);
+    for (i = 0; i < NCALLS; i++)
+        mins[i] = calls[i].time;
+    PMPI_Reduce(world_rank == 0 ? MPI_IN_PLACE : mins, mins, NCALLS,
+                MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    PMPI_Reduce(&mpi_time, &mpi_min, 1, MPI_DOUBLE, MPI_MIN, 0,
+                MPI_COMM_WORLD);
+    PMPI_Reduce(&mpi_time, &mpi_sum, 1, MPI_DOUBLE, MPI_SUM, 0,
+                MPI_COMM_WORLD);
+    PMPI_Reduce(times, maxs, NCALLS + 1, MPI_DOUBLE_INT, MPI_MAXLOC, 0,
+                MPI_COMM_WORLD);
+    if (world_rank != 0)
+        return;
+
+    fprintf(stderr, "mpiprof: %d ranks, %.3f s on rank 0, MPI time min "
+            "%.3f avg %.3f max %.3f s (rank %d), imbalance max/avg %.2f\n",
+            world_size, elapsed, mpi_min, mpi_sum / world_size,
+            maxs[NCALLS].value, maxs[NCALLS].rank,
+            mpi_sum > 0.0 ? maxs[NCALLS].value * world_size / mpi_sum : 1.0);
+    fprintf(stderr, "%-24s %12s %12s %10s %10s %10s %8s\n", "call", "calls",
+            "bytes", "min (s)", "avg (s)", "max (s)", "max rank");
+    for (i = 0; i < NCALLS; i++) {
+        if (totals[3 * i] == 0.0)
+            continue;
+        fprintf(stderr, "%-24s %12.0f %12.4g %10.4f %10.4f %10.4f %8d\n",
+                call_names[i], totals[3 * i], totals[3 * i + 1], mins[i],
+                totals[3 * i + 2] / world_size, maxs[i].value, maxs[i].rank);
+    }
+}
+
+/* One row per rank and call */
+static void write_calls(void)
+{
+    double stats[3 * NCALLS], *all = NULL;
+    FILE *fp;
+    int i, r;
+
+    for (i = 0; i < NCALLS; i++) {
+        stats[3 * i] = calls[i].calls;
+        stats[3 * i + 1] = calls[i].bytes;
+        stats[3 * i + 2] = calls[i].time;
+    }
+    if (world_rank == 0)
+        all = malloc((size_t) world_size * 3 * NCALLS * sizeof(double));
+    PMPI_Gather(stats, 3 * NCALLS, MPI_DOUBLE, all, 3 * NCALLS, MPI_DOUBLE, 0,
+                MPI_COMM_WORLD);
+    if (world_rank != 0)
+        return;
+
+    fp = open_output("calls");
+    if (fp != NULL) {
+        fprintf(fp, "rank,call,calls,bytes,time\n");
+        for (r = 0; r < world_size; r++)
+            for (i = 0; i < NCALLS; i++) {
+                double *s = all + (size_t) r * 3 * NCALLS + 3 * i;
+                if (s[0] > 0.0)
+                    fprintf(fp, "%d,%s,%.0f,%.0f,%.9f\n", r, call_names[i],
+                            s[0], s[1], s[2]);
+            }
+        fclose(fp);
+    }
+    free(all);
+}
+
+/* Nonzero entries of the traffic matrix, and the largest links */
+static void write_matrix(void)
+{
+    link_entry *local, *all = NULL;
+    int i, n = 0, total = 0, *counts = NULL, *displs = NULL;
+    FILE *fp;
+
+    local = malloc(world_size * sizeof(link_entry));
+    for (i = 0; i < world_size; i++)
+        if (peers[i].messages > 0.0 || peers[i].blocked > 0.0) {
+            local[n].rank = world_rank;
+            local[n].peer = i;
+            local[n].messages = peers[i].messages;
+            local[n].bytes = peers[i].bytes;
+            local[n].blocked = peers[i].blocked;
+            n++;
+        }
+
+    /* The entries are sent as five doubles */
+    n *= 5;
+    if (world_rank == 0) {
+        counts = malloc(world_size * sizeof(int));
+        displs = malloc(world_size * sizeof(int));
+    }
+    PMPI_Gather(&n, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (world_rank == 0) {
+        for (i = 0; i < world_size; i++) {
+            displs[i] = total;
+            total += counts[i];
+        }
+        all = malloc((total > 0 ? total : 1) * sizeof(double));
+    }
+    PMPI_Gatherv(local, n, MPI_DOUBLE, all, counts, displs, MPI_DOUBLE, 0,
+                 MPI_COMM_WORLD);
+    free(local);
+    if (world_rank != 0)
+        return;
+
+    total /= 5;
+    fp = open_output("matrix");
+    if (fp != NULL) {
+        fprintf(fp, "rank,peer,messages,bytes,blocked_time\n");
+        for (i = 0; i < total; i++)
+            fprintf(fp, "%.0f,%.0f,%.0f,%.0f,%.9f\n", all[i].rank,
+                    all[i].peer, all[i].messages, all[i].bytes,
+                    all[i].blocked);
+        fclose(fp);
+    }
+
+    qsort(all, total, sizeof(link_entry), by_bytes);
+    if (total > 0 && all[0].bytes > 0.0)
+        fprintf(stderr, "Largest links:\n%8s %8s %12s %12s %12s\n", "rank",
+                "peer", "messages", "bytes", "blocked (s)");
+    for (i = 0; i < total && i < MAX_LINKS && all[i].bytes > 0.0; i++)
+        fprintf(stderr, "%8.0f %8.0f %12.0f %12.4g %12.4f\n", all[i].rank,
+                all[i].peer, all[i].messages, all[i].bytes, all[i].blocked);
+    free(all);
+    free(counts);
+    free(displs);
+}
+
+int MPI_Finalize(void)
+{
+    double elapsed = PMPI_Wtime() - start_time;
+
+    recording = 0;
+    print_summary(elapsed);
+    write_calls();
+    write_matrix();
+    free(peers);
+    free(pending);
+    PMPI_Comm_free_keyval(&comm_keyval);
+    PMPI_Win_free_keyval(&win_keyval);
+    return PMPI_Finalize();
+}
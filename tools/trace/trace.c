@@ -0,0 +1,431 @@
+/* Timeline tracing of MPI programs.
+ *
+ * Every rank records begin and end events of the MPI calls wrapped below
+ * (through the PMPI profiling interface) and of the regions marked with
+ * trace_begin() and trace_end(), with the time of a monotonic clock. The
+ * events go to a ring buffer of TRACE_EVENTS events (default 2^20) per
+ * rank, which the threads of the rank fill without locks; when it is full
+ * the oldest events are overwritten.
+ *
+ * The clocks of the ranks are aligned to that of rank 0 by a ping-pong
+ * with rank 0 in MPI_Init and again in MPI_Finalize: the offset is taken
+ * from the round trip with the smallest duration, and the drift between
+ * the two estimates is interpolated linearly. In MPI_Finalize the ranks
+ * send their events in chunks to rank 0, one rank after the other, and
+ * rank 0 writes them to the file TRACE_FILE (default trace.json) in the
+ * Chrome trace event format, with one process per rank and one thread per
+ * thread of the rank. The file opens in chrome://tracing and
+ * https://ui.perfetto.dev. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <mpi.h>
+
+#include "trace.h"
+
+#define DEFAULT_EVENTS (1 << 20)
+#define SYNC_ROUNDS 20
+#define CHUNK_BYTES (1 << 20)
+#define MAX_EVENT_BYTES 256
+
+typedef struct {
+    const char *name;
+    int64_t time;               /* Nanoseconds of the local clock */
+    int thread;
+    char type;                  /* 'B' or 'E' */
+} trace_event;
+
+static trace_event *events = NULL;
+static uint64_t capacity, recorded;
+static int next_thread;
+static __thread int thread_id = -1;
+
+/* Offset to the clock of rank 0 at two local times */
+static int64_t sync_time[2], sync_offset[2];
+static MPI_Comm sync_comm = MPI_COMM_NULL;
+
+static int64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(const char *name, char type)
+{
+    uint64_t n;
+
+    if (events == NULL)
+        return;
+    if (thread_id < 0)
+        thread_id = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    n = __atomic_fetch_add(&recorded, 1, __ATOMIC_RELAXED) & (capacity - 1);
+    events[n].name = name;
+    events[n].thread = thread_id;
+    events[n].type = type;
+    events[n].time = clock_ns();
+}
+
+void trace_begin(const char *name)
+{
+    record(name, 'B');
+}
+
+void trace_end(const char *name)
+{
+    record(name, 'E');
+}
+
+/* Ping-pong of every rank in turn with rank 0, which replies with its
+ * clock. Sets the offset of the local clock at the time of the call. */
+static void synchronize(int k)
+{
+    int rank, size, r, i;
+    int64_t t0, t1, remote, best = INT64_MAX;
+
+    PMPI_Comm_rank(sync_comm, &rank);
+    PMPI_Comm_size(sync_comm, &size);
+    sync_time[k] = clock_ns();
+    sync_offset[k] = 0;
+    for (r = 1; r < size; r++) {
+        if (rank == 0) {
+            for (i = 0; i < SYNC_ROUNDS; i++) {
+                PMPI_Recv(NULL, 0, MPI_BYTE, r, 0, sync_comm,
+                          MPI_STATUS_IGNORE);
+                remote = clock_ns();
+                PMPI_Send(&remote, 1, MPI_INT64_T, r, 0, sync_comm);
+            }
+        } else if (rank == r) {
+            for (i = 0; i < SYNC_ROUNDS; i++) {
+                t0 = clock_ns();
+                PMPI_Send(NULL, 0, MPI_BYTE, 0, 0, sync_comm);
+                PMPI_Recv(&remote, 1, MPI_INT64_T, 0, 0, sync_comm,
+                          MPI_STATUS_IGNORE);
+                t1 = clock_ns();
+                if (t1 - t0 < best) {
+                    best = t1 - t0;
+                    sync_time[k] = t0 + (t1 - t0) / 2;
+                    sync_offset[k] = remote - sync_time[k];
+                }
+            }
+        }
+    }
+}
+
+static void start(void)
+{
+    char *value = getenv("TRACE_EVENTS");
+    uint64_t requested = value != NULL ? strtoull(value, NULL, 10) : 0;
+
+    /* A power of two, so that the ring index is a mask */
+    capacity = 1;
+    while (capacity < (requested > 0 ? requested : DEFAULT_EVENTS))
+        capacity *= 2;
+    PMPI_Comm_dup(MPI_COMM_WORLD, &sync_comm);
+    synchronize(0);
+    recorded = 0;
+    next_thread = 0;
+    events = malloc(capacity * sizeof(trace_event));
+}
+
+/* Time in microseconds since MPI_Init on rank 0 */
+static double aligned_us(int64_t time, int64_t origin)
+{
+    double drift = 0.0;
+
+    if (sync_time[1] != sync_time[0])
+        drift = (double) (sync_offset[1] - sync_offset[0]) *
+                (time - sync_time[0]) / (sync_time[1] - sync_time[0]);
+    return (time + sync_offset[0] + drift - origin) * 1.0e-3;
+}
+
+/* Sends the events of this rank as JSON text to rank 0, or writes them
+ * if this is rank 0, in chunks, ending with an empty chunk */
+static void send_events(FILE *fp, int64_t origin)
+{
+    char *chunk = malloc(CHUNK_BYTES + MAX_EVENT_BYTES);
+    uint64_t first = 0, i;
+    int rank, n;
+
+    PMPI_Comm_rank(sync_comm, &rank);
+    if (recorded > capacity) {
+        first = recorded - capacity;
+        fprintf(stderr, "trace: rank %d lost the first %llu events, set "
+                "TRACE_EVENTS larger than %llu\n", rank,
+                (unsigned long long) first, (unsigned long long) recorded);
+    }
+    /* The first entry of the file is the name of rank 0 */
+    n = snprintf(chunk, MAX_EVENT_BYTES, "%s{\"name\":\"process_name\","
+                 "\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d\"}}",
+                 rank == 0 ? "" : ",\n", rank, rank);
+    for (i = first; i <= recorded; i++) {
+        if (n > CHUNK_BYTES || i == recorded) {
+            if (rank != 0)
+                PMPI_Send(chunk, n, MPI_CHAR, 0, 0, sync_comm);
+            else if (fp != NULL)
+                fwrite(chunk, 1, n, fp);
+            n = 0;
+        }
+        if (i < recorded) {
+            trace_event *e = &events[i & (capacity - 1)];
+            n += snprintf(chunk + n, MAX_EVENT_BYTES,
+                          ",\n{\"name\":\"%.100s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                          "\"pid\":%d,\"tid\":%d}", e->name, e->type,
+                          aligned_us(e->time, origin), rank, e->thread);
+        }
+    }
+    if (rank != 0)
+        PMPI_Send(chunk, 0, MPI_CHAR, 0, 0, sync_comm);
+    free(chunk);
+}
+
+/* Rank 0 receives the chunks of each rank in turn */
+static void receive_events(FILE *fp, int source)
+{
+    char *chunk = malloc(CHUNK_BYTES + MAX_EVENT_BYTES);
+    MPI_Status status;
+    int n;
+
+    do {
+        PMPI_Recv(chunk, CHUNK_BYTES + MAX_EVENT_BYTES, MPI_CHAR, source, 0,
+                  sync_comm, &status);
+        PMPI_Get_count(&status, MPI_CHAR, &n);
+        if (fp != NULL)
+            fwrite(chunk, 1, n, fp);
+    } while (n > 0);
+    free(chunk);
+}
+
+static void finish(void)
+{
+    char *filename = getenv("TRACE_FILE");
+    int64_t origin;
+    int rank, size, r;
+    FILE *fp = NULL;
+
+    synchronize(1);
+    PMPI_Comm_rank(sync_comm, &rank);
+    PMPI_Comm_size(sync_comm, &size);
+    origin = sync_time[0] + sync_offset[0];
+    PMPI_Bcast(&origin, 1, MPI_INT64_T, 0, sync_comm);
+
+    if (rank == 0) {
+        if (filename == NULL)
+            filename = "trace.json";
+        fp = fopen(filename, "w");
+        if (fp == NULL)
+            fprintf(stderr, "trace: cannot open %s\n", filename);
+        else
+            fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        send_events(fp, origin);
+        for (r = 1; r < size; r++)
+            receive_events(fp, r);
+        if (fp != NULL) {
+            fprintf(fp, "\n]}\n");
+            fclose(fp);
+        }
+    } else {
+        send_events(NULL, origin);
+    }
+
+    free(events);
+    events = NULL;
+    PMPI_Comm_free(&sync_comm);
+}
+
+/* Wrappers */
+
+int MPI_Init(int *argc, char ***argv)
+{
+    int err = PMPI_Init(argc, argv);
+    start();
+    return err;
+}
+
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided)
+{
+    int err = PMPI_Init_thread(argc, argv, required, provided);
+    start();
+    return err;
+}
+
+int MPI_Finalize(void)
+{
+    finish();
+    return PMPI_Finalize();
+}
+
+#define TRACED(name, call) \
+    int err; \
+    record(name, 'B'); \
+    err = call; \
+    record(name, 'E'); \
+    return err;
+
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest,
+             int tag, MPI_Comm comm)
+{
+    TRACED("MPI_Send", PMPI_Send(buf, count, datatype, dest, tag, comm))
+}
+
+int MPI_Ssend(const void *buf, int count, MPI_Datatype datatype, int dest,
+              int tag, MPI_Comm comm)
+{
+    TRACED("MPI_Ssend", PMPI_Ssend(buf, count, datatype, dest, tag, comm))
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source,
+             int tag, MPI_Comm comm, MPI_Status *status)
+{
+    TRACED("MPI_Recv",
+           PMPI_Recv(buf, count, datatype, source, tag, comm, status))
+}
+
+int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                 int dest, int sendtag, void *recvbuf, int recvcount,
+                 MPI_Datatype recvtype, int source, int recvtag,
+                 MPI_Comm comm, MPI_Status *status)
+{
+    TRACED("MPI_Sendrecv",
+           PMPI_Sendrecv(sendbuf, sendcount, sendtype, dest, sendtag,
+                         recvbuf, recvcount, recvtype, source, recvtag, comm,
+                         status))
+}
+
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    TRACED("MPI_Probe", PMPI_Probe(source, tag, comm, status))
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+    TRACED("MPI_Wait", PMPI_Wait(request, status))
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[])
+{
+    TRACED("MPI_Waitall", PMPI_Waitall(count, requests, statuses))
+}
+
+int MPI_Waitany(int count, MPI_Request requests[], int *index,
+                MPI_Status *status)
+{
+    TRACED("MPI_Waitany", PMPI_Waitany(count, requests, index, status))
+}
+
+int MPI_Barrier(MPI_Comm comm)
+{
+    TRACED("MPI_Barrier", PMPI_Barrier(comm))
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root,
+              MPI_Comm comm)
+{
+    TRACED("MPI_Bcast", PMPI_Bcast(buffer, count, datatype, root, comm))
+}
+
+int MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+               MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm comm)
+{
+    TRACED("MPI_Reduce",
+           PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm))
+}
+
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+                  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    TRACED("MPI_Allreduce",
+           PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm))
+}
+
+int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+               void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
+               MPI_Comm comm)
+{
+    TRACED("MPI_Gather",
+           PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                       recvtype, root, comm))
+}
+
+int MPI_Allgather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                  void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                  MPI_Comm comm)
+{
+    TRACED("MPI_Allgather",
+           PMPI_Allgather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                          recvtype, comm))
+}
+
+int MPI_Alltoall(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                 void *recvbuf, int recvcount, MPI_Datatype recvtype,
+                 MPI_Comm comm)
+{
+    TRACED("MPI_Alltoall",
+           PMPI_Alltoall(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                         recvtype, comm))
+}
+
+int MPI_Alltoallv(const void *sendbuf, const int sendcounts[],
+                  const int sdispls[], MPI_Datatype sendtype, void *recvbuf,
+                  const int recvcounts[], const int rdispls[],
+                  MPI_Datatype recvtype, MPI_Comm comm)
+{
+    TRACED("MPI_Alltoallv",
+           PMPI_Alltoallv(sendbuf, sendcounts, sdispls, sendtype, recvbuf,
+                          recvcounts, rdispls, recvtype, comm))
+}
+
+int MPI_Neighbor_alltoall(const void *sendbuf, int sendcount,
+                          MPI_Datatype sendtype, void *recvbuf, int recvcount,
+                          MPI_Datatype recvtype, MPI_Comm comm)
+{
+    TRACED("MPI_Neighbor_alltoall",
+           PMPI_Neighbor_alltoall(sendbuf, sendcount, sendtype, recvbuf,
+                                  recvcount, recvtype, comm))
+}
+
+int MPI_Neighbor_alltoallv(const void *sendbuf, const int sendcounts[],
+                           const int sdispls[], MPI_Datatype sendtype,
+                           void *recvbuf, const int recvcounts[],
+                           const int rdispls[], MPI_Datatype recvtype,
+                           MPI_Comm comm)
+{
+    TRACED("MPI_Neighbor_alltoallv",
+           PMPI_Neighbor_alltoallv(sendbuf, sendcounts, sdispls, sendtype,
+                                   recvbuf, recvcounts, rdispls, recvtype,
+                                   comm))
+}
+
+int MPI_Win_fence(int assert, MPI_Win win)
+{
+    TRACED("MPI_Win_fence", PMPI_Win_fence(assert, win))
+}
+
+int MPI_Win_start(MPI_Group group, int assert, MPI_Win win)
+{
+    TRACED("MPI_Win_start", PMPI_Win_start(group, assert, win))
+}
+
+int MPI_Win_complete(MPI_Win win)
+{
+    TRACED("MPI_Win_complete", PMPI_Win_complete(win))
+}
+
+int MPI_Win_wait(MPI_Win win)
+{
+    TRACED("MPI_Win_wait", PMPI_Win_wait(win))
+}
+
+int MPI_Win_flush(int rank, MPI_Win win)
+{
+    TRACED("MPI_Win_flush", PMPI_Win_flush(rank, win))
+}
+
+int MPI_Win_unlock(int rank, MPI_Win win)
+{
+    TRACED("MPI_Win_unlock", PMPI_Win_unlock(rank, win))
+}
@@ -0,0 +1,22 @@
+/* Timeline tracing of MPI programs in the Chrome trace format, see
+ * trace.c. */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Begin and end of a region on the calling thread. The name must stay
+ * valid until MPI_Finalize, e.g. a string literal. Outside MPI_Init and
+ * MPI_Finalize the calls do nothing. */
+void trace_begin(const char *name);
+
+void trace_end(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __TRACE_H__ */